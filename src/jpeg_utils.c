@@ -28,6 +28,7 @@
 #include <dlfcn.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include "utils.h"
 
 /* V4L2 format constants */
@@ -166,9 +167,10 @@ int jpeg_decode_to_gray_scaled(unsigned char *jpeg_data, int jpeg_size, int scal
         return -1;
     }
     
-    /* Get dimensions and subsampling from JPEG header */
-    int jpeg_width = 0, jpeg_height = 0, subsamp = 0;
-    if (tjDecompressHeader2(handle, jpeg_data, jpeg_size, &jpeg_width, &jpeg_height, &subsamp) != 0) {
+    /* Only parse the header if the caller has no indexed dimensions */
+    int jpeg_width = known_width, jpeg_height = known_height, subsamp = 0;
+    if ((known_width <= 0 || known_height <= 0) &&
+        tjDecompressHeader2(handle, jpeg_data, jpeg_size, &jpeg_width, &jpeg_height, &subsamp) != 0) {
         return -1;
     }
     
@@ -226,9 +228,10 @@ int jpeg_decode_to_y_component(unsigned char *jpeg_data, int jpeg_size, int scal
         return -1;
     }
 
-    /* Get dimensions and subsampling from JPEG header */
-    int jpeg_width = 0, jpeg_height = 0, subsamp = 0;
-    if (tjDecompressHeader2(handle, jpeg_data, jpeg_size, &jpeg_width, &jpeg_height, &subsamp) != 0) {
+    /* Only parse the header if the caller has no indexed dimensions */
+    int jpeg_width = known_width, jpeg_height = known_height, subsamp = 0;
+    if ((known_width <= 0 || known_height <= 0) &&
+        tjDecompressHeader2(handle, jpeg_data, jpeg_size, &jpeg_width, &jpeg_height, &subsamp) != 0) {
         return -1;
     }
 
@@ -360,120 +363,14 @@ Return Value: None (tables cached in global variables)
 ******************************************************************************/
 void rtpjpeg_cache_qtables_from_jpeg(const uint8_t *p, size_t sz)
 {
-    /* Reset cache */
-    g_have_luma = 0;
-    g_have_chroma = 0;
-    g_qt_precision = 0;
-    
-    if (!p || sz < 4) return;
-    
-    /* Find SOI marker */
-    if (p[0] != 0xFF || p[1] != 0xD8) return; /* Not a JPEG */
-    
-    size_t i = 2; /* Start after SOI */
-    
-    /* Parse JPEG segments until SOS */
-    while (i + 3 < sz) {
-        /* Skip padding bytes (0xFF) */
-        if (p[i] != 0xFF) {
-            i++;
-            continue;
-        }
-        
-        /* Skip multiple 0xFF bytes */
-        while (i < sz && p[i] == 0xFF) i++;
-        if (i >= sz) break;
-        
-        uint8_t marker = p[i++];
-        
-        /* SOS reached - stop parsing */
-        if (marker == 0xDA) break;
-        
-        /* RSTn markers - no length field */
-        if (marker >= 0xD0 && marker <= 0xD7) continue;
-        
-        /* Need at least 2 bytes for segment length */
-        if (i + 1 >= sz) break;
-        
-        /* Read segment length (big-endian) */
-        uint16_t seglen = ((uint16_t)p[i] << 8) | (uint16_t)p[i + 1];
-        i += 2;
-        
-        if (seglen < 2 || i + (size_t)(seglen - 2) > sz) break;
-        
-        /* DQT marker (0xDB) */
-        if (marker == 0xDB) {
-            /* Parse DQT segment - may contain multiple tables */
-            size_t off = 0;
-            while (off < (size_t)(seglen - 2)) {
-                if (i + off >= sz) break;
-                
-                /* Read Pq (precision) and Tq (table ID) */
-                uint8_t pq_tq = p[i + off++];
-                uint8_t pq = (pq_tq >> 4) & 0x0F;  /* Precision: 0=8-bit, 1=16-bit */
-                uint8_t tq = pq_tq & 0x0F;         /* Table ID: 0=luma, 1=chroma */
-                
-                /* Handle both 8-bit and 16-bit tables */
-                if (pq == 0) {
-                    /* 8-bit table: 64 bytes */
-                    size_t need = 64;
-                    if (off + need > (size_t)(seglen - 2)) break;
-                    
-                    uint8_t *dst = NULL;
-                    if (tq == 0) {
-                        dst = g_qt_luma;
-                        g_have_luma = 1;
-                    } else if (tq == 1) {
-                        dst = g_qt_chroma;
-                        g_have_chroma = 1;
-                    }
-                    
-                    if (dst) {
-                        /* Copy 8-bit table */
-                        simd_memcpy(dst, p + i + off, 64);
-                        /* CRITICAL: Sanitize immediately after copy - ensure no zeros */
-                        for (int k = 0; k < 64; k++) {
-                            if (dst[k] == 0) dst[k] = 1;
-                        }
-                        /* Sanitize: replace zeros with 1 (double check) */
-                        sanitize_qt_8bit(dst);
-                    }
-                    off += need;
-                } else {
-                    /* 16-bit table: 128 bytes -> convert to 8-bit */
-                    size_t need = 128;
-                    if (off + need > (size_t)(seglen - 2)) break;
-                    
-                    uint8_t *dst = NULL;
-                    if (tq == 0) {
-                        dst = g_qt_luma;
-                        g_have_luma = 1;
-                    } else if (tq == 1) {
-                        dst = g_qt_chroma;
-                        g_have_chroma = 1;
-                    }
-                    
-                    if (dst) {
-                        /* Convert 16-bit to 8-bit: read 16-bit values and normalize */
-                        const uint8_t *src_16bit = p + i + off;
-                        for (int k = 0; k < 64; k++) {
-                            uint16_t v16 = ((uint16_t)src_16bit[2*k] << 8) | (uint16_t)src_16bit[2*k + 1];
-                            dst[k] = qt_to_8bit(v16);
-                            /* CRITICAL: Ensure no zeros after conversion */
-                            if (dst[k] == 0) dst[k] = 1;
-                        }
-                        /* Sanitize: replace zeros with 1 (shouldn't be any after qt_to_8bit, but just in case) */
-                        sanitize_qt_8bit(dst);
-                    }
-                    g_qt_precision = 1; /* Remember that source had 16-bit */
-                    off += need;
-                }
-            }
-        }
-        
-        /* Move to next segment */
-        i += (seglen - 2);
-    }
+    jpeg_index idx;
+
+    jpeg_index_frame(p, sz, &idx);
+    simd_memcpy(g_qt_luma, idx.qt_luma, 64);
+    simd_memcpy(g_qt_chroma, idx.qt_chroma, 64);
+    g_have_luma = idx.have_luma;
+    g_have_chroma = idx.have_chroma;
+    g_qt_precision = idx.qt_precision;
 }
 
 /******************************************************************************
@@ -744,6 +641,264 @@ int jpeg_strip_to_rtp(const unsigned char *jfif, size_t jfif_sz,
     return 0;
 }
 
+/******************************************************************************
+Description.: Decompress handle private to the calling thread. TurboJPEG
+              handles must not be shared between threads, and decodes for
+              different consumers may now run concurrently.
+Input Value.: None
+Return Value: TurboJPEG decompress handle or NULL
+******************************************************************************/
+static pthread_key_t thread_decompress_key;
+static pthread_once_t thread_decompress_once = PTHREAD_ONCE_INIT;
+
+static void destroy_thread_handle(void *handle)
+{
+    tjDestroy((tjhandle)handle);
+}
+
+static void create_thread_decompress_key(void)
+{
+    pthread_key_create(&thread_decompress_key, destroy_thread_handle);
+}
+
+static tjhandle get_thread_decompress_handle(void)
+{
+    tjhandle handle;
+
+    pthread_once(&thread_decompress_once, create_thread_decompress_key);
+    handle = pthread_getspecific(thread_decompress_key);
+    if (!handle) {
+        handle = tjInitDecompress();
+        if (handle)
+            pthread_setspecific(thread_decompress_key, handle);
+    }
+    return handle;
+}
+
+/******************************************************************************
+Description.: Compress handle private to the calling thread. All encodes
+              through it use the same subsampling per pixel format, so the
+              handle reuse problem of compress_rgb_to_jpeg() does not apply.
+Input Value.: None
+Return Value: TurboJPEG compress handle or NULL
+******************************************************************************/
+static pthread_key_t thread_compress_key;
+static pthread_once_t thread_compress_once = PTHREAD_ONCE_INIT;
+
+static void create_thread_compress_key(void)
+{
+    pthread_key_create(&thread_compress_key, destroy_thread_handle);
+}
+
+static tjhandle get_thread_compress_handle(void)
+{
+    tjhandle handle;
+
+    pthread_once(&thread_compress_once, create_thread_compress_key);
+    handle = pthread_getspecific(thread_compress_key);
+    if (!handle) {
+        handle = tjInitCompress();
+        if (handle)
+            pthread_setspecific(thread_compress_key, handle);
+    }
+    return handle;
+}
+
+/******************************************************************************
+Description.: Compute the output size of a scaled decode, using the largest
+              TurboJPEG scaling factor that does not exceed 1/scale
+Input Value.: width, height: JPEG dimensions
+              scale: downscale divisor, 1 = full size
+              scaled_width, scaled_height: output
+Return Value: 0 if ok, -1 on error
+******************************************************************************/
+int jpeg_scaled_size(int width, int height, int scale, int *scaled_width, int *scaled_height)
+{
+    tjscalingfactor *factors, best = {1, 1};
+    int count = 0;
+
+    if (width <= 0 || height <= 0 || !scaled_width || !scaled_height) return -1;
+    if (scale < 1) scale = 1;
+
+    factors = tjGetScalingFactors(&count);
+    if (factors && scale > 1) {
+        best.num = 0;
+        for (int i = 0; i < count; i++) {
+            if (factors[i].num * scale > factors[i].denom) continue;
+            if (best.num == 0 || factors[i].num * best.denom > best.num * factors[i].denom)
+                best = factors[i];
+        }
+    }
+
+    if (best.num == 0) {
+        /* no exact factor, tjDecompress2 picks the closest smaller one */
+        *scaled_width = width / scale;
+        *scaled_height = height / scale;
+    } else {
+        *scaled_width = TJSCALED(width, best);
+        *scaled_height = TJSCALED(height, best);
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: Decompress JPEG into a caller provided buffer at a size from
+              jpeg_scaled_size(), safe to call from several threads at once
+Input Value.: jpeg_data, jpeg_size: JPEG frame
+              dst: output, width * height * (1 for TJPF_GRAY, 3 otherwise)
+              width, height: scaled dimensions
+              pixfmt: TJPF_GRAY, TJPF_RGB or TJPF_BGR
+Return Value: 0 if ok, -1 on error
+******************************************************************************/
+int jpeg_decode_scaled(const unsigned char *jpeg_data, int jpeg_size, unsigned char *dst,
+                       int width, int height, int pixfmt)
+{
+    tjhandle handle;
+
+    if (!jpeg_data || jpeg_size <= 0 || !dst || width <= 0 || height <= 0) return -1;
+    if (pixfmt != TJPF_GRAY && pixfmt != TJPF_RGB && pixfmt != TJPF_BGR) return -1;
+
+    handle = get_thread_decompress_handle();
+    if (!handle) return -1;
+
+    return tjDecompress2(handle, jpeg_data, (unsigned long)jpeg_size, dst,
+                         width, 0, height, pixfmt, 0) == 0 ? 0 : -1;
+}
+
+/******************************************************************************
+Description.: Largest JPEG jpeg_encode() can produce for a picture
+Input Value.: width, height: picture dimensions
+Return Value: bytes, 0 on error
+******************************************************************************/
+size_t jpeg_encode_bound(int width, int height)
+{
+    unsigned long bound;
+
+    if (width <= 0 || height <= 0) return 0;
+    bound = tjBufSize(width, height, TJSAMP_422);
+    return bound == (unsigned long)-1 ? 0 : (size_t)bound;
+}
+
+/******************************************************************************
+Description.: Compress pixels into a caller provided buffer of at least
+              jpeg_encode_bound() bytes, safe to call from several threads
+Input Value.: pixels: width * height * (1 for TJPF_GRAY, 3 otherwise)
+              width, height: picture dimensions
+              pixfmt: TJPF_GRAY, TJPF_RGB or TJPF_BGR
+              quality: 1 to 100
+              dst, capacity: output buffer
+              size: receives the JPEG length
+Return Value: 0 if ok, -1 on error
+******************************************************************************/
+int jpeg_encode(const unsigned char *pixels, int width, int height, int pixfmt, int quality,
+                unsigned char *dst, size_t capacity, size_t *size)
+{
+    tjhandle handle;
+    unsigned long length = capacity;
+
+    if (!pixels || width <= 0 || height <= 0 || quality < 1 || quality > 100 || !dst || !size) return -1;
+    if (pixfmt != TJPF_GRAY && pixfmt != TJPF_RGB && pixfmt != TJPF_BGR) return -1;
+    if (capacity < jpeg_encode_bound(width, height)) return -1;
+
+    handle = get_thread_compress_handle();
+    if (!handle) return -1;
+
+    /* the buffer is large enough, TurboJPEG must not replace it */
+    if (tjCompress2(handle, pixels, width, 0, height, pixfmt, &dst, &length,
+                    pixfmt == TJPF_GRAY ? TJSAMP_GRAY : TJSAMP_422, quality, TJFLAG_NOREALLOC) != 0)
+        return -1;
+
+    *size = length;
+    return 0;
+}
+
+/******************************************************************************
+Description.: Bytes jpeg_decode_scaled_yuv() needs for a picture
+Input Value.: width, height: scaled dimensions
+              subsamp: TJSAMP_* of the JPEG
+Return Value: bytes, 0 on error
+******************************************************************************/
+size_t jpeg_yuv_size(int width, int height, int subsamp)
+{
+    unsigned long size;
+
+    if (width <= 0 || height <= 0 || subsamp < 0) return 0;
+    size = tjBufSizeYUV2(width, 1, height, subsamp);
+    return size == (unsigned long)-1 ? 0 : (size_t)size;
+}
+
+/******************************************************************************
+Description.: Decompress JPEG into planar YUV at a size from jpeg_scaled_size(),
+              the chroma planes keep the subsampling of the JPEG, so there is
+              no color conversion. Safe to call from several threads at once.
+Input Value.: jpeg_data, jpeg_size: JPEG frame
+              dst, capacity: output, at least jpeg_yuv_size() bytes
+              width, height: scaled dimensions
+              subsamp: TJSAMP_* of the JPEG
+              planes: receive Y, U and V inside dst, U and V are NULL for
+                      TJSAMP_GRAY
+              plane_width, plane_height: receive the dimensions of the three
+                                         planes, the width is also the stride
+Return Value: 0 if ok, -1 on error
+******************************************************************************/
+int jpeg_decode_scaled_yuv(const unsigned char *jpeg_data, int jpeg_size, unsigned char *dst, size_t capacity,
+                           int width, int height, int subsamp,
+                           unsigned char **planes, int *plane_width, int *plane_height)
+{
+    tjhandle handle;
+    int i, count = subsamp == TJSAMP_GRAY ? 1 : 3;
+
+    if (!jpeg_data || jpeg_size <= 0 || !dst || !planes || !plane_width || !plane_height) return -1;
+    if (capacity < jpeg_yuv_size(width, height, subsamp) || capacity == 0) return -1;
+
+    for (i = 0; i < 3; i++) {
+        planes[i] = NULL;
+        plane_width[i] = plane_height[i] = 0;
+        if (i >= count) continue;
+        plane_width[i] = tjPlaneWidth(i, width, subsamp);
+        plane_height[i] = tjPlaneHeight(i, height, subsamp);
+        planes[i] = i == 0 ? dst : planes[i - 1] + (size_t)plane_width[i - 1] * plane_height[i - 1];
+    }
+
+    handle = get_thread_decompress_handle();
+    if (!handle) return -1;
+
+    return tjDecompressToYUVPlanes(handle, jpeg_data, (unsigned long)jpeg_size, planes,
+                                   width, plane_width, height, 0) == 0 ? 0 : -1;
+}
+
+/******************************************************************************
+Description.: Compress YUV 4:2:0 planes into a caller provided buffer of at
+              least jpeg_encode_bound() bytes, with the compress handle of the
+              calling thread
+Input Value.: planes: Y, U and V
+              strides: bytes per row of each plane
+              width, height: picture dimensions
+              quality: 1 to 100
+              dst, capacity: output buffer
+              size: receives the JPEG length
+Return Value: 0 if ok, -1 on error
+******************************************************************************/
+int jpeg_encode_yuv420(const unsigned char **planes, const int *strides, int width, int height, int quality,
+                       unsigned char *dst, size_t capacity, size_t *size)
+{
+    tjhandle handle;
+    unsigned long length = capacity;
+
+    if (!planes || !strides || width <= 0 || height <= 0 || quality < 1 || quality > 100 || !dst || !size) return -1;
+    if (capacity < jpeg_encode_bound(width, height)) return -1;
+
+    handle = get_thread_compress_handle();
+    if (!handle) return -1;
+
+    if (tjCompressFromYUVPlanes(handle, planes, width, strides, height, TJSAMP_420,
+                                &dst, &length, quality, TJFLAG_NOREALLOC) != 0)
+        return -1;
+
+    *size = length;
+    return 0;
+}
+
 /******************************************************************************
 Description.: Get cached decompress handle (performance optimization)
 Input Value.: None
@@ -827,6 +982,156 @@ int turbojpeg_header_info(const unsigned char *jpeg_data, int jpeg_size,
     return (rc == 0) ? 0 : -1;
 }
 
+/******************************************************************************
+Description.: Copy the tables of one DQT segment into the index, converting
+              16-bit tables to 8-bit and replacing zero entries with 1
+Input Value.: seg: segment payload after the length field
+              len: payload length
+              idx: index to fill
+Return Value: None
+******************************************************************************/
+static void index_dqt_segment(const uint8_t *seg, size_t len, jpeg_index *idx)
+{
+    size_t off = 0;
+
+    while (off < len) {
+        uint8_t pq = seg[off] >> 4;
+        uint8_t tq = seg[off] & 0x0F;
+        size_t need = pq ? 128 : 64;
+        uint8_t *dst = NULL;
+
+        off++;
+        if (off + need > len) break;
+
+        if (tq == 0) {
+            dst = idx->qt_luma;
+            idx->have_luma = 1;
+        } else if (tq == 1) {
+            dst = idx->qt_chroma;
+            idx->have_chroma = 1;
+        }
+
+        if (dst) {
+            if (pq == 0) {
+                simd_memcpy(dst, seg + off, 64);
+                sanitize_qt_8bit(dst);
+            } else {
+                for (int k = 0; k < 64; k++)
+                    dst[k] = qt_to_8bit(((uint16_t)seg[off + 2*k] << 8) | seg[off + 2*k + 1]);
+            }
+        }
+        if (pq)
+            idx->qt_precision = 1;
+        off += need;
+    }
+}
+
+/******************************************************************************
+Description.: Read dimensions and chroma subsampling from a SOF segment
+Input Value.: seg: segment payload after the length field
+              len: payload length
+              idx: index to fill
+Return Value: None
+******************************************************************************/
+static void index_sof_segment(const uint8_t *seg, size_t len, jpeg_index *idx)
+{
+    if (len < 6) return;
+
+    idx->height = (seg[1] << 8) | seg[2];
+    idx->width = (seg[3] << 8) | seg[4];
+    idx->subsamp = -1;
+
+    if (seg[5] == 1) {
+        idx->subsamp = TJSAMP_GRAY;
+    } else if (seg[5] == 3 && len >= 6 + 3 * 3) {
+        int hs = seg[7] >> 4, vs = seg[7] & 0x0F;
+        /* chroma components are expected at 1x1 */
+        if (seg[10] == 0x11 && seg[13] == 0x11) {
+            if (hs == 1 && vs == 1) idx->subsamp = TJSAMP_444;
+            else if (hs == 2 && vs == 1) idx->subsamp = TJSAMP_422;
+            else if (hs == 2 && vs == 2) idx->subsamp = TJSAMP_420;
+            else if (hs == 1 && vs == 2) idx->subsamp = TJSAMP_440;
+            else if (hs == 4 && vs == 1) idx->subsamp = TJSAMP_411;
+        }
+    }
+}
+
+/******************************************************************************
+Description.: Build the marker index of a frame. Segment headers are walked up
+              to SOS, the scan is only searched for the EOI with memchr, so
+              this is one cheap pass that consumers can share instead of
+              each rescanning the frame.
+Input Value.: p, sz: JPEG data
+              idx: index to fill
+Return Value: 0 if SOF, SOS and EOI were found, -1 otherwise
+******************************************************************************/
+int jpeg_index_frame(const unsigned char *p, size_t sz, jpeg_index *idx)
+{
+    size_t i = 2;
+
+    if (!idx) return -1;
+    memset(idx, 0, sizeof(*idx));
+    idx->subsamp = -1;
+
+    if (!p || sz < 4 || p[0] != 0xFF || p[1] != 0xD8) return -1;
+
+    while (i + 3 < sz) {
+        if (p[i] != 0xFF) return -1;
+        while (i < sz && p[i] == 0xFF) i++;
+        if (i + 2 >= sz) return -1;
+
+        size_t pos = i - 1;
+        unsigned char m = p[i++];
+        if (m == 0xD9) {
+            idx->eoi = pos;
+            return -1; /* EOI before SOS */
+        }
+        if (m == 0x01 || (m >= 0xD0 && m <= 0xD7)) continue; /* no length */
+
+        size_t seglen = ((size_t)p[i] << 8) | p[i + 1];
+        if (seglen < 2 || i + seglen > sz) return -1;
+        const uint8_t *seg = p + i + 2;
+        size_t len = seglen - 2;
+
+        if (m == 0xDA) {
+            idx->sos = pos;
+            idx->scan = i + seglen;
+            break;
+        } else if (m == 0xDB) {
+            if (!idx->dqt) idx->dqt = pos;
+            index_dqt_segment(seg, len, idx);
+        } else if (m == 0xC4) {
+            if (!idx->dht) idx->dht = pos;
+        } else if (m == 0xDD) {
+            idx->dri = pos;
+            if (len >= 2) idx->restart_interval = (seg[0] << 8) | seg[1];
+        } else if (m >= 0xC0 && m <= 0xCF && m != 0xC8 && m != 0xCC) {
+            /* SOF0..SOF15 except DHT (C4), JPG (C8) and DAC (CC) */
+            if (!idx->sof) {
+                idx->sof = pos;
+                index_sof_segment(seg, len, idx);
+            }
+        }
+        i += seglen;
+    }
+
+    if (!idx->sos) return -1;
+
+    /* inside the scan 0xFF is always stuffed or a RSTn, the first FF D9 ends it */
+    for (i = idx->scan; i + 1 < sz; i++) {
+        const unsigned char *ff = memchr(p + i, 0xFF, sz - 1 - i);
+        if (!ff) break;
+        i = ff - p;
+        if (p[i + 1] == 0xD9) {
+            idx->eoi = i;
+            break;
+        }
+    }
+
+    idx->valid = (idx->sof && idx->eoi > idx->scan);
+    return idx->valid ? 0 : -1;
+}
+
 #include <stdint.h>
 
 typedef struct {
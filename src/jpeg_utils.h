@@ -1,3 +1,9 @@
+#ifndef JPEG_UTILS_H
+#define JPEG_UTILS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
 /* Include TurboJPEG headers if available */
 #ifdef HAVE_TURBOJPEG
     #include <turbojpeg.h>
@@ -20,6 +26,24 @@ int decode_any_to_y_component(unsigned char *data, int data_size, int scale_fact
 int jpeg_decompress_to_rgb(unsigned char *jpeg_data, int jpeg_size, 
                            unsigned char **rgb_data, int *width, int *height, int known_width, int known_height);
 
+/* Scaled decode into a caller buffer, used by the per-frame plane cache */
+int jpeg_scaled_size(int width, int height, int scale, int *scaled_width, int *scaled_height);
+int jpeg_decode_scaled(const unsigned char *jpeg_data, int jpeg_size, unsigned char *dst,
+                       int width, int height, int pixfmt);
+
+/* Encode into a caller buffer, used for the per-frame JPEG variants */
+size_t jpeg_encode_bound(int width, int height);
+int jpeg_encode(const unsigned char *pixels, int width, int height, int pixfmt, int quality,
+                unsigned char *dst, size_t capacity, size_t *size);
+
+/* Planar YUV without color conversion, used to compose the mosaic of output_http */
+size_t jpeg_yuv_size(int width, int height, int subsamp);
+int jpeg_decode_scaled_yuv(const unsigned char *jpeg_data, int jpeg_size, unsigned char *dst, size_t capacity,
+                           int width, int height, int subsamp,
+                           unsigned char **planes, int *plane_width, int *plane_height);
+int jpeg_encode_yuv420(const unsigned char **planes, const int *strides, int width, int height, int quality,
+                       unsigned char *dst, size_t capacity, size_t *size);
+
 /* TurboJPEG handle caching functions */
 void cleanup_turbojpeg_handles(void);
 
@@ -32,6 +56,27 @@ extern const unsigned char jpeg_default_qt_chroma[64];
 int turbojpeg_header_info(const unsigned char *jpeg_data, int jpeg_size,
                           int *width, int *height, int *subsamp);
 
+/* Marker index of one JPEG frame, built once by jpeg_index_frame() when the
+   frame is published. Offsets point at the 0xFF of the marker, 0 = absent. */
+typedef struct {
+    int valid;                  /* SOF, SOS and EOI were all found */
+    size_t sof, dqt, dht, dri, sos, eoi;
+    size_t scan;                /* first byte of entropy coded data */
+    int width;
+    int height;
+    int subsamp;                /* TJSAMP_*, -1 if unusual */
+    int restart_interval;
+    uint8_t qt_luma[64];        /* natural order, 8-bit, never 0 */
+    uint8_t qt_chroma[64];
+    int have_luma;
+    int have_chroma;
+    int qt_precision;           /* 1 if the stream carried 16-bit tables */
+} jpeg_index;
+
+/* Walks segment headers and the scan once. Returns 0 if the index is valid,
+   -1 otherwise (fields found before the failure are still filled). */
+int jpeg_index_frame(const unsigned char *p, size_t sz, jpeg_index *idx);
+
 /* Strip JPEG to RTP/JPEG format (RFC 2435) */
 /* Input: Full JPEG (SOI...EOI), dimensions, subsamp */
 /* Output: RTP/JPEG payload (JPEG header + optional QT + scan data, no SOI/EOI) */
@@ -63,3 +108,5 @@ typedef struct {
     unsigned char *buffer;
     int buffersize;
 } jpeg_rgb_image;
+
+#endif /* JPEG_UTILS_H */
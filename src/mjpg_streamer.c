@@ -92,9 +92,15 @@ static void help(char *progname)
     fprintf(stderr, "Usage: %s\n" \
             "  -i | --input \"<input-plugin.so> [parameters]\"\n" \
             "  -o | --output \"<output-plugin.so> [parameters]\"\n" \
+            " [-r | --ring <depth>].: frames kept per input for slow outputs, applies\n" \
+            "                         to the preceding -i or, if given first, to all\n" \
+            "                         inputs (1-%d, default %d)\n" \
+            " [-t | --trace <frames>]: keep stage timestamps of the last delivered\n" \
+            "                         frames for /latency?format=trace\n" \
             " [-h | --help ]........: display this help\n" \
             " [-v | --version ].....: display version information\n" \
-            " [-b | --background]...: fork to the background, daemon mode\n", progname);
+            " [-b | --background]...: fork to the background, daemon mode\n", progname,
+            MAX_FRAME_RING_DEPTH, DEFAULT_FRAME_RING_DEPTH);
     fprintf(stderr, "-----------------------------------------------------------------------\n");
     fprintf(stderr, "Example #1:\n" \
             " To open an UVC webcam \"/dev/video1\" and stream it via HTTP:\n" \
@@ -157,6 +163,9 @@ static void signal_handler(int sig)
 
     /* cleanup input plugins and relay system */
     for(i = 0; i < global.incnt; i++) {
+        /* release published and pooled frames */
+        input_frames_cleanup(&global.in[i]);
+
         /* cleanup condition variables */
         pthread_cond_destroy(&global.in[i].db_update);
         pthread_mutex_destroy(&global.in[i].db);
@@ -193,6 +202,24 @@ static void signal_handler(int sig)
     return;
 }
 
+/******************************************************************************
+Description.: grow a table by one element, exits if memory runs out because
+              this is only used while parsing the command line
+Input Value.: table: array to grow
+              count: current number of elements
+              size: size of one element
+Return Value: the new array, element count is uninitialized
+******************************************************************************/
+static void *grow_table(void *table, int count, size_t size)
+{
+    table = realloc(table, (count + 1) * size);
+    if(table == NULL) {
+        fprintf(stderr, "could not allocate memory for plugin table\n");
+        exit(EXIT_FAILURE);
+    }
+    return table;
+}
+
 static int split_parameters(char *parameter_string, int *argc, char **argv)
 {
     int count = 1;
@@ -231,12 +258,13 @@ Return Value:
 int main(int argc, char *argv[])
 {
     //char *input  = "input_uvc.so --resolution 640x480 --fps 5 --device /dev/video0";
-    char *input[MAX_INPUT_PLUGINS];
-    char *output[MAX_OUTPUT_PLUGINS];
+    char **input = NULL;
+    char **output = NULL;
+    int *ring_depth = NULL;
+    int default_ring_depth = DEFAULT_FRAME_RING_DEPTH;
     int daemon = 0, i, j;
     size_t tmp = 0;
 
-    output[0] = "output_http.so --port 8080";
     global.outcnt = 0;
     global.incnt = 0;
     global.argv0 = argv[0];
@@ -250,20 +278,46 @@ int main(int argc, char *argv[])
             {"output", required_argument, NULL, 'o'},
             {"version", no_argument, NULL, 'v'},
             {"background", no_argument, NULL, 'b'},
+            {"ring", required_argument, NULL, 'r'},
+            {"trace", required_argument, NULL, 't'},
             {NULL, 0, NULL, 0}
         };
 
-        c = getopt_long(argc, argv, "hi:o:vb", long_options, NULL);
+        c = getopt_long(argc, argv, "hi:o:vbr:t:", long_options, NULL);
 
         /* no more options to parse */
         if(c == -1) break;
 
         switch(c) {
         case 'i':
+            input = grow_table(input, global.incnt, sizeof(char *));
+            ring_depth = grow_table(ring_depth, global.incnt, sizeof(int));
+            ring_depth[global.incnt] = default_ring_depth;
             input[global.incnt++] = strdup(optarg);
             break;
 
+        case 'r': {
+            int depth = atoi(optarg);
+            if(depth < 1 || depth > MAX_FRAME_RING_DEPTH) {
+                fprintf(stderr, "ring depth must be between 1 and %d\n", MAX_FRAME_RING_DEPTH);
+                exit(EXIT_FAILURE);
+            }
+            if(global.incnt == 0)
+                default_ring_depth = depth;
+            else
+                ring_depth[global.incnt - 1] = depth;
+            break;
+        }
+
+        case 't':
+            if(latency_trace_init(atoi(optarg)) != 0) {
+                fprintf(stderr, "could not enable tracing of %s frames\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
         case 'o':
+            output = grow_table(output, global.outcnt, sizeof(char *));
             output[global.outcnt++] = strdup(optarg);
             break;
 
@@ -337,13 +391,15 @@ int main(int argc, char *argv[])
     /* check if at least one output plugin was selected */
     if(global.outcnt == 0) {
         /* no? Then use the default plugin instead */
-        global.outcnt = 1;
+        output = grow_table(output, 0, sizeof(char *));
+        output[global.outcnt++] = "output_http.so --port 8080";
     }
 
-    /* Initialize input array */
+    /* Initialize input and output arrays */
     global.in = calloc(global.incnt, sizeof(struct _input));
-    if (global.in == NULL) {
-        LOG("ERROR: could not allocate input array\n");
+    global.out = calloc(global.outcnt, sizeof(struct _output));
+    if ((global.in == NULL && global.incnt > 0) || global.out == NULL) {
+        LOG("ERROR: could not allocate plugin arrays\n");
         closelog();
         exit(EXIT_FAILURE);
     }
@@ -363,8 +419,12 @@ int main(int argc, char *argv[])
             exit(EXIT_FAILURE);
         }
         
-        /* Initialize condition variables */
-        
+        if(input_frames_init(&global.in[i], i, ring_depth[i]) != 0) {
+            LOG("could not initialize frame pool\n");
+            closelog();
+            exit(EXIT_FAILURE);
+        }
+
 
         char *space_pos = strchr(input[i], ' ');
         
@@ -459,7 +519,8 @@ int main(int argc, char *argv[])
 
     /* open output plugin */
     for(i = 0; i < global.outcnt; i++) {
-        tmp = (size_t)(strchr(output[i], ' ') - output[i]);
+        char *out_space_pos = strchr(output[i], ' ');
+        tmp = (out_space_pos != NULL) ? (size_t)(out_space_pos - output[i]) : strlen(output[i]);
         global.out[i].plugin = (tmp > 0) ? strndup(output[i], tmp) : strdup(output[i]);
         
         // Try to find plugin in plugins directory
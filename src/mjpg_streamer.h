@@ -24,11 +24,13 @@
 #define MJPG_STREAMER_H
 #define SOURCE_VERSION "2.0"
 
-/* FIXME take a look to the output_http clients thread marked with fixme if you want to set more then 10 plugins */
-#define MAX_INPUT_PLUGINS 10
-#define MAX_OUTPUT_PLUGINS 10
+/* input and output tables are sized at startup from the command line */
 #define MAX_PLUGIN_ARGUMENTS 32
 
+/* number of published frames each input keeps for consumers that fall behind */
+#define DEFAULT_FRAME_RING_DEPTH 4
+#define MAX_FRAME_RING_DEPTH 64
+
 #ifdef __linux__
 #include <linux/types.h>          /* for videodev2.h */
 #include <linux/videodev2.h>
@@ -148,12 +150,12 @@ struct _control {
 struct _globals {
     int stop;
 
-    /* input plugin */
-    input *in; // Changed from array to pointer to avoid incomplete type error
+    /* input plugins, incnt entries */
+    input *in;
     int incnt;
 
-    /* output plugin */
-    output out[MAX_OUTPUT_PLUGINS];
+    /* output plugins, outcnt entries */
+    output *out;
     int outcnt;
 
     /* program name for plugin path resolution */
@@ -25,6 +25,7 @@
 
 #include <syslog.h>
 #include "../mjpg_streamer.h"
+#include "../jpeg_utils.h"
 #define INPUT_PLUGIN_PREFIX " i: "
 #define IPRINT(...) { char _bf[1024] = {0}; snprintf(_bf, sizeof(_bf)-1, __VA_ARGS__); fprintf(stderr, "%s", INPUT_PLUGIN_PREFIX); fprintf(stderr, "%s", _bf); syslog(LOG_INFO, "%s", _bf); }
 
@@ -52,6 +53,88 @@ struct _input_format {
     char currentResolution;
 };
 
+/*
+ * Decoded picture of a published frame, see input_frame_plane(), or a JPEG
+ * encoded from one, see input_frame_variant(). Planes stay attached to the
+ * frame buffer and are reused when it is recycled, sequence tells which
+ * publication the content belongs to.
+ */
+typedef struct _frame_plane frame_plane;
+struct _frame_plane {
+    unsigned int sequence;           /* frame sequence decoded, 0 = empty */
+    int scale;                       /* downscale divisor */
+    int pixfmt;                      /* TJPF_GRAY, TJPF_RGB or TJPF_BGR */
+    int quality;                     /* JPEG variant quality, 0 = pixels */
+    int width;
+    int height;
+    unsigned char *data;
+    size_t size;                     /* bytes of a JPEG variant */
+    size_t capacity;
+    frame_plane *next;
+};
+
+/*
+ * Published JPG frame. Once handed to input_frame_publish() the data is
+ * read-only; consumers hold a reference while they use it and the buffer
+ * goes back to the owning input's free pool when the last one is dropped.
+ */
+typedef struct _frame_buffer frame_buffer;
+struct _frame_buffer {
+    unsigned char *data;
+    size_t capacity;                 /* allocated bytes of data */
+    int size;                        /* used bytes of data */
+    volatile int refcount;
+    unsigned int sequence;           /* frame_sequence at publication */
+    struct timeval timestamp;
+    long long timestamp_ms;
+    long long capture_us;            /* CLOCK_MONOTONIC when the input got the
+                                        frame, 0 means publication time */
+    long long publish_us;            /* CLOCK_MONOTONIC at publication */
+    jpeg_index jpeg;                 /* marker index, built at publication */
+    frame_plane *planes;             /* decode cache, protected by planes_lock */
+    pthread_mutex_t planes_lock;
+    struct _input *owner;
+    frame_buffer *next;              /* free pool link */
+};
+
+/*
+ * Metadata of the newest frame. It is written by input_frame_publish() under
+ * a sequence lock, read it with input_meta_read() to get a consistent copy
+ * without taking the input mutex.
+ */
+typedef struct _frame_meta frame_meta;
+struct _frame_meta {
+    unsigned int sequence;
+    int size;
+    int width;
+    int height;
+    struct timeval timestamp;
+    long long timestamp_ms;
+    int fps;
+    int subsampling;                 /* TJSAMP_*, -1 if unknown */
+};
+
+/*
+ * Read position of a consumer in the frame ring of an input, see
+ * input_frame_next(). next_sequence 0 starts at the oldest retained frame.
+ */
+typedef struct _frame_cursor frame_cursor;
+struct _frame_cursor {
+    unsigned int next_sequence;
+    unsigned long long skipped;      /* frames that left the ring unread */
+};
+
+/*
+ * Descriptor that becomes readable when a frame is published, see
+ * input_frame_subscribe(). fd is handed out, notify_fd is written to, both are
+ * the same eventfd on Linux and the two ends of a pipe elsewhere.
+ */
+typedef struct _frame_subscriber frame_subscriber;
+struct _frame_subscriber {
+    int fd;
+    int notify_fd;
+};
+
 /* structure to store variables/functions for input plugin */
 typedef struct _input input;
 struct _input {
@@ -76,6 +159,14 @@ struct _input {
     unsigned char *buf;
     int size;
 
+    /* newest frame (the reference is held by frame_ring), buf/size mirror it */
+    frame_buffer *frame;
+    /* last frame_ring_depth frames by sequence, each slot holds one reference */
+    frame_buffer **frame_ring;
+    int frame_ring_depth;
+    frame_buffer *frame_pool;
+    pthread_mutex_t frame_pool_lock;
+
     /* v4l2_buffer timestamp */
     struct timeval timestamp;
 
@@ -90,6 +181,22 @@ struct _input {
     volatile unsigned int frame_sequence;     /* Frame sequence number for multi-consumer detection */
     long long frame_timestamp_ms;    /* Timestamp of the frame in milliseconds */
 
+    /* seqlock protected copy of the above, odd meta_lock means write in progress */
+    volatile unsigned int meta_lock;
+    frame_meta meta;
+
+    /* descriptors signalled on every publish, protected by db */
+    frame_subscriber *subscribers;
+    int subscriber_count;
+
+    /* registered by input_frames_init(), see metric_counter() */
+    struct _metric *m_frames;
+    struct _metric *m_bytes;
+    struct _metric *m_skipped;
+    struct _metric *m_lock_wait;
+    struct _metric *m_capture;
+    struct _metric *m_variants;
+
     /* Relay system fields removed - no longer used */
 
     input_format *in_formats;
@@ -138,35 +138,18 @@ static int plugin_id;
     }
 
     if (jpeg_data && jpeg_size > 0) {
-        // Update global buffer - following UVC plugin structure with optimizations
-        pthread_mutex_lock(&pglobal->in[plugin_id].db);
-        
-        // Free previous buffer if exists
-        if (pglobal->in[plugin_id].buf) {
-            free(pglobal->in[plugin_id].buf);
+        // Publish through a pooled frame - following UVC plugin structure
+        frame_buffer *fb = input_frame_acquire(&pglobal->in[plugin_id], jpeg_size);
+        if (fb) {
+            memcpy(fb->data, jpeg_data, jpeg_size);
+            pglobal->in[plugin_id].width = (int)width;
+            pglobal->in[plugin_id].height = (int)height;
+
+            // Timestamp is taken by input_frame_publish (Unix system time)
+            input_frame_publish(&pglobal->in[plugin_id], fb, jpeg_size, NULL);
         }
-
-        // Store new frame data
-        pglobal->in[plugin_id].buf = jpeg_data;
-        pglobal->in[plugin_id].size = jpeg_size;
-        pglobal->in[plugin_id].width = (int)width;
-        pglobal->in[plugin_id].height = (int)height;
-        pglobal->in[plugin_id].current_size = jpeg_size;
-        pglobal->in[plugin_id].prev_size = pglobal->in[plugin_id].current_size;
-
-        // Update timestamp - always use Unix timestamp (system time)
-        gettimeofday(&pglobal->in[plugin_id].timestamp, NULL);
-        pglobal->in[plugin_id].frame_timestamp_ms = 
-            pglobal->in[plugin_id].timestamp.tv_sec * 1000 + 
-            pglobal->in[plugin_id].timestamp.tv_usec / 1000;
-
-        // Increment frame sequence
-        pglobal->in[plugin_id].frame_sequence++;
-
-        // Signal new frame - using broadcast like UVC plugin
-        pthread_cond_broadcast(&pglobal->in[plugin_id].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_id].db);
     }
+    free(jpeg_data);
 
     // Unlock the image buffer
     CVPixelBufferUnlockBaseAddress(imageBuffer, kCVPixelBufferLock_ReadOnly);
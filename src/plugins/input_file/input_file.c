@@ -30,7 +30,6 @@
 #include "../../utils.h"
 
 #define INPUT_PLUGIN_NAME "FILE input plugin"
-#define MAX_FILE_SIZE (10*1024*1024)  /* 10MB max file size */
 
 typedef enum _read_mode {
     NewFilesOnly,
@@ -70,10 +69,6 @@ static read_mode mode = NewFilesOnly;
 static int fd, rc, wd, size;
 static struct inotify_event *ev;
 
-/* Static buffer for file data to avoid malloc/free in hot path */
-static unsigned char static_file_buffer[MAX_FILE_SIZE];
-static int use_static_buffers = 1;
-
 /*** plugin interface functions ***/
 int input_init(input_parameter *param, int id)
 {
@@ -233,7 +228,6 @@ int input_run(int id)
     }
 
     if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
-        free(pglobal->in[id].buf);
         fprintf(stderr, "could not start worker thread\n");
         exit(EXIT_FAILURE);
     }
@@ -376,58 +370,29 @@ void *worker_thread(void *arg)
 
         filesize = stats.st_size;
 
-        /* copy frame from file to global buffer */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
-
-        /* allocate memory for frame - use static buffer if possible */
-        if(pglobal->in[plugin_number].buf != NULL && pglobal->in[plugin_number].buf != static_file_buffer)
-            free(pglobal->in[plugin_number].buf);
-
-        if (use_static_buffers && filesize <= MAX_FILE_SIZE) {
-            /* Use static buffer for files up to MAX_FILE_SIZE */
-            pglobal->in[plugin_number].buf = static_file_buffer;
-        } else {
-            /* Fallback to dynamic allocation for larger files */
-            pglobal->in[plugin_number].buf = malloc(filesize + (1 << 16));
-            if(pglobal->in[plugin_number].buf == NULL) {
-                fprintf(stderr, "could not allocate memory\n");
-                pthread_mutex_unlock(&pglobal->in[plugin_number].db);
-                close(file);
-                break;
-            }
+        /* read the file into a pooled frame, the mutex is only taken to publish */
+        frame_buffer *fb = input_frame_acquire(&pglobal->in[plugin_number], filesize + (1 << 16));
+        if(fb == NULL) {
+            fprintf(stderr, "could not allocate memory\n");
+            close(file);
+            break;
         }
 
         /* Use buffered read for better performance */
         file_read_buffer read_buf;
         init_file_read_buffer(&read_buf, file);
         
-        ssize_t bytes_read = buffered_read(&read_buf, pglobal->in[plugin_number].buf, filesize);
+        ssize_t bytes_read = buffered_read(&read_buf, fb->data, filesize);
         if(bytes_read == -1) {
             perror("could not read from file");
-            if (pglobal->in[plugin_number].buf != static_file_buffer) {
-                free(pglobal->in[plugin_number].buf);
-            }
-            pglobal->in[plugin_number].buf = NULL; 
-            pglobal->in[plugin_number].size = 0;
-            pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+            input_frame_put(fb);
             close(file);
             break;
         }
-        
-        // Update frame metadata BEFORE signaling
-        pglobal->in[plugin_number].prev_size = pglobal->in[plugin_number].current_size;
-        pglobal->in[plugin_number].current_size = bytes_read;
-        pglobal->in[plugin_number].size = bytes_read;
-        pglobal->in[plugin_number].frame_sequence++;
 
         gettimeofday(&timestamp, NULL);
-        pglobal->in[plugin_number].timestamp = timestamp;
-        pglobal->in[plugin_number].frame_timestamp_ms = (timestamp.tv_sec * 1000LL) + (timestamp.tv_usec / 1000);
-        
-        DBG("new frame copied (size: %d)\n", pglobal->in[plugin_number].size);
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+        input_frame_publish(&pglobal->in[plugin_number], fb, bytes_read, &timestamp);
+        DBG("new frame copied (size: %d)\n", (int)bytes_read);
 
         close(file);
 
@@ -468,10 +433,6 @@ void worker_cleanup(void *arg)
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
 
-    if(pglobal->in[plugin_number].buf != NULL && pglobal->in[plugin_number].buf != static_file_buffer) {
-        free(pglobal->in[plugin_number].buf);
-    }
-
     free(ev);
 
     if (mode == NewFilesOnly) {
@@ -108,16 +108,7 @@ int input_run(int id)
     pglobal->in[id].prev_size = 0;
     pglobal->in[id].frame_sequence = 0;
     
-    // OPTIMIZATION: Allocate smaller initial buffer
-    // Will be reallocated if needed, but starts smaller
-    pglobal->in[id].buf = malloc(128 * 1024); // Reduced from 256KB to 128KB
-    if(pglobal->in[id].buf == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        exit(EXIT_FAILURE);
-    }
-
     if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
-        free(pglobal->in[id].buf);
         fprintf(stderr, "could not start worker thread\n");
         exit(EXIT_FAILURE);
     }
@@ -128,27 +119,15 @@ int input_run(int id)
 
 
 void on_image_received(char * data, int length){
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
-
-        /* Update frame metadata */
-        pglobal->in[plugin_number].prev_size = pglobal->in[plugin_number].current_size;
-        pglobal->in[plugin_number].current_size = length;
-        pglobal->in[plugin_number].size = length;
-        pglobal->in[plugin_number].frame_sequence++;
-        
-        /* Set timestamp */
-        struct timeval timestamp;
-        gettimeofday(&timestamp, NULL);
-        pglobal->in[plugin_number].timestamp = timestamp;
-        pglobal->in[plugin_number].frame_timestamp_ms = (timestamp.tv_sec * 1000LL) + (timestamp.tv_usec / 1000);
-
-        simd_memcpy(pglobal->in[plugin_number].buf, data, length);
-
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
-
+        /* copy JPG picture to a pooled frame and publish it */
+        frame_buffer *fb = input_frame_acquire(&pglobal->in[plugin_number], length);
+        if(fb == NULL) {
+            fprintf(stderr, "could not allocate memory\n");
+            return;
+        }
+
+        simd_memcpy(fb->data, data, length);
+        input_frame_publish(&pglobal->in[plugin_number], fb, length, NULL);
 }
 
 void *worker_thread(void *arg)
@@ -184,7 +163,6 @@ void worker_cleanup(void *arg)
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
     close_mjpg_proxy(&proxy);
-    if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
 }
 
 
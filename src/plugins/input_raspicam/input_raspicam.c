@@ -97,7 +97,7 @@ typedef struct
   VCOS_SEMAPHORE_T complete_semaphore; /// semaphore which is posted when we reach end of frame (indicates end of capture or fault)
   MMAL_POOL_T *pool; /// pointer to our state in case required in callback
   uint32_t offset;
-  int frame_locked;
+  frame_buffer *frame; /// pooled frame being filled, published at frame end
   int frame_dropped;
 } PORT_USERDATA;
 
@@ -388,25 +388,27 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
 
       //fprintf(stderr, "The flags are %x of length %i offset %i\n", buffer->flags, buffer->length, pData->offset);
 
-      if (!pData->frame_dropped) {
-        /* Lock frame buffer once at frame start and unlock at frame end */
-        if (!pData->frame_locked) {
-          pthread_mutex_lock(&pglobal->in[plugin_number].db);
-          pData->frame_locked = 1;
+      /* Take a pooled frame at frame start, nothing is locked while filling it */
+      if (!pData->frame_dropped && pData->frame == NULL) {
+        pData->frame = input_frame_acquire(&pglobal->in[plugin_number], frame_buffer_capacity);
+        if (pData->frame == NULL) {
+          DBG("Dropping JPEG frame: could not allocate frame buffer\n");
+          pData->frame_dropped = 1;
+          pData->offset = 0;
         }
+      }
 
+      if (!pData->frame_dropped) {
         if ((size_t)pData->offset + (size_t)buffer->length <= frame_buffer_capacity) {
-          simd_memcpy(pData->offset + pglobal->in[plugin_number].buf, buffer->data, buffer->length);
+          simd_memcpy(pData->offset + pData->frame->data, buffer->data, buffer->length);
           pData->offset += buffer->length;
         } else {
           DBG("Dropping oversized JPEG frame: offset=%u chunk=%u capacity=%zu\n",
               pData->offset, (unsigned int)buffer->length, frame_buffer_capacity);
           pData->frame_dropped = 1;
           pData->offset = 0;
-          if (pData->frame_locked) {
-            pthread_mutex_unlock(&pglobal->in[plugin_number].db);
-            pData->frame_locked = 0;
-          }
+          input_frame_put(pData->frame);
+          pData->frame = NULL;
         }
       }
       //fwrite(buffer->data, 1, buffer->length, pData->file_handle);
@@ -416,37 +418,19 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
     // Now flag if we have completed
     if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED))
     {
-      if (!pData->frame_dropped && pData->frame_locked) {
-        // Update frame metadata BEFORE signaling
-        pglobal->in[plugin_number].prev_size = pglobal->in[plugin_number].current_size;
-        pglobal->in[plugin_number].current_size = pData->offset;
-        pglobal->in[plugin_number].size = pData->offset;
-        pglobal->in[plugin_number].frame_sequence++;
-
+      if (!pData->frame_dropped && pData->frame != NULL) {
         //Set frame timestamp
-        if(wantTimestamp)
-        {
-          gettimeofday(&timestamp, NULL);
-          pglobal->in[plugin_number].timestamp = timestamp;
-          pglobal->in[plugin_number].frame_timestamp_ms = (timestamp.tv_sec * 1000LL) + (timestamp.tv_usec / 1000);
-        }
-        else
-        {
-          // Set default timestamp even if not requested
-          gettimeofday(&timestamp, NULL);
-          pglobal->in[plugin_number].timestamp = timestamp;
-          pglobal->in[plugin_number].frame_timestamp_ms = (timestamp.tv_sec * 1000LL) + (timestamp.tv_usec / 1000);
-        }
+        gettimeofday(&timestamp, NULL);
+        input_frame_publish(&pglobal->in[plugin_number], pData->frame, pData->offset, &timestamp);
+        pData->frame = NULL;
 
         //mark frame complete
         complete = 1;
 
         pData->offset = 0;
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
-        pData->frame_locked = 0;
       } else {
+        input_frame_put(pData->frame);
+        pData->frame = NULL;
         pData->offset = 0;
       }
       pData->frame_dropped = 0;
@@ -529,16 +513,9 @@ int input_run(int id)
   if (frame_buffer_capacity < (1024 * 1024)) {
     frame_buffer_capacity = 1024 * 1024;
   }
-  pglobal->in[id].buf = malloc(frame_buffer_capacity);
-  if (pglobal->in[id].buf == NULL)
-  {
-    fprintf(stderr, "could not allocate memory\n");
-    exit(EXIT_FAILURE);
-  }
 
   if (pthread_create(&worker, 0, worker_thread, NULL) != 0)
   {
-    free(pglobal->in[id].buf);
     fprintf(stderr, "could not start worker thread\n");
     exit(EXIT_FAILURE);
   }
@@ -972,7 +949,7 @@ void *worker_thread(void *arg)
   callback_data.file_handle = NULL;
   callback_data.pool = pool;
   callback_data.offset = 0;
-  callback_data.frame_locked = 0;
+  callback_data.frame = NULL;
   callback_data.frame_dropped = 0;
 
   vcos_assert(vcos_semaphore_create(&callback_data.complete_semaphore, "RaspiStill-sem", 0) == VCOS_SUCCESS);
@@ -1143,9 +1120,6 @@ void worker_cleanup(void *arg)
 
   first_run = 0;
   DBG("cleaning up resources allocated by input thread\n");
-
-  if(pglobal->in[plugin_number].buf != NULL)
-    free(pglobal->in[plugin_number].buf);
 }
 
 
@@ -0,0 +1,460 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Original code Copyright (C) 2007 Tom Stöveken                         #
+#                                                                              #
+#      Optimizations Copyright (C) 2024 350d                                   #
+#                                                                              #
+#      Licensed under MIT License - see LICENSE file for details               #
+#                                                                              #
+*******************************************************************************/
+
+/*
+ * Synthetic input for load tests: a cycle of JPEG frames is encoded once at
+ * startup and then published from memory at a fixed rate or as fast as
+ * possible, so outputs can be benchmarked without a camera or disk I/O.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <errno.h>
+#include <strings.h>  /* for strcasecmp */
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+#include "../../jpeg_utils.h"
+
+#define INPUT_PLUGIN_NAME "SYNTHETIC input plugin"
+
+/* a COM segment carries at most 65533 bytes of payload */
+#define COM_PAYLOAD_MAX 65533
+
+typedef enum _motion_pattern {
+    MotionNone,
+    MotionRect,
+    MotionNoise
+} motion_pattern;
+
+typedef struct {
+    unsigned char *data;
+    unsigned long size;
+} encoded_frame;
+
+/* private functions and variables to this plugin */
+static pthread_t   worker;
+static globals     *pglobal;
+static int         plugin_number;
+
+void *worker_thread(void *);
+void worker_cleanup(void *);
+void help(void);
+
+static int width = 640;
+static int height = 480;
+static int fps = 30;                 /* 0 = as fast as possible */
+static int quality = 80;
+static int cycle = 60;               /* number of distinct frames */
+static int pad = 0;                  /* minimum frame size in bytes */
+static int jitter = 0;               /* random extra bytes, percent of frame size */
+static unsigned int seed = 1;
+static motion_pattern motion = MotionRect;
+
+static encoded_frame *frames = NULL;
+static unsigned long max_frame_size = 0;
+
+/******************************************************************************
+Description.: draw frame number n of the cycle: a static gradient background
+              with a rectangle bouncing across it, or full frame noise
+Input Value.: rgb: width * height * 3 bytes
+              n: frame number within the cycle
+              rnd: PRNG state for the noise pattern
+Return Value: -
+******************************************************************************/
+static void draw_frame(unsigned char *rgb, int n, unsigned int *rnd)
+{
+    int x, y;
+
+    for(y = 0; y < height; y++) {
+        unsigned char *p = rgb + (size_t)y * width * 3;
+        for(x = 0; x < width; x++, p += 3) {
+            if(motion == MotionNoise) {
+                p[0] = p[1] = p[2] = (unsigned char)rand_r(rnd);
+            } else {
+                p[0] = (unsigned char)(x * 255 / width);
+                p[1] = (unsigned char)(y * 255 / height);
+                p[2] = 96;
+            }
+        }
+    }
+
+    if(motion == MotionRect) {
+        /* the rectangle travels back and forth once per cycle */
+        int rw = width / 6, rh = height / 6;
+        int span = width - rw;
+        int half = cycle / 2 > 0 ? cycle / 2 : 1;
+        int pos = (n % cycle) < half ? (n % cycle) : cycle - (n % cycle);
+        int rx = span * pos / half;
+        int ry = (height - rh) / 2;
+
+        for(y = ry; y < ry + rh; y++) {
+            unsigned char *p = rgb + ((size_t)y * width + rx) * 3;
+            memset(p, 255, (size_t)rw * 3);
+        }
+    }
+}
+
+/******************************************************************************
+Description.: encode the whole frame cycle once
+Input Value.: -
+Return Value: 0 if ok, -1 on error
+******************************************************************************/
+static int encode_frames(void)
+{
+    unsigned char *rgb;
+    unsigned int rnd = seed;
+    int i;
+
+    rgb = malloc((size_t)width * height * 3);
+    frames = calloc(cycle, sizeof(encoded_frame));
+    if(rgb == NULL || frames == NULL) {
+        free(rgb);
+        return -1;
+    }
+
+    for(i = 0; i < cycle; i++) {
+        draw_frame(rgb, i, &rnd);
+        if(compress_rgb_to_jpeg(rgb, width, height, quality, &frames[i].data, &frames[i].size) != 0) {
+            free(rgb);
+            return -1;
+        }
+        if(frames[i].size > max_frame_size)
+            max_frame_size = frames[i].size;
+    }
+
+    free(rgb);
+    return 0;
+}
+
+/******************************************************************************
+Description.: copy an encoded frame and inflate it with COM segments right
+              after SOI until it is extra bytes larger
+Input Value.: dst: destination, at least src->size + extra bytes
+              src: encoded frame
+              extra: bytes to add
+Return Value: bytes written
+******************************************************************************/
+static size_t build_frame(unsigned char *dst, const encoded_frame *src, size_t extra)
+{
+    size_t pos = 2;
+
+    /* SOI */
+    dst[0] = src->data[0];
+    dst[1] = src->data[1];
+
+    while(extra > 4) {
+        size_t chunk = extra - 4;
+        if(chunk > COM_PAYLOAD_MAX)
+            chunk = COM_PAYLOAD_MAX;
+        dst[pos++] = 0xFF;
+        dst[pos++] = 0xFE;
+        dst[pos++] = (unsigned char)((chunk + 2) >> 8);
+        dst[pos++] = (unsigned char)((chunk + 2) & 0xFF);
+        memset(dst + pos, 0, chunk);
+        pos += chunk;
+        extra -= chunk + 4;
+    }
+
+    simd_memcpy(dst + pos, src->data + 2, src->size - 2);
+    return pos + src->size - 2;
+}
+
+/*** plugin interface functions ***/
+int input_init(input_parameter *param, int id)
+{
+    int i;
+    plugin_number = id;
+
+    param->argv[0] = INPUT_PLUGIN_NAME;
+
+    /* show all parameters for DBG purposes */
+    for(i = 0; i < param->argc; i++) {
+        DBG("argv[%d]=%s\n", i, param->argv[i]);
+    }
+
+    reset_getopt();
+    while(1) {
+        int option_index = 0, c = 0;
+        static struct option long_options[] = {
+            {"h", no_argument, 0, 0},
+            {"help", no_argument, 0, 0},
+            {"r", required_argument, 0, 0},
+            {"resolution", required_argument, 0, 0},
+            {"f", required_argument, 0, 0},
+            {"fps", required_argument, 0, 0},
+            {"q", required_argument, 0, 0},
+            {"quality", required_argument, 0, 0},
+            {"c", required_argument, 0, 0},
+            {"cycle", required_argument, 0, 0},
+            {"s", required_argument, 0, 0},
+            {"size", required_argument, 0, 0},
+            {"j", required_argument, 0, 0},
+            {"jitter", required_argument, 0, 0},
+            {"m", required_argument, 0, 0},
+            {"motion", required_argument, 0, 0},
+            {"seed", required_argument, 0, 0},
+            {0, 0, 0, 0}
+        };
+
+        c = getopt_long_only(param->argc, param->argv, "", long_options, &option_index);
+
+        /* no more options to parse */
+        if(c == -1) break;
+
+        /* unrecognized option */
+        if(c == '?') {
+            help();
+            return 1;
+        }
+
+        switch(option_index) {
+            /* h, help */
+        case 0:
+        case 1:
+            DBG("case 0,1\n");
+            help();
+            return 1;
+            break;
+
+            /* r, resolution */
+        case 2:
+        case 3:
+            DBG("case 2,3\n");
+            if(sscanf(optarg, "%dx%d", &width, &height) != 2 || width < 16 || height < 16) {
+                IPRINT("ERROR: invalid resolution %s\n", optarg);
+                return 1;
+            }
+            break;
+
+            /* f, fps */
+        case 4:
+        case 5:
+            DBG("case 4,5\n");
+            fps = atoi(optarg);
+            break;
+
+            /* q, quality */
+        case 6:
+        case 7:
+            DBG("case 6,7\n");
+            quality = MIN(MAX(atoi(optarg), 1), 100);
+            break;
+
+            /* c, cycle */
+        case 8:
+        case 9:
+            DBG("case 8,9\n");
+            cycle = MAX(atoi(optarg), 1);
+            break;
+
+            /* s, size */
+        case 10:
+        case 11:
+            DBG("case 10,11\n");
+            pad = MAX(atoi(optarg), 0);
+            break;
+
+            /* j, jitter */
+        case 12:
+        case 13:
+            DBG("case 12,13\n");
+            jitter = MIN(MAX(atoi(optarg), 0), 100);
+            break;
+
+            /* m, motion */
+        case 14:
+        case 15:
+            DBG("case 14,15\n");
+            if(strcasecmp(optarg, "none") == 0) {
+                motion = MotionNone;
+            } else if(strcasecmp(optarg, "rect") == 0) {
+                motion = MotionRect;
+            } else if(strcasecmp(optarg, "noise") == 0) {
+                motion = MotionNoise;
+            } else {
+                IPRINT("ERROR: unknown motion pattern %s\n", optarg);
+                return 1;
+            }
+            break;
+
+            /* seed */
+        case 16:
+            DBG("case 16\n");
+            seed = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+
+        default:
+            DBG("default case\n");
+            help();
+            return 1;
+        }
+    }
+
+    pglobal = param->global;
+
+    if(motion == MotionNone)
+        cycle = 1;
+
+    IPRINT("resolution........: %dx%d\n", width, height);
+    if(fps > 0) {
+        IPRINT("frames per second.: %d\n", fps);
+    } else {
+        IPRINT("frames per second.: unlimited\n");
+    }
+    IPRINT("JPEG quality......: %d\n", quality);
+    IPRINT("motion pattern....: %s, %d frame cycle\n",
+           motion == MotionRect ? "rect" : motion == MotionNoise ? "noise" : "none", cycle);
+
+    if(encode_frames() != 0) {
+        IPRINT("ERROR: could not encode synthetic frames\n");
+        return 1;
+    }
+
+    IPRINT("encoded frame size: up to %lu bytes\n", max_frame_size);
+    IPRINT("minimum frame size: %d bytes, jitter %d%%\n", pad, jitter);
+
+    param->global->in[id].width = width;
+    param->global->in[id].height = height;
+    param->global->in[id].fps = fps;
+    param->global->in[id].quality = quality;
+
+    param->global->in[id].name = malloc((strlen(INPUT_PLUGIN_NAME) + 1) * sizeof(char));
+    sprintf(param->global->in[id].name, INPUT_PLUGIN_NAME);
+
+    return 0;
+}
+
+int input_stop(int id)
+{
+    /* the worker leaves its loop within one frame interval of
+     * pglobal->stop, cancelling it could hit a thread already gone */
+    DBG("will wait for the input thread\n");
+    pthread_join(worker, NULL);
+    return 0;
+}
+
+int input_run(int id)
+{
+    if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
+        fprintf(stderr, "could not start worker thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
+
+/*** private functions for this plugin below ***/
+void help(void)
+{
+    fprintf(stderr, " ---------------------------------------------------------------\n" \
+    " Help for input plugin..: "INPUT_PLUGIN_NAME"\n" \
+    " ---------------------------------------------------------------\n" \
+    " The following parameters can be passed to this plugin:\n\n" \
+    " [-r | --resolution ]...: frame size WIDTHxHEIGHT, default 640x480\n" \
+    " [-f | --fps ]..........: frames per second, 0 = as fast as possible\n" \
+    " [-q | --quality ]......: JPEG quality 1-100, default 80\n" \
+    " [-c | --cycle ]........: number of distinct frames encoded at start\n" \
+    " [-s | --size ].........: pad frames with COM segments to at least\n" \
+    "                          this many bytes\n" \
+    " [-j | --jitter ].......: add up to this percentage of random padding\n" \
+    " [-m | --motion ].......: none, rect (moving rectangle) or noise\n" \
+    " [--seed ]..............: seed for noise and jitter, default 1\n" \
+    " ---------------------------------------------------------------\n");
+}
+
+/* the single writer thread */
+void *worker_thread(void *arg)
+{
+    input *in = &pglobal->in[plugin_number];
+    unsigned int rnd = seed;
+    unsigned long long n = 0;
+    struct timespec next;
+    long interval_ns = fps > 0 ? 1000000000L / fps : 0;
+
+    /* Initialize SIMD capabilities */
+    static int simd_initialized = 0;
+    if (!simd_initialized) {
+        detect_simd_capabilities();
+        simd_initialized = 1;
+    }
+
+    /* set cleanup handler to cleanup allocated resources */
+    pthread_cleanup_push(worker_cleanup, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while(!pglobal->stop) {
+        const encoded_frame *src = &frames[n % cycle];
+        size_t extra = 0;
+
+        if(pad > (int)src->size)
+            extra = pad - src->size;
+        if(jitter > 0)
+            extra += (size_t)rand_r(&rnd) % ((src->size + extra) * jitter / 100 + 1);
+
+        /* the COM headers are counted in the padding itself */
+        frame_buffer *fb = input_frame_acquire(in, src->size + extra);
+        if(fb == NULL) {
+            fprintf(stderr, "could not allocate memory\n");
+            break;
+        }
+
+        input_frame_publish(in, fb, (int)build_frame(fb->data, src, extra), NULL);
+        n++;
+
+        if(interval_ns > 0) {
+            /* absolute deadlines keep the rate exact even if publishing
+             * took a while, a late frame is sent immediately */
+            next.tv_nsec += interval_ns;
+            while(next.tv_nsec >= 1000000000L) {
+                next.tv_nsec -= 1000000000L;
+                next.tv_sec++;
+            }
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+        }
+    }
+
+    DBG("leaving input thread, calling cleanup function now\n");
+    /* call cleanup handler, signal with the parameter */
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
+
+void worker_cleanup(void *arg)
+{
+    static unsigned char first_run = 1;
+    int i;
+
+    if(!first_run) {
+        DBG("already cleaned up resources\n");
+        return;
+    }
+
+    first_run = 0;
+    DBG("cleaning up resources allocated by input thread\n");
+
+    if(frames != NULL) {
+        for(i = 0; i < cycle; i++)
+            tjFree(frames[i].data);
+        free(frames);
+        frames = NULL;
+    }
+}
@@ -532,12 +532,6 @@ int input_run(int id)
     input * in = &pglobal->in[id];
     context *pctx = (context*)in->context;
     
-    in->buf = malloc(pctx->videoIn->framesizeIn);
-    if(in->buf == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        exit(EXIT_FAILURE);
-    }
-
     DBG("launching camera thread #%02d\n", id);
     /* create thread and pass context to thread function */
     if(pthread_create(&(pctx->threadID), NULL, cam_thread, in) != 0) {
@@ -626,6 +620,15 @@ void *cam_thread(void *arg)
     
     unsigned int every_count = 0;
     int quality = settings->quality;
+    char labels[64];
+    struct _metric *dropped_every, *dropped_small, *dropped_soft;
+
+    snprintf(labels, sizeof(labels), "input=\"%d\",reason=\"every_frame\"", pcontext->id);
+    dropped_every = metric_counter("mjpg_uvc_dropped_frames_total", labels, "Frames dropped by the UVC input before publishing");
+    snprintf(labels, sizeof(labels), "input=\"%d\",reason=\"minimum_size\"", pcontext->id);
+    dropped_small = metric_counter("mjpg_uvc_dropped_frames_total", labels, "Frames dropped by the UVC input before publishing");
+    snprintf(labels, sizeof(labels), "input=\"%d\",reason=\"soft_framedrop\"", pcontext->id);
+    dropped_soft = metric_counter("mjpg_uvc_dropped_frames_total", labels, "Frames dropped by the UVC input before publishing");
     
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(cam_cleanup, in);
@@ -754,6 +757,7 @@ void *cam_thread(void *arg)
             if ( every_count < every - 1 ) {
                 DBG("dropping %d frame for every=%d\n", every_count + 1, every);
                 ++every_count;
+                metric_add(dropped_every, 1);
                 goto other_select_handlers;
             } else {
                 every_count = 0;
@@ -770,6 +774,7 @@ void *cam_thread(void *arg)
              */
             if(pcontext->videoIn->tmpbytesused < minimum_size) {
                 DBG("dropping too small frame, assuming it as broken\n");
+                metric_add(dropped_small, 1);
                 goto other_select_handlers;
             }
 
@@ -791,6 +796,7 @@ void *cam_thread(void *arg)
                 // if the requested time did not esplashed skip the frame
                 if ((current - last) < pcontext->videoIn->frame_period_time) {
                     DBG("Last frame taken %d ms ago so drop it\n", (current - last));
+                    metric_add(dropped_soft, 1);
                     goto other_select_handlers;
                 }
                 DBG("Lagg: %ld\n", (current - last) - pcontext->videoIn->frame_period_time);
@@ -803,8 +809,13 @@ void *cam_thread(void *arg)
                 goto other_select_handlers;
             }
 
-            /* Optimized frame processing with minimal mutex locking */
+            /* Fill a pooled frame without holding the mutex */
             int compressed_size = 0;
+            frame_buffer *fb = input_frame_acquire(&pglobal->in[pcontext->id], pcontext->videoIn->framesizeIn);
+            if (fb == NULL) {
+                IPRINT("could not allocate frame buffer\n");
+                goto other_select_handlers;
+            }
             
             /*
              * If capturing in YUV mode convert to JPEG now.
@@ -819,12 +830,12 @@ void *cam_thread(void *arg)
             (pcontext->videoIn->formatIn == V4L2_PIX_FMT_RGB565) ) {
                 DBG("compressing frame from input: %d\n", (int)pcontext->id);
                 /* Use optimized YUV compression with cached handle */
-                compressed_size = compress_yuv_to_jpeg_optimized(pcontext, pcontext->videoIn, pglobal->in[pcontext->id].buf, pcontext->videoIn->framesizeIn, quality);
+                compressed_size = compress_yuv_to_jpeg_optimized(pcontext, pcontext->videoIn, fb->data, (int)fb->capacity, quality);
             } else {
             #endif
                 DBG("copying frame from input: %d\n", (int)pcontext->id);
                 /* Use traditional memcpy for MJPEG */
-                compressed_size = memcpy_picture(pglobal->in[pcontext->id].buf, pcontext->videoIn->tmpbuffer, pcontext->videoIn->tmpbytesused);
+                compressed_size = memcpy_picture(fb->data, pcontext->videoIn->tmpbuffer, pcontext->videoIn->tmpbytesused);
             #ifndef NO_LIBJPEG
             }
             #endif
@@ -837,29 +848,12 @@ void *cam_thread(void *arg)
             prev_size = global->size;
 #endif
 
-            /* Lock mutex only for final buffer update - minimize lock time */
-            pthread_mutex_lock(&pglobal->in[pcontext->id].db);
-            
+            /* Publishing is a pointer swap under the mutex */
             if (compressed_size > 0) {
-                /* Update frame metadata */
-                pglobal->in[pcontext->id].prev_size = pglobal->in[pcontext->id].current_size;
-                pglobal->in[pcontext->id].current_size = compressed_size;
-                
-                pglobal->in[pcontext->id].size = compressed_size;
-                pglobal->in[pcontext->id].timestamp = pcontext->videoIn->tmptimestamp;
-                pglobal->in[pcontext->id].frame_timestamp_ms = (pcontext->videoIn->tmptimestamp.tv_sec * 1000LL) + (pcontext->videoIn->tmptimestamp.tv_usec / 1000);
-                
-                /* Increment frame sequence for multi-consumer detection */
-                pglobal->in[pcontext->id].frame_sequence++;
-                
-                /* signal fresh_frame */
-                pthread_cond_broadcast(&pglobal->in[pcontext->id].db_update);
-                
-                /* Unlock mutex before waiting for output plugins */
-                pthread_mutex_unlock(&pglobal->in[pcontext->id].db);
-                
+                fb->capture_us = pcontext->videoIn->capture_us;
+                input_frame_publish(&pglobal->in[pcontext->id], fb, compressed_size, &pcontext->videoIn->tmptimestamp);
             } else {
-                pthread_mutex_unlock(&pglobal->in[pcontext->id].db);
+                input_frame_put(fb);
             }
         }
 
@@ -906,10 +900,6 @@ void cam_cleanup(void *arg)
         pctx->videoIn = NULL;
     }
     
-    free(in->buf);
-    in->buf = NULL;
-    in->size = 0;
-    
     /* cleanup optimizations */
     cleanup_optimized_select(pctx);
     cleanup_turbojpeg_handle(pctx);
@@ -1091,6 +1091,7 @@ int uvcGrab(struct vdIn *vd)
         perror("Unable to dequeue buffer");
         goto err;
     }
+    vd->capture_us = time_monotonic_us();
 
     switch(vd->formatIn) {
     case V4L2_PIX_FMT_JPEG:
@@ -1111,18 +1112,20 @@ int uvcGrab(struct vdIn *vd)
             context *pcontext = (context *)vd->context_ptr;
             if (pcontext->id >= 0 && pcontext->pglobal != NULL) {
                 
-                /* Lock global buffer for direct copy */
-                pthread_mutex_lock(&pcontext->pglobal->in[pcontext->id].db);
-                
+                /* Copy straight into a pooled frame, no mutex needed until publish */
+                input *in = &pcontext->pglobal->in[pcontext->id];
+                frame_buffer *fb = input_frame_acquire(in, vd->framesizeIn);
+                int copied_size = 0;
                 
                 /* Use direct MJPEG copy with validation */
-                int copied_size = memcpy_mjpeg_direct(
-                    vd->mem[vd->buf.index], 
-                    pcontext->pglobal->in[pcontext->id].buf, 
-                    vd->buf.bytesused, 
-                    HEADERFRAME1
-                );
-                
+                if (fb != NULL) {
+                    copied_size = memcpy_mjpeg_direct(
+                        vd->mem[vd->buf.index], 
+                        fb->data, 
+                        vd->buf.bytesused, 
+                        HEADERFRAME1
+                    );
+                }
                 
                 if (copied_size > 0) {
                     /* Success - prepare data for main processing */
@@ -1130,28 +1133,16 @@ int uvcGrab(struct vdIn *vd)
                     vd->tmptimestamp = vd->buf.timestamp;
                     vd->direct_copy_used = 1; /* Mark as directly copied */
                     
-                    /* Update frame metadata for direct copy path */
-                    pcontext->pglobal->in[pcontext->id].prev_size = pcontext->pglobal->in[pcontext->id].current_size;
-                    pcontext->pglobal->in[pcontext->id].current_size = copied_size;
-                    pcontext->pglobal->in[pcontext->id].size = copied_size;
-                    pcontext->pglobal->in[pcontext->id].timestamp = vd->buf.timestamp;
-                    pcontext->pglobal->in[pcontext->id].frame_timestamp_ms = (vd->buf.timestamp.tv_sec * 1000LL) + (vd->buf.timestamp.tv_usec / 1000);
-                    pcontext->pglobal->in[pcontext->id].frame_sequence++;
-                    
-                    /* Signal fresh frame */
-                    pthread_cond_broadcast(&pcontext->pglobal->in[pcontext->id].db_update);
-                    
-                    /* Unlock mutex before waiting for output plugins */
-                    pthread_mutex_unlock(&pcontext->pglobal->in[pcontext->id].db);
-                    
+                    fb->capture_us = vd->capture_us;
+                    input_frame_publish(in, fb, copied_size, &vd->buf.timestamp);
                     
                     if(debug) {
                         fprintf(stderr, "MJPEG direct copy: %d bytes\n", copied_size);
                     }
                     break; /* Skip fallback to tmpbuffer */
                 } else {
-                    /* Direct copy failed - unlock and fallback to tmpbuffer */
-                    pthread_mutex_unlock(&pcontext->pglobal->in[pcontext->id].db);
+                    /* Direct copy failed - fallback to tmpbuffer */
+                    input_frame_put(fb);
                 }
             }
         }
@@ -122,6 +122,7 @@ struct vdIn {
     int recordtime;
     uint32_t tmpbytesused;
     struct timeval tmptimestamp;
+    long long capture_us; // CLOCK_MONOTONIC at VIDIOC_DQBUF
     v4l2_std_id vstd;
     unsigned long frame_period_time; // in ms
     unsigned char soft_framedrop;
@@ -53,12 +53,9 @@ static int input_number = 0;
 static char *mjpgFileName = NULL;
 static char *linkFileName = NULL;
 static char *fixedFileName = NULL;
+static frame_cursor file_cursor = {0, 0};
 
-/* Performance optimization: static buffers */
-#define MAX_FRAME_SIZE (256*1024)  /* 256KB for typical JPEG frames */
 #define BUFFER_SIZE 1024           /* 1KB buffer size */
-static unsigned char static_framebuffer[MAX_FRAME_SIZE];
-static int use_static_buffers = 1;
 
 /* File I/O buffering for better performance */
 typedef struct {
@@ -157,6 +154,9 @@ void worker_cleanup(void *arg)
 
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
+    if (file_cursor.skipped > 0) {
+        OPRINT("frames skipped because the writer fell behind: %llu\n", file_cursor.skipped);
+    }
 
     close(fd);
 }
@@ -292,7 +292,6 @@ void *worker_thread(void *arg)
     unsigned long long counter = 0;
     time_t t;
     struct tm *now;
-    unsigned char *tmp_framebuffer = NULL;
     
     /* Initialize SIMD capabilities for optimal performance */
     static int simd_initialized = 0;
@@ -310,52 +309,28 @@ void *worker_thread(void *arg)
     while(ok >= 0 && !pglobal->stop) {
         DBG("waiting for fresh frame\n");
 
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        
-        if (!is_new_frame_available(&pglobal->in[input_number], &last_file_sequence)) {
-            /* No new frame, wait for signal with timeout */
-            struct timespec timeout;
-            calculate_wait_timeout(&pglobal->in[input_number], &timeout);
-            int ret = pthread_cond_timedwait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db, &timeout);
-            if (ret == ETIMEDOUT) {
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                continue;
-            }
-            /* Check again after signal */
-            if (!is_new_frame_available(&pglobal->in[input_number], &last_file_sequence)) {
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                continue;
-            }
-        }
-
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-
-        /* Use static buffer if available and sufficient, otherwise fallback to dynamic */
-        unsigned char *current_frame = NULL;
-        if (use_static_buffers && frame_size <= MAX_FRAME_SIZE) {
-            /* Use static buffer for better performance */
-            current_frame = static_framebuffer;
+        /*
+         * reference the next frame, it is written straight from the shared buffer.
+         * Without a delay every frame should be stored, so walk the frame ring
+         * and only lose frames once we fell behind by more than its depth.
+         * With a delay just sample the newest frame.
+         */
+        frame_buffer *fb;
+        if (delay > 0) {
+            fb = input_frame_wait(&pglobal->in[input_number], &last_file_sequence, 1000);
         } else {
-            /* Fallback to dynamic allocation for large frames */
-            if(tmp_framebuffer == NULL || frame_size > 1024*1024) { // 1MB limit
-                if(tmp_framebuffer != NULL) free(tmp_framebuffer);
-                tmp_framebuffer = malloc(frame_size);
-                if(tmp_framebuffer == NULL) {
-                    pthread_mutex_unlock(&pglobal->in[input_number].db);
-                    LOG("not enough memory for frame buffer\n");
-                    break;
-                }
+            unsigned long long skipped = file_cursor.skipped;
+            fb = input_frame_next(&pglobal->in[input_number], &file_cursor, 1000);
+            if (file_cursor.skipped != skipped) {
+                DBG("writer fell behind, skipped %llu frames (%llu total)\n",
+                    file_cursor.skipped - skipped, file_cursor.skipped);
             }
-            current_frame = tmp_framebuffer;
         }
-        
-        /* copy frame to our local buffer using SIMD optimization */
-        simd_memcpy(current_frame, pglobal->in[input_number].buf, frame_size);
-
-        /* allow others to access the global buffer again */
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
-        
+        if (fb == NULL) {
+            continue;
+        }
+        unsigned char *current_frame = fb->data;
+        frame_size = fb->size;
 
         if (mjpgFileName == NULL) { // single files with ringbuffer mode
             /* prepare filename */
@@ -371,12 +346,14 @@ void *worker_thread(void *arg)
                 now = localtime(&t);
                 if(now == NULL) {
                     perror("localtime");
+                    input_frame_put(fb);
                     return NULL;
                 }
 
                 /* prepare string, add time and date values */
                 if(strftime(buffer1, sizeof(buffer1), "%%s/%Y_%m_%d_%H_%M_%S_picture_%%09llu.jpg", now) == 0) {
                     OPRINT("strftime returned 0\n");
+                    input_frame_put(fb);
                     return NULL;
                 }
 
@@ -390,6 +367,7 @@ void *worker_thread(void *arg)
             /* open file for write */
             if((fd = open(buffer2, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
                 OPRINT("could not open the file %s\n", buffer2);
+                input_frame_put(fb);
                 return NULL;
             }
 
@@ -402,12 +380,14 @@ void *worker_thread(void *arg)
                 perror("write()");
                 flush_file_buffer(&file_buf);
                 close(fd);
+                input_frame_put(fb);
                 return NULL;
             }
 
             /* Flush any remaining data and close file */
             flush_file_buffer(&file_buf);
             close(fd);
+            input_frame_put(fb);
 
             /* link the picture as fixed name file */
             if (linkFileName) {
@@ -464,8 +444,10 @@ void *worker_thread(void *arg)
                 perror("write()");
                 flush_file_buffer(&file_buf);
                 close(fd);
+                input_frame_put(fb);
                 return NULL;
             }
+            input_frame_put(fb);
         }
 
         /* if specified, wait now */
@@ -722,35 +704,13 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
 					DBG("Generic control found (id: %d): %s\n", control_id, pglobal->out[plugin_id].out_parameters[i].ctrl.name);
 					switch(control_id) {
                             case OUT_FILE_CMD_TAKE: {
-                                unsigned char *tmp_framebuffer = NULL;
                                 if (valueStr != NULL) {
-                                    int frame_size = 0;
-                                    unsigned char *current_frame = NULL;
-
-                                    if(pthread_mutex_lock(&pglobal->in[input_number].db)) {
-                                        DBG("Unable to lock mutex\n");
+                                    /* reference the current frame, no copy needed */
+                                    frame_buffer *fb = input_frame_get(&pglobal->in[input_number]);
+                                    if(fb == NULL) {
+                                        DBG("no frame available\n");
                                         return -1;
                                     }
-                                    /* read buffer */
-                                    frame_size = pglobal->in[input_number].size;
-
-                                    /* allocate buffer for frame copy */
-                                    if(tmp_framebuffer == NULL || frame_size > 1024*1024) { // 1MB limit
-                                        if(tmp_framebuffer != NULL) free(tmp_framebuffer);
-                                        tmp_framebuffer = malloc(frame_size);
-                                        if(tmp_framebuffer == NULL) {
-                                            pthread_mutex_unlock(&pglobal->in[input_number].db);
-                                            DBG("not enough memory for frame buffer\n");
-                                            return -1;
-                                        }
-                                    }
-                                    
-                                    /* copy frame to our local buffer */
-                                    simd_memcpy(tmp_framebuffer, pglobal->in[input_number].buf, frame_size);
-                                    current_frame = tmp_framebuffer;
-
-                                    /* allow others to access the global buffer again */
-                                    pthread_mutex_unlock(&pglobal->in[input_number].db);
 
                                     DBG("writing file: %s\n", valueStr);
 
@@ -758,27 +718,25 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
                                     /* open file for write */
                                     if((fd = open(valueStr, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
                                         OPRINT("could not open the file %s\n", valueStr);
+                                        input_frame_put(fb);
                                         return -1;
                                     }
 
                                     /* save picture to file */
-                                    if(write(fd, current_frame, frame_size) < 0) {
+                                    if(write(fd, fb->data, fb->size) < 0) {
                                         OPRINT("could not write to file %s\n", valueStr);
                                         perror("write()");
                                         close(fd);
+                                        input_frame_put(fb);
                                         return -1;
                                     }
 
                                     close(fd);
+                                    input_frame_put(fb);
                                 } else {
                                     DBG("No filename specified\n");
                                     return -1;
                                 }
-                                
-                                /* cleanup */
-                                if(tmp_framebuffer != NULL) {
-                                    free(tmp_framebuffer);
-                                }
                             } break;
                             case OUT_FILE_CMD_FILENAME: {
                                 DBG("Not yet implemented\n");
@@ -0,0 +1,64 @@
+#!/bin/bash
+
+################################################################################
+# Compares the CPU the HTTP server spends per Gbit/s of stream data with and
+# without --zerocopy. Start it from the build directory:
+#
+#   ./zerocopy_bench.sh "input_file.so -f /path/to/big/jpegs -e -d 0.01" 50 20
+#
+# The first argument is the input plugin, then the number of /stream clients
+# and the seconds to measure. Frames smaller than 64 kB are always copied.
+# On loopback the kernel copies MSG_ZEROCOPY sends as well
+# (mjpg_http_zerocopy_copied_total), there the numbers show the overhead of
+# the notifications, the saving needs a real NIC and a remote client.
+#
+################################################################################
+
+INPUT=${1:-"input_file.so -f pics -e -d 0.01"}
+CLIENTS=${2:-20}
+SECONDS_RUN=${3:-10}
+PORT=${PORT:-8099}
+STREAMER=${STREAMER:-./mjpg_streamer}
+TICKS=$(getconf CLK_TCK)
+
+metric() {
+    curl -s "http://127.0.0.1:${PORT}/metrics" | awk -v m="$1" '$1 ~ "^"m {s += $2} END {printf "%d\n", s}'
+}
+
+cpu_ticks() {
+    awk '{print $14 + $15}' "/proc/$1/stat"
+}
+
+run() {
+    "${STREAMER}" -i "${INPUT}" -o "output_http.so -p ${PORT} $1" >/dev/null 2>&1 &
+    local pid=$!
+    sleep 2
+
+    local i
+    for i in $(seq "${CLIENTS}"); do
+        curl -s -o /dev/null --max-time $((SECONDS_RUN + 5)) "http://127.0.0.1:${PORT}/stream" &
+    done
+    sleep 1
+
+    local bytes0 ticks0 bytes1 ticks1 copied
+    bytes0=$(metric mjpg_http_bytes_sent_total)
+    ticks0=$(cpu_ticks ${pid})
+    sleep "${SECONDS_RUN}"
+    bytes1=$(metric mjpg_http_bytes_sent_total)
+    ticks1=$(cpu_ticks ${pid})
+    copied=$(metric mjpg_http_zerocopy_copied_total)
+
+    kill ${pid}
+    wait 2>/dev/null
+
+    awk -v b=$((bytes1 - bytes0)) -v t=$((ticks1 - ticks0)) -v hz="${TICKS}" \
+        -v s="${SECONDS_RUN}" -v name="${2}" -v copied="${copied}" 'BEGIN {
+        gbits = b * 8 / s / 1e9
+        cpu = t / hz / s
+        printf "%-10s %8.3f Gbit/s %6.2f CPU %8.3f CPU per Gbit/s, %d sends copied\n",
+               name, gbits, cpu, gbits > 0 ? cpu / gbits : 0, copied
+    }'
+}
+
+run "" "copy"
+run "--zerocopy" "zerocopy"
@@ -26,15 +26,22 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <pthread.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #ifdef __linux__
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
 #endif
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <errno.h>
@@ -55,6 +62,7 @@
 
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
+#include "../../jpeg_utils.h"
 
 #include "httpd.h"
 
@@ -114,129 +122,147 @@ static int flush_write_buffer(write_buffer *wb) {
     return result;
 }
 
-/* HTTP Keep-Alive support functions */
-static int should_use_keep_alive(int fd) {
-    /* For now, use Keep-Alive for all connections */
-    /* In future, could check client capabilities or configuration */
-    return 1;
-}
-
-/* Stage 3: epoll async I/O functions */
+/* event loop backend: epoll on Linux, poll() elsewhere */
+/******************************************************************************
+Description.: register a descriptor with an event loop
+Input Value.: l: event loop
+              s: source, loop_wait() hands its address back
+              events: LOOP_READ and/or LOOP_WRITE
+Return Value: 0 on success, -1 on error
+******************************************************************************/
+static int loop_add(event_loop *l, loop_source *s, int events)
+{
 #ifdef __linux__
-int init_async_io(async_io_context *ctx, int max_events) {
-    ctx->max_events = max_events;
-    ctx->client_count = 0;
-    ctx->server_socket_count = 0;
-    
-    ctx->epfd = epoll_create1(EPOLL_CLOEXEC);
-    if (ctx->epfd == -1) {
-        perror("epoll_create1");
-        return -1;
-    }
-    
-    ctx->events = malloc(max_events * sizeof(struct epoll_event));
-    if (!ctx->events) {
-        close(ctx->epfd);
-        return -1;
-    }
-    
-    return 0;
-}
+    struct epoll_event ev;
 
-void cleanup_async_io(async_io_context *ctx) {
-    if (ctx->events) {
-        free(ctx->events);
-        ctx->events = NULL;
-    }
-    if (ctx->epfd != -1) {
-        close(ctx->epfd);
-        ctx->epfd = -1;
-    }
-}
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((events & LOOP_READ) ? EPOLLIN : 0) | ((events & LOOP_WRITE) ? EPOLLOUT : 0);
+#ifdef EPOLLEXCLUSIVE
+    /* wake a single event loop for an incoming connection */
+    if(s->type == SRC_LISTEN)
+        ev.events |= EPOLLEXCLUSIVE;
+#endif
+    ev.data.ptr = s;
+    return epoll_ctl(l->epfd, EPOLL_CTL_ADD, s->fd, &ev);
+#else
+    if(l->count == l->capacity) {
+        int capacity = l->capacity ? l->capacity * 2 : MAX_EPOLL_EVENTS;
+        struct pollfd *pfds = realloc(l->pfds, capacity * sizeof(struct pollfd));
+        loop_source **sources;
 
-int add_server_socket(async_io_context *ctx, int sockfd) {
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = sockfd;
-    
-    if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
-        perror("epoll_ctl: ADD server socket");
-        return -1;
+        if(pfds == NULL)
+            return -1;
+        l->pfds = pfds;
+        if((sources = realloc(l->sources, capacity * sizeof(loop_source *))) == NULL)
+            return -1;
+        l->sources = sources;
+        l->capacity = capacity;
     }
-    
-    ctx->server_sockets[ctx->server_socket_count] = sockfd;
-    ctx->server_socket_count++;
-    
+    l->pfds[l->count].fd = s->fd;
+    l->pfds[l->count].events = ((events & LOOP_READ) ? POLLIN : 0) | ((events & LOOP_WRITE) ? POLLOUT : 0);
+    l->pfds[l->count].revents = 0;
+    l->sources[l->count++] = s;
     return 0;
+#endif
 }
 
-int add_client_socket(async_io_context *ctx, int sockfd) {
+/******************************************************************************
+Description.: change the events a registered descriptor is watched for
+Input Value.: l: event loop
+              s: registered source
+              events: LOOP_READ and/or LOOP_WRITE
+Return Value: -
+******************************************************************************/
+static void loop_mod(event_loop *l, loop_source *s, int events)
+{
+#ifdef __linux__
     struct epoll_event ev;
-    ev.events = EPOLLIN | EPOLLET;  /* Edge-triggered for clients */
-    ev.data.fd = sockfd;
-    
-    if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
-        perror("epoll_ctl: ADD client socket");
-        return -1;
-    }
-    
-    ctx->client_count++;
-    return 0;
-}
 
-int remove_client_socket(async_io_context *ctx, int sockfd) {
-    if (epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, sockfd, NULL) == -1) {
-        perror("epoll_ctl: DEL client socket");
-        return -1;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((events & LOOP_READ) ? EPOLLIN : 0) | ((events & LOOP_WRITE) ? EPOLLOUT : 0);
+    ev.data.ptr = s;
+    epoll_ctl(l->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+#else
+    int i;
+
+    for(i = 0; i < l->count; i++) {
+        if(l->sources[i] == s) {
+            l->pfds[i].events = ((events & LOOP_READ) ? POLLIN : 0) | ((events & LOOP_WRITE) ? POLLOUT : 0);
+            break;
+        }
     }
-    
-    ctx->client_count--;
-    return 0;
+#endif
 }
+
+/******************************************************************************
+Description.: stop watching a descriptor, call it before closing the descriptor
+Input Value.: l: event loop
+              s: registered source
+Return Value: -
+******************************************************************************/
+static void loop_del(event_loop *l, loop_source *s)
+{
+#ifdef __linux__
+    epoll_ctl(l->epfd, EPOLL_CTL_DEL, s->fd, NULL);
 #else
-/* Fallback implementations for non-Linux systems */
-int init_async_io(async_io_context *ctx, int max_events) {
-    ctx->max_events = max_events;
-    ctx->client_count = 0;
-    ctx->server_socket_count = 0;
-    ctx->epfd = -1;
-    ctx->events = NULL;
-    return 0;
-}
+    int i;
 
-void cleanup_async_io(async_io_context *ctx) {
-    /* No-op for non-Linux systems */
+    for(i = 0; i < l->count; i++) {
+        if(l->sources[i] == s) {
+            l->count--;
+            l->pfds[i] = l->pfds[l->count];
+            l->sources[i] = l->sources[l->count];
+            break;
+        }
+    }
+#endif
 }
 
-int add_server_socket(async_io_context *ctx, int sockfd) {
-    /* No-op for non-Linux systems */
-    return 0;
-}
+/******************************************************************************
+Description.: wait for ready descriptors
+Input Value.: l: event loop
+              ready: receives the ready sources
+              events: receives LOOP_READ/LOOP_WRITE for each source, errors
+                      and hangups are reported as both
+              max: size of ready and events
+              timeout_ms: maximum time to wait
+Return Value: number of ready sources, 0 on timeout, -1 on error
+******************************************************************************/
+static int loop_wait(event_loop *l, loop_source **ready, int *events, int max, int timeout_ms)
+{
+    int i, n = 0;
+#ifdef __linux__
+    struct epoll_event ev[MAX_EPOLL_EVENTS];
 
-int add_client_socket(async_io_context *ctx, int sockfd) {
-    /* No-op for non-Linux systems */
-    return 0;
-}
+    n = epoll_wait(l->epfd, ev, MIN(max, MAX_EPOLL_EVENTS), timeout_ms);
+    for(i = 0; i < n; i++) {
+        ready[i] = ev[i].data.ptr;
+        events[i] = ((ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) ? LOOP_READ : 0) |
+                    ((ev[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) ? LOOP_WRITE : 0);
+    }
+#else
+    int rc = poll(l->pfds, l->count, timeout_ms);
 
-int remove_client_socket(async_io_context *ctx, int sockfd) {
-    /* No-op for non-Linux systems */
-    return 0;
-}
+    if(rc <= 0)
+        return rc;
+    for(i = 0; i < l->count && n < max; i++) {
+        short revents = l->pfds[i].revents;
+        if(revents == 0)
+            continue;
+        ready[n] = l->sources[i];
+        events[n++] = ((revents & (POLLIN | POLLERR | POLLHUP)) ? LOOP_READ : 0) |
+                      ((revents & (POLLOUT | POLLERR | POLLHUP)) ? LOOP_WRITE : 0);
+    }
 #endif
-
+    return n;
+}
 
 static globals *pglobal;
-extern context servers[MAX_OUTPUT_PLUGINS];
+extern context *servers;
 
 /* Forward declarations */
 int unescape(char *string);
-static int parse_short_path(const char *buffer, const char *path_prefix, int *number);
-
-/* Helper function to check client status and set error if needed */
-static int check_and_handle_client_status(cfd *lcfd, request *req, int *query_suffixed)
-{
-    return 0;
-}
+static void send_text(connection *c, const char *content_type, char *text, size_t length);
 
 /* Helper function to parse parameter from buffer */
 static int parse_parameter(const char *buffer, const char *prefix, char **parameter, const char *allowed_chars)
@@ -261,176 +287,181 @@ static int parse_parameter(const char *buffer, const char *prefix, char **parame
     return len;
 }
 
-/* Helper function to parse short path and extract action type and number */
-static int parse_short_path(const char *buffer, const char *path_prefix, int *number)
+/* Parse the decimal input number at *pp of any length, advancing past the
+   digits. Values that cannot be an input index give -1, so the range check
+   rejects them instead of atoi() overflowing. */
+static int parse_input_number(const char **pp)
 {
-    char path_pattern[32];
-    // Try GET first
-    snprintf(path_pattern, sizeof(path_pattern), "GET /%s", path_prefix);
-    const char *pb = strstr(buffer, path_pattern);
-    if (pb == NULL) {
-        // Try POST for stream
-        snprintf(path_pattern, sizeof(path_pattern), "POST /%s", path_prefix);
-        pb = strstr(buffer, path_pattern);
-        if (pb == NULL) {
-            return 0; // Not found
-        }
+    const char *p = *pp;
+    int value = 0;
+
+    for (; *p >= '0' && *p <= '9'; p++) {
+        int digit = *p - '0';
+        if (value >= 0)
+            value = (value > (INT_MAX - digit) / 10) ? -1 : value * 10 + digit;
     }
-    pb += strlen(path_pattern);
-    
-    // Check if there's a number after the path
-    if (*pb >= '0' && *pb <= '9') {
-        *number = atoi(pb);
-        // Skip digits
-        while (*pb >= '0' && *pb <= '9') pb++;
-        // Check if there's a query string or end
-        if (*pb == ' ' || *pb == '?' || *pb == '\r' || *pb == '\n' || *pb == '\0') {
-            return 1; // Found with number
-        }
-    } else if (*pb == ' ' || *pb == '?' || *pb == '\r' || *pb == '\n' || *pb == '\0') {
-        *number = 0; // Default to 0 if no number specified
-        return 1; // Found without number
+    *pp = p;
+    return value;
+}
+
+/* Value of the query parameter name in the request line, NULL if the URI
+   does not carry it. */
+static const char *parse_query_value(const char *buffer, const char *name)
+{
+    const char *p = strchr(buffer, '?');
+    size_t len = strlen(name);
+
+    while(p != NULL && (*p == '?' || *p == '&')) {
+        p++;
+        if(strncmp(p, name, len) == 0 && p[len] == '=')
+            return p + len + 1;
+        p += strcspn(p, "& \r");
     }
-    return 0; // Not a valid path
+    return NULL;
 }
 
-/******************************************************************************
-Description.: initializes the iobuffer structure properly
-Input Value.: pointer to already allocated iobuffer
-Return Value: iobuf
-******************************************************************************/
-void init_iobuffer(iobuffer *iobuf)
+/* Value of the numeric query parameter name in the request line, def if the
+   URI does not carry it or it is out of range. */
+static int parse_query_int(const char *buffer, const char *name, int def)
 {
-    memset(iobuf->buffer, 0, sizeof(iobuf->buffer));
-    iobuf->level = 0;
+    const char *p = parse_query_value(buffer, name);
+    int value;
+
+    if(p == NULL || *p < '0' || *p > '9')
+        return def;
+    value = parse_input_number(&p);
+    return value < 0 ? def : value;
 }
 
-/******************************************************************************
-Description.: initializes the request structure properly
-Input Value.: pointer to already allocated req
-Return Value: req
-******************************************************************************/
-void init_request(request *req)
+/* Pick the JPEG variant of ?scale=1/N (or N) and &q=, N being one of the
+   TurboJPEG DCT scaling divisors. The original frame is kept if neither is
+   given. Returns -1 for values that cannot be served. */
+static int parse_variant(const char *buffer, int *scale, int *quality)
 {
-    req->type        = A_UNKNOWN;
-    req->parameter   = NULL;
-    req->client      = NULL;
-    req->credentials = NULL;
+    const char *p = parse_query_value(buffer, "scale");
+
+    *scale = 1;
+    if(p != NULL) {
+        if(strncmp(p, "1/", 2) == 0)
+            p += 2;
+        *scale = (*p >= '0' && *p <= '9') ? parse_input_number(&p) : -1;
+        if(*scale != 1 && *scale != 2 && *scale != 4 && *scale != 8)
+            return -1;
+    }
+
+    *quality = parse_query_int(buffer, "q", 0);
+    if(*quality > 100)
+        return -1;
+    if(*quality == 0 && *scale > 1)
+        *quality = VARIANT_QUALITY;
+    return 0;
+}
+
+/* paths answered by the server itself, see request_route() */
+static const route routes[] = {
+    { "snapshot",  8, A_SNAPSHOT,  1 },
+    { "stream",    6, A_STREAM,    1 },
+    { "ws/stream", 9, A_WEBSOCKET, 1 },
+    { "mosaic",    6, A_MOSAIC,    0 },
+    { "metrics",   7, A_METRICS,   0 },
+    { "latency",   7, A_LATENCY,   0 },
+    { "clients",   7, A_CLIENTS,   0 },
+    { "take",      4, A_TAKE,      1 }
+};
+
+/* header fields handle_request() looks at and where request_parse() puts them */
+static const struct {
+    const char *name;
+    size_t len;
+    size_t offset;
+} request_headers[] = {
+    { "If-None-Match",     13, offsetof(request, if_none_match) },
+    { "If-Modified-Since", 17, offsetof(request, if_modified_since) },
+    { "Accept-Encoding",   15, offsetof(request, accept_encoding) },
+    { "Sec-WebSocket-Key", 17, offsetof(request, ws_key) },
+    { "Connection",        10, offsetof(request, connection) },
+    { "Content-Length",    14, offsetof(request, content_length) },
+    { "Transfer-Encoding", 17, offsetof(request, transfer_encoding) },
+    { "User-Agent",        10, offsetof(request, client) },
+    { "Authorization",     13, offsetof(request, credentials) }
+};
+
+/* NUL terminate the line ending at eol, with or without CR */
+static char *request_line_end(char *line, char *eol)
+{
+    *eol = '\0';
+    if(eol > line && eol[-1] == '\r')
+        eol[-1] = '\0';
+    return eol + 1;
 }
 
 /******************************************************************************
-Description.: If strings were assigned to the different members free them
-              This will fail if strings are static, so always use strdup().
-Input Value.: req: pointer to request structure
-Return Value: -
+Description.: Split the request header into its parts where it is. Lines are
+              found with memchr(), the request line and the header values
+              are NUL terminated in place and nothing is copied.
+Input Value.: c: connection, the header is c->request[0..c->request_end)
+              req: receives pointers into c->request
+Return Value: 0 if the request line is usable, -1 if not
 ******************************************************************************/
-void free_request(request *req)
-{
-    if(req->parameter != NULL) free(req->parameter);
-    if(req->client != NULL) free(req->client);
-    if(req->credentials != NULL) free(req->credentials);
-    if(req->query_string != NULL) free(req->query_string);
-}
-
-/******************************************************************************
-Description.: read with timeout, implemented without using signals
-              tries to read len bytes and returns if enough bytes were read
-              or the timeout was triggered. In case of timeout the return
-              value may differ from the requested bytes "len".
-Input Value.: * fd.....: fildescriptor to read from
-              * iobuf..: iobuffer that allows to use this functions from multiple
-                         threads because the complete context is the iobuffer.
-              * buffer.: The buffer to store values at, will be set to zero
-                         before storing values.
-              * len....: the length of buffer
-              * timeout: seconds to wait for an answer
-Return Value: * buffer.: will become filled with bytes read
-              * iobuf..: May get altered to save the context for future calls.
-              * func().: bytes copied to buffer or -1 in case of error
-******************************************************************************/
-int _read(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
-{
-    int copied = 0, rc, i;
-    fd_set fds;
-    struct timeval tv;
-
-    memset(buffer, 0, len);
-
-    while((copied < len)) {
-        i = MIN(iobuf->level, len - copied);
-        memcpy(buffer + copied, iobuf->buffer + IO_BUFFER - iobuf->level, i);
-
-        iobuf->level -= i;
-        copied += i;
-        if(copied >= len)
-            return copied;
-
-        /* select will return in case of timeout or new data arrived */
-        tv.tv_sec = timeout;
-        tv.tv_usec = 0;
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        if((rc = select(fd + 1, &fds, NULL, NULL, &tv)) <= 0) {
-            if(rc < 0)
-                exit(EXIT_FAILURE);
+static int request_parse(connection *c, request *req)
+{
+    char *line = c->request, *end = c->request + c->request_end;
+    char *eol, *colon, *value;
+    size_t i, len;
 
-            /* this must be a timeout */
-            return copied;
-        }
+    memset(req, 0, sizeof(*req));
 
-        init_iobuffer(iobuf);
+    /* the header ends with an empty line, so each line has its LF */
+    eol = memchr(line, '\n', end - line);
+    req->method = line;
+    line = request_line_end(line, eol);
 
-        /*
-         * there should be at least one byte, because select signalled it.
-         * But: It may happen (very seldomly), that the socket gets closed remotly between
-         * the select() and the following read. That is the reason for not relying
-         * on reading at least one byte.
-         */
-        if((iobuf->level = read(fd, &iobuf->buffer, IO_BUFFER)) <= 0) {
-            /* an error occured */
-            return -1;
-        }
+    if((req->target = strchr(req->method, ' ')) == NULL)
+        return -1;
+    *req->target++ = '\0';
+    if((req->version = strchr(req->target, ' ')) != NULL)
+        *req->version++ = '\0';
+    if(req->target[0] != '/')
+        return -1;
 
-        /* align data to the end of the buffer if less than IO_BUFFER bytes were read */
-        memmove(iobuf->buffer + (IO_BUFFER - iobuf->level), iobuf->buffer, iobuf->level);
+    for(; line < end && (eol = memchr(line, '\n', end - line)) != NULL; line = request_line_end(line, eol)) {
+        if((colon = memchr(line, ':', eol - line)) == NULL)
+            continue;
+        len = colon - line;
+        for(i = 0; i < LENGTH_OF(request_headers); i++) {
+            if(request_headers[i].len != len || strncasecmp(line, request_headers[i].name, len) != 0)
+                continue;
+            for(value = colon + 1; *value == ' ' || *value == '\t'; value++);
+            *(char **)((char *)req + request_headers[i].offset) = value;
+            break;
+        }
     }
-
     return 0;
 }
 
 /******************************************************************************
-Description.: Read a single line from the provided fildescriptor.
-              This funtion will return under two conditions:
-              * line end was reached
-              * timeout occured
-Input Value.: * fd.....: fildescriptor to read from
-              * iobuf..: iobuffer that allows to use this functions from multiple
-                         threads because the complete context is the iobuffer.
-              * buffer.: The buffer to store values at, will be set to zero
-                         before storing values.
-              * len....: the length of buffer
-              * timeout: seconds to wait for an answer
-Return Value: * buffer.: will become filled with bytes read
-              * iobuf..: May get altered to save the context for future calls.
-              * func().: bytes copied to buffer or -1 in case of error
+Description.: Look the request target up in the routes table. The path has
+              to match a route completely, optionally followed by the input
+              number as /stream1 or, like older versions, /stream_1.
+Input Value.: req: parsed request
+              number: receives the input number, 0 if none is given
+Return Value: the route or NULL for a file request
 ******************************************************************************/
-/* read just a single line or timeout */
-int _readline(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
+static const route *request_route(request *req, int *number)
 {
-    char c = '\0', *out = buffer;
-    int i;
-
-    memset(buffer, 0, len);
+    const char *path = req->target + 1, *p;
+    size_t i, len = strspn(path, "abcdefghijklmnopqrstuvwxyz/");
 
-    for(i = 0; i < len && c != '\n'; i++) {
-        if(_read(fd, iobuf, &c, 1, timeout) <= 0) {
-            /* timeout or error occured */
-            return -1;
-        }
-        *out++ = c;
+    for(i = 0; i < LENGTH_OF(routes); i++) {
+        if(routes[i].len != len || memcmp(path, routes[i].path, len) != 0)
+            continue;
+        p = path + len;
+        if(*p == '_' && p[1] >= '0' && p[1] <= '9')
+            p++;
+        *number = (*p >= '0' && *p <= '9') ? parse_input_number(&p) : 0;
+        return (*p == '\0' || *p == '?') ? &routes[i] : NULL;
     }
-
-    return i;
+    return NULL;
 }
 
 /******************************************************************************
@@ -478,6 +509,96 @@ void decodeBase64(char *data)
     *data = '\0';
 }
 
+/******************************************************************************
+Description.: base64 encode a buffer
+Input Value.: in, len: data
+              out: receives (len + 2) / 3 * 4 + 1 characters
+Return Value: -
+******************************************************************************/
+static void encodeBase64(const unsigned char *in, size_t len, char *out)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned ch;
+    size_t i;
+
+    for(i = 0; i < len; i += 3) {
+        ch = in[i] << 16 | (i + 1 < len ? in[i + 1] << 8 : 0) | (i + 2 < len ? in[i + 2] : 0);
+        *out++ = table[(ch >> 18) & 63];
+        *out++ = table[(ch >> 12) & 63];
+        *out++ = i + 1 < len ? table[(ch >> 6) & 63] : '=';
+        *out++ = i + 2 < len ? table[ch & 63] : '=';
+    }
+    *out = '\0';
+}
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/******************************************************************************
+Description.: SHA-1 digest, as the WebSocket handshake requires
+Input Value.: data, len: message
+              digest: receives 20 bytes
+Return Value: -
+******************************************************************************/
+static void sha1(const unsigned char *data, size_t len, unsigned char digest[20])
+{
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    unsigned long long bits = (unsigned long long)len * 8;
+    unsigned char block[64];
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    size_t done = 0, n;
+    int i, last = 0;
+
+    while(!last) {
+        /* the message is followed by 0x80, zeros and its length in bits */
+        n = done >= len ? 0 : MIN(len - done, 64);
+        memcpy(block, data + done, n);
+        if(n < 64) {
+            if(done <= len) {
+                block[n++] = 0x80;
+                done = len + 1;
+            } else {
+                n = 0;
+            }
+            memset(block + n, 0, 64 - n);
+            if(n <= 56) {
+                for(i = 0; i < 8; i++)
+                    block[63 - i] = bits >> (8 * i);
+                last = 1;
+            }
+        } else {
+            done += 64;
+        }
+
+        for(i = 0; i < 16; i++)
+            w[i] = (uint32_t)block[4 * i] << 24 | block[4 * i + 1] << 16 | block[4 * i + 2] << 8 | block[4 * i + 3];
+        for(i = 16; i < 80; i++)
+            w[i] = ROL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+        for(i = 0; i < 80; i++) {
+            if(i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if(i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if(i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            t = ROL32(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = ROL32(b, 30); b = a; a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for(i = 0; i < 20; i++)
+        digest[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
 /******************************************************************************
 Description.: convert a hexadecimal ASCII character to integer
 Input Value.: ASCII character
@@ -531,613 +652,2814 @@ int unescape(char *string)
 
 
 /******************************************************************************
-Description.: Send a complete HTTP response and a single JPG-frame.
-Input Value.: fildescriptor fd to send the answer to
+Description.: drop everything queued for output, the header buffer is reused
+Input Value.: c: connection
 Return Value: -
 ******************************************************************************/
-void send_snapshot(cfd *context_fd, int input_number)
+static void connection_reset_output(connection *c)
 {
-    unsigned char *frame = NULL;
-    int frame_size = 0;
-    char *buffer = NULL;
-    struct timeval timestamp;
-    context *server_context = context_fd->pc;
-
-    /* get current frame using timestamp mechanism */
-    pthread_mutex_lock(&pglobal->in[input_number].db);
-    
-    /* wait for fresh frame using event-driven approach */
-    static unsigned int last_snapshot_sequence = UINT_MAX;  /* Start with max value to ensure first frame is processed */
-    
-    /* check if frame is new using sequence number */
-    unsigned int current_frame_sequence = pglobal->in[input_number].frame_sequence;
-    if (current_frame_sequence == last_snapshot_sequence) {
-        /* No new frame, unlock and return */
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
-        return;
+    c->iov_first = c->iov_count = 0;
+    c->zc_iov = -1;
+    free(c->out);
+    c->out = NULL;
+    if(c->frame != NULL) {
+        input_frame_put(c->frame);
+        c->frame = NULL;
     }
-    last_snapshot_sequence = current_frame_sequence;
-
-    /* read buffer */
-    frame_size = pglobal->in[input_number].size;
-    
-    /* Use static buffer if available and sufficient, otherwise fallback to dynamic */
-    if (server_context && server_context->use_static_buffers && frame_size <= MAX_FRAME_SIZE) {
-        frame = server_context->static_frame_buffer;
-        buffer = (char*)server_context->static_header_buffer;
-    } else {
-        /* Fallback to dynamic allocation for large frames */
-        if(frame == NULL || frame_size > 10*1024*1024) { // 10MB limit
-            if(frame != NULL) free(frame);
-            frame = malloc(frame_size);
-            if(frame == NULL) {
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                LOG("not enough memory for frame buffer\n");
-                return;
-            }
-        }
-        buffer = malloc(BUFFER_SIZE);
-        if(buffer == NULL) {
-            if(frame != server_context->static_frame_buffer) free(frame);
-            pthread_mutex_unlock(&pglobal->in[input_number].db);
-            LOG("not enough memory for header buffer\n");
-            return;
-        }
+    if(c->file_fd >= 0) {
+        close(c->file_fd);
+        c->file_fd = -1;
     }
-    
-    /* copy frame to our local buffer using SIMD optimization */
-    simd_memcpy(frame, pglobal->in[input_number].buf, frame_size);
-
-    /* copy v4l2_buffer timeval to user space */
-    timestamp = pglobal->in[input_number].timestamp;
-
-    DBG("got frame (size: %d kB)\n", frame_size / 1024);
-
-    pthread_mutex_unlock(&pglobal->in[input_number].db);
+}
 
-    /* write the response header with dynamic values */
-    char header_buffer[512];
-    int header_len = snprintf(header_buffer, sizeof(header_buffer),
-        "HTTP/1.0 200 OK\r\n"
-        "Access-Control-Allow-Origin: *\r\n"
-        "Connection: close\r\n"
-        "Server: MJPG-Streamer/0.2\r\n"
-        "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n"
-        "Pragma: no-cache\r\n"
-        "Expires: Mon, 3 Jan 2000 12:34:56 GMT\r\n"
-        "Content-type: image/jpeg\r\n"
-        "X-Timestamp: %d.%06d\r\n"
-        "X-Framerate: 0\r\n"
-        "\r\n",
-        (int)timestamp.tv_sec, (int)timestamp.tv_usec);
-    if (write(context_fd->fd, header_buffer, header_len) < 0) {
-        if (!server_context->use_static_buffers || frame_size > MAX_FRAME_SIZE) {
-            if (frame != server_context->static_frame_buffer) free(frame);
-            if (buffer != (char*)server_context->static_header_buffer) free(buffer);
-        }
+/******************************************************************************
+Description.: append a buffer to the pending output, it has to stay valid
+              until the connection wrote it
+Input Value.: c: connection
+              data, len: bytes to send
+Return Value: -
+******************************************************************************/
+static void connection_queue(connection *c, const void *data, size_t len)
+{
+    if(len == 0 || c->iov_count == MAX_IOV)
         return;
-    }
+    c->iov[c->iov_count].iov_base = (void *)data;
+    c->iov[c->iov_count].iov_len = len;
+    c->iov_count++;
+}
 
-    /* send image data */
-    if (write(context_fd->fd, frame, frame_size) < 0) {
-        /* Clean up dynamic buffers if used */
-        if (server_context && (!server_context->use_static_buffers || frame_size > MAX_FRAME_SIZE)) {
-            if (frame != server_context->static_frame_buffer) free(frame);
-            if (buffer != (char*)server_context->static_header_buffer) free(buffer);
-        }
+/******************************************************************************
+Description.: watch or stop watching a connection for writability
+Input Value.: c: connection
+              on: 1 while output is pending
+Return Value: -
+******************************************************************************/
+static void connection_want_write(connection *c, int on)
+{
+    if(c->want_write == on)
         return;
-    }
-    
-    
-    /* Clean up dynamic buffers if used */
-    if (server_context && (!server_context->use_static_buffers || frame_size > MAX_FRAME_SIZE)) {
-        if (frame != server_context->static_frame_buffer) free(frame);
-        if (buffer != (char*)server_context->static_header_buffer) free(buffer);
-    }
+    c->want_write = on;
+    loop_mod(c->loop, &c->src, (c->read_paused ? 0 : LOOP_READ) | (on ? LOOP_WRITE : 0));
 }
 
 /******************************************************************************
-Description.: Send a complete HTTP response and a stream of JPG-frames.
-Input Value.: fildescriptor fd to send the answer to
+Description.: stop or resume reading from a connection, while pipelined
+              requests fill the request buffer the socket is left alone
+Input Value.: c: connection
+              on: 1 to stop reading
 Return Value: -
 ******************************************************************************/
-void send_stream(cfd *context_fd, int input_number)
+static void connection_pause_read(connection *c, int on)
 {
-    unsigned char *frame = NULL, *tmp = NULL;
-    int frame_size = 0, max_frame_size = 0;
-    char buffer[BUFFER_SIZE] = {0};
-    struct timeval timestamp;
-
-    DBG("preparing header\n");
-    /* Get initial timestamp and fps for stream header */
-    pthread_mutex_lock(&pglobal->in[input_number].db);
-    struct timeval initial_timestamp = pglobal->in[input_number].timestamp;
-    int initial_fps = pglobal->in[input_number].fps;
-    pthread_mutex_unlock(&pglobal->in[input_number].db);
-    
-    /* Write stream header with dynamic values */
-    char header_buffer[512];
-    int header_len = snprintf(header_buffer, sizeof(header_buffer),
-        "HTTP/1.0 200 OK\r\n"
-        "Access-Control-Allow-Origin: *\r\n"
-        "Connection: keep-alive\r\n"
-        "Keep-Alive: timeout=5, max=100\r\n"
-        "Server: MJPG-Streamer/0.2\r\n"
-        "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n"
-        "Pragma: no-cache\r\n"
-        "Expires: Mon, 3 Jan 2000 12:34:56 GMT\r\n"
-        "Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n"
-        "X-Timestamp: %d.%06d\r\n"
-        "X-Framerate: %d\r\n"
-        "\r\n"
-        "--" BOUNDARY "\r\n",
-        (int)initial_timestamp.tv_sec, (int)initial_timestamp.tv_usec, initial_fps);
-    if (write(context_fd->fd, header_buffer, header_len) < 0) {
-        free(frame);
+    if(c->read_paused == on)
         return;
-    }
+    c->read_paused = on;
+    loop_mod(c->loop, &c->src, (on ? 0 : LOOP_READ) | (c->want_write ? LOOP_WRITE : 0));
+}
 
-    DBG("Headers send, sending stream now\n");
+static void admission_release(connection *c);
+static void connection_zerocopy_release(connection *c, int all, unsigned int completed);
 
-    unsigned int last_frame_sequence = UINT_MAX;  /* Start with max value to ensure first frame is processed */
-    
-    while(!pglobal->stop) {
+/******************************************************************************
+Description.: close a connection, the memory is released by the event loop
+              once the current batch of events is handled
+Input Value.: c: connection
+Return Value: -
+******************************************************************************/
+static void connection_close(connection *c)
+{
+    event_loop *l = c->loop;
 
-        /* wait for new frame using helper (mutex held on success) */
-        if (!wait_for_fresh_frame(&pglobal->in[input_number], &last_frame_sequence)) {
-            /* Add small delay to prevent busy waiting */
-            usleep(1000); /* 1ms delay */
-            continue;
-        }
-        last_frame_sequence = pglobal->in[input_number].frame_sequence;
-        
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-
-        /* check if framebuffer is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
-
-            max_frame_size = frame_size + TEN_K;
-            if((tmp = realloc(frame, max_frame_size)) == NULL) {
-                free(frame);
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                send_error(context_fd->fd, 500, "not enough memory");
-                return;
-            }
+    if(c->src.fd < 0)
+        return;
 
-            frame = tmp;
-        }
+    /*
+     * frames the kernel still reads from are about to be reused, reset the
+     * connection so it drops what it has queued instead of sending it later
+     */
+    if(c->zc_count > 0) {
+        struct linger lg = { 1, 0 };
+        setsockopt(c->src.fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        connection_zerocopy_release(c, 1, 0);
+    }
 
-        /* copy v4l2_buffer timeval to user space */
-        timestamp = pglobal->in[input_number].timestamp;
+    loop_del(l, &c->src);
+    close(c->src.fd);
+    c->src.fd = -1;
+    connection_reset_output(c);
+    admission_release(c);
+    if(c->mosaic != NULL)
+        __atomic_sub_fetch(&c->mosaic->viewers, 1, __ATOMIC_RELAXED);
+    if(c->variant != NULL)
+        __atomic_sub_fetch(&c->variant->viewers, 1, __ATOMIC_RELAXED);
+    if(c->streaming) {
+        metric_add(l->pc->m_clients, -1);
+        DBG("stream client %s left, %lu frames sent, %lu dropped\n",
+            c->peer, c->frames_sent, c->frames_dropped);
+    }
 
-        simd_memcpy(frame, pglobal->in[input_number].buf, frame_size);
-        DBG("got frame (size: %d kB)\n", frame_size / 1024);
+    pthread_mutex_lock(&l->lock);
+    if(c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        l->connections = c->next;
+    if(c->next != NULL)
+        c->next->prev = c->prev;
+    l->connection_count--;
+    pthread_mutex_unlock(&l->lock);
+    metric_add(l->m_connections, -1);
+
+    c->next = l->closed;
+    l->closed = c;
+}
 
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+static void connection_flush(connection *c);
+static void connection_dispatch(connection *c);
+static void stream_next(connection *c);
 
-        /*
-         * print the individual mimetype and the length
-         * sending the content-length fixes random stream disruption observed
-         * with firefox
-         */
-        int fps = pglobal->in[input_number].fps;
-        sprintf(buffer, "Content-Type: image/jpeg\r\n" \
-                "Content-Length: %d\r\n" \
-                "X-Timestamp: %d.%06d\r\n" \
-                "X-Framerate: %d\r\n" \
-                "\r\n", frame_size, (int)timestamp.tv_sec, (int)timestamp.tv_usec, fps);
-        DBG("sending intemdiate header\n");
-        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
-
-        DBG("sending frame\n");
-        if(write(context_fd->fd, frame, frame_size) < 0) break;
-
-        DBG("sending boundary\n");
-        sprintf(buffer, "\r\n--" BOUNDARY "\r\n");
-        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
-        
+/******************************************************************************
+Description.: a response of a persistent connection went out, forget its
+              request and start on the next one if it was pipelined already
+Input Value.: c: connection
+Return Value: -
+******************************************************************************/
+static void connection_next_request(connection *c)
+{
+    connection_reset_output(c);
+    admission_release(c);
+
+    /* pipelined requests move to the front of the buffer */
+    c->request_len -= c->request_end;
+    memmove(c->request, c->request + c->request_end, c->request_len + 1);
+    c->request_end = 0;
+    c->request_scan = 0;
+
+    c->state = C_REQUEST;
+    c->deadline_us = time_monotonic_us() + c->loop->pc->conf.keepalive_timeout * 1000000LL;
+    c->input = 0;
+    c->scale = c->quality = 0;
+    c->after = 0;
+    c->if_none_match[0] = '\0';
+    c->if_modified_since[0] = '\0';
+    c->accept_gzip = 0;
+    connection_pause_read(c, 0);
+
+    if(!c->dispatching)
+        connection_dispatch(c);
+}
+
+/******************************************************************************
+Description.: the pending output was written completely
+Input Value.: c: connection
+Return Value: -
+******************************************************************************/
+static void connection_done(connection *c)
+{
+    context *pc = c->loop->pc;
+    long long now, delay;
+
+    if(c->state != C_STREAM_PART) {
+        /* within handle_request() the state has to stay answered, see connection_dispatch() */
+        if(!c->keep_alive)
+            connection_close(c);
+        else if(c->dispatching)
+            c->answered = 1;
+        else
+            connection_next_request(c);
+        return;
     }
 
-    free(frame);
+    /* a multipart part or the stream header went out */
+    if(c->frame != NULL) {
+        now = time_monotonic_us();
+        latency_record(c->latency, c->frame, c->wakeup_us, now);
+        metric_observe_us(pc->m_send, now - c->wakeup_us);
+        delay = now - c->frame->capture_us;
+        metric_observe_us(pc->m_delay, delay);
+        __atomic_store_n(&c->delay_us, delay, __ATOMIC_RELAXED);
+        if(delay > c->delay_max_us)
+            __atomic_store_n(&c->delay_max_us, delay, __ATOMIC_RELAXED);
+        metric_add(pc->m_frames, 1);
+        metric_add(pc->m_bytes, c->part_bytes);
+        __atomic_store_n(&c->frames_sent, c->frames_sent + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->bytes_sent, c->bytes_sent + c->part_bytes, __ATOMIC_RELAXED);
+    }
+    connection_reset_output(c);
+    c->state = C_STREAM_IDLE;
+    stream_next(c);
 }
 
+/******************************************************************************
+Description.: unpin the frames whose MSG_ZEROCOPY sends completed
+Input Value.: c: connection
+              all: 1 to unpin every frame
+              completed: the sends up to this id are done
+Return Value: -
+******************************************************************************/
+static void connection_zerocopy_release(connection *c, int all, unsigned int completed)
+{
+    while(c->zc_count > 0) {
+        if(!all && (int)(c->zc_pins[c->zc_head].last - completed) > 0)
+            break;
+        input_frame_put(c->zc_pins[c->zc_head].fb);
+        c->zc_pins[c->zc_head].fb = NULL;
+        c->zc_head = (c->zc_head + 1) % ZEROCOPY_PINS;
+        c->zc_count--;
+    }
+}
 
 /******************************************************************************
-Description.: Send error messages and headers.
-Input Value.: * fd.....: is the filedescriptor to send the message to
-              * which..: HTTP error code, most popular is 404
-              * message: append this string to the displayed response
+Description.: read the MSG_ZEROCOPY completions from the error queue of the
+              socket, the event loop sees them as EPOLLERR
+Input Value.: c: connection
 Return Value: -
 ******************************************************************************/
-void send_error(int fd, int which, char *message)
+static void connection_zerocopy_reap(connection *c)
 {
-    char buffer[BUFFER_SIZE] = {0};
+#if defined(__linux__) && defined(MSG_ZEROCOPY)
+    char control[128];
+    struct sock_extended_err *err;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+
+    while(c->zc_count > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(c->src.fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
 
-    if(which == 401) {
-        sprintf(buffer, "HTTP/1.0 401 Unauthorized\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "WWW-Authenticate: Basic realm=\"MJPG-Streamer\"\r\n" \
-                "\r\n" \
-                "401: Not Authenticated!\r\n" \
-                "%s", message);
+        for(cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if(!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+               !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            err = (struct sock_extended_err *)CMSG_DATA(cm);
+            if(err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            /* sends ee_info to ee_data are done, the kernel may have had to copy them */
+            if(err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                metric_add(c->loop->pc->m_zerocopy_copied, err->ee_data - err->ee_info + 1);
+            connection_zerocopy_release(c, 0, err->ee_data);
+        }
+    }
+#endif
+}
+
+/******************************************************************************
+Description.: Write pending stream output when a frame goes out with
+              MSG_ZEROCOPY. The headers before the frame are written as
+              usual, they are rewritten for the next frame while the kernel
+              may still read the frame. The frame stays referenced until the
+              kernel reports the send complete.
+Input Value.: c: connection, c->zc_iov is the frame data
+Return Value: bytes sent, -1 with errno set on error
+******************************************************************************/
+static ssize_t connection_send_zerocopy(connection *c)
+{
+#if defined(__linux__) && defined(MSG_ZEROCOPY)
+    int tail = (c->zc_head + c->zc_count - 1) % ZEROCOPY_PINS;
+    struct msghdr msg;
+    ssize_t n;
+
+    if(c->iov_first < c->zc_iov)
+        return writev(c->src.fd, c->iov + c->iov_first, c->zc_iov - c->iov_first);
+
+    if(c->zc_count == ZEROCOPY_PINS)
+        connection_zerocopy_reap(c);
+    if(c->zc_count < ZEROCOPY_PINS || c->zc_pins[tail].fb == c->frame) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = c->iov + c->iov_first;
+        msg.msg_iovlen = c->iov_count - c->iov_first;
+        n = sendmsg(c->src.fd, &msg, MSG_ZEROCOPY);
+        if(n >= 0) {
+            /* a frame sent in several calls is pinned once, until its last send completed */
+            if(c->zc_count > 0 && c->zc_pins[tail].fb == c->frame) {
+                c->zc_pins[tail].last = c->zc_next;
+            } else {
+                tail = (c->zc_head + c->zc_count) % ZEROCOPY_PINS;
+                c->zc_pins[tail].fb = input_frame_ref(c->frame);
+                c->zc_pins[tail].last = c->zc_next;
+                c->zc_count++;
+            }
+            c->zc_next++;
+            metric_add(c->loop->pc->m_zerocopy, n);
+            return n;
+        }
+        if(errno != ENOBUFS)
+            return n;
+    }
+#endif
+    /* every pin is taken or the kernel is out of option memory: copy */
+    return writev(c->src.fd, c->iov + c->iov_first, c->iov_count - c->iov_first);
+}
+
+/******************************************************************************
+Description.: send the next part of the file being served, with sendfile(2)
+              where available so the content never passes through user space
+Input Value.: c: connection with file_fd and no other output pending
+Return Value: bytes sent, 0 at the end of the file (file_fd is closed then),
+              -1 with errno set on error
+******************************************************************************/
+static ssize_t connection_send_file(connection *c)
+{
+    ssize_t n;
+
+#ifdef __linux__
+    n = sendfile(c->src.fd, c->file_fd, NULL, FILE_CHUNK_SIZE);
+#else
+    if(c->chunk == NULL && (c->chunk = malloc(FILE_CHUNK_SIZE)) == NULL)
+        return -1;
+    n = read(c->file_fd, c->chunk, FILE_CHUNK_SIZE);
+    if(n > 0) {
+        /* the chunk is pending output until the socket took all of it */
+        c->iov_first = c->iov_count = 0;
+        connection_queue(c, c->chunk, n);
+        n = writev(c->src.fd, c->iov, c->iov_count);
+    }
+#endif
+    if(n == 0) {
+        close(c->file_fd);
+        c->file_fd = -1;
+    }
+    return n;
+}
+
+/******************************************************************************
+Description.: write pending output until the socket would block
+Input Value.: c: connection
+Return Value: -
+******************************************************************************/
+static void connection_flush(connection *c)
+{
+    ssize_t n;
+
+    while(c->src.fd >= 0) {
+        if(c->iov_first == c->iov_count && c->file_fd < 0) {
+            connection_want_write(c, 0);
+            connection_done(c);
+            return;
+        }
+
+        if(c->iov_first < c->iov_count && c->zc_iov >= 0)
+            n = connection_send_zerocopy(c);
+        else if(c->iov_first < c->iov_count)
+            n = writev(c->src.fd, c->iov + c->iov_first, c->iov_count - c->iov_first);
+        else if((n = connection_send_file(c)) == 0)
+            continue;
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* the client has STALL_TIMEOUT seconds to take more data */
+                if(c->deadline_us == 0)
+                    c->deadline_us = time_monotonic_us() + STALL_TIMEOUT * 1000000LL;
+                connection_want_write(c, 1);
+                return;
+            }
+            DBG("write failed: %s\n", strerror(errno));
+            connection_close(c);
+            return;
+        }
+
+        c->deadline_us = 0;
+        __atomic_add_fetch(&c->loop->pc->bytes_out, n, __ATOMIC_RELAXED);
+        if(c->streaming)
+            __atomic_store_n(&c->unsent, c->unsent - MIN((size_t)n, c->unsent), __ATOMIC_RELAXED);
+
+        /* skip what was written, the last iovec may be partially sent */
+        while(n > 0 && c->iov_first < c->iov_count) {
+            struct iovec *v = &c->iov[c->iov_first];
+            if((size_t)n >= v->iov_len) {
+                n -= v->iov_len;
+                c->iov_first++;
+            } else {
+                v->iov_base = (char *)v->iov_base + n;
+                v->iov_len -= n;
+                n = 0;
+            }
+        }
+    }
+}
+
+/******************************************************************************
+Description.: start sending the queued output as the answer to the request
+Input Value.: c: connection
+              state: C_RESPONSE or C_STREAM_PART
+Return Value: -
+******************************************************************************/
+static void connection_respond(connection *c, connection_state state)
+{
+    c->state = state;
+    c->deadline_us = 0;
+    connection_flush(c);
+}
+
+/* frame sources of streams: the inputs, the mosaics and the variants */
+#define SOURCE_COUNT (pglobal->incnt + MOSAIC_COUNT + VARIANT_MAX)
+
+/******************************************************************************
+Description.: frame source of a stream, the mosaics follow the inputs and the
+              variants follow the mosaics
+Input Value.: pc: server context
+              n: input number, pglobal->incnt + grid - MOSAIC_GRID_MIN or
+                 pglobal->incnt + MOSAIC_COUNT + variant index
+Return Value: input
+******************************************************************************/
+static input *stream_source(context *pc, int n)
+{
+    if(n < pglobal->incnt)
+        return &pglobal->in[n];
+    if(n < pglobal->incnt + MOSAIC_COUNT)
+        return &pc->mosaics[n - pglobal->incnt].in;
+    return &pc->variants[n - pglobal->incnt - MOSAIC_COUNT].in;
+}
+
+/******************************************************************************
+Description.: make sure the event loop gets notified about frames of an input
+Input Value.: l: event loop
+              input: input number, see stream_source()
+Return Value: 0 on success, -1 on error
+******************************************************************************/
+static int loop_watch_input(event_loop *l, int input)
+{
+    loop_source *s = &l->inputs[input].src;
+
+    if(s->fd >= 0)
+        return 0;
+
+    if((s->fd = input_frame_subscribe(stream_source(l->pc, input))) < 0)
+        return -1;
+    if(loop_add(l, s, LOOP_READ) < 0) {
+        input_frame_unsubscribe(stream_source(l->pc, input), s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: format the Connection header of a response, persistent
+              connections announce their limits
+Input Value.: c: connection, keep_alive decides
+Return Value: header lines, valid until the next call for c
+******************************************************************************/
+static const char *response_connection(connection *c)
+{
+    context *pc = c->loop->pc;
+
+    if(!c->keep_alive)
+        return "Connection: close\r\n";
+
+    snprintf(c->connection_header, sizeof(c->connection_header),
+             "Connection: keep-alive\r\nKeep-Alive: timeout=%d, max=%d\r\n",
+             pc->conf.keepalive_timeout, pc->conf.keepalive_max - (int)c->requests);
+    return c->connection_header;
+}
+
+/******************************************************************************
+Description.: Send error messages and headers.
+Input Value.: * c......: is the connection to send the message to
+              * which..: HTTP error code, most popular is 404
+              * message: append this string to the displayed response
+Return Value: -
+******************************************************************************/
+void send_error(connection *c, int which, const char *message)
+{
+    const char *status, *extra = "";
+    char body[BUFFER_SIZE / 2], retry_after[32];
+    int header_len, body_len;
+
+    /* the first answer to a request wins */
+    if(c->state != C_REQUEST && c->state != C_SNAPSHOT)
+        return;
+
+    if(which == 401) {
+        status = "401 Unauthorized";
+        extra = "WWW-Authenticate: Basic realm=\"MJPG-Streamer\"\r\n";
+        body_len = snprintf(body, sizeof(body), "401: Not Authenticated!\r\n%s", message);
     } else if(which == 404) {
-        sprintf(buffer, "HTTP/1.0 404 Not Found\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "\r\n" \
-                "404: Not Found!\r\n" \
-                "%s", message);
+        status = "404 Not Found";
+        body_len = snprintf(body, sizeof(body), "404: Not Found!\r\n%s", message);
     } else if(which == 500) {
-        sprintf(buffer, "HTTP/1.0 500 Internal Server Error\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "\r\n" \
-                "500: Internal Server Error!\r\n" \
-                "%s", message);
+        status = "500 Internal Server Error";
+        body_len = snprintf(body, sizeof(body), "500: Internal Server Error!\r\n%s", message);
     } else if(which == 400) {
-        sprintf(buffer, "HTTP/1.0 400 Bad Request\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "\r\n" \
-                "400: Not Found!\r\n" \
-                "%s", message);
+        status = "400 Bad Request";
+        body_len = snprintf(body, sizeof(body), "400: Not Found!\r\n%s", message);
     } else if (which == 403) {
-        sprintf(buffer, "HTTP/1.0 403 Forbidden\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "\r\n" \
-                "403: Forbidden!\r\n" \
-                "%s", message);
+        status = "403 Forbidden";
+        body_len = snprintf(body, sizeof(body), "403: Forbidden!\r\n%s", message);
+    } else if(which == 503) {
+        status = "503 Service Unavailable";
+        snprintf(retry_after, sizeof(retry_after), "Retry-After: %d\r\n", RETRY_AFTER);
+        extra = retry_after;
+        body_len = snprintf(body, sizeof(body), "503: Service Unavailable!\r\n%s", message);
     } else {
-        sprintf(buffer, "HTTP/1.0 501 Not Implemented\r\n" \
+        status = "501 Not Implemented";
+        body_len = snprintf(body, sizeof(body), "501: Not Implemented!\r\n%s", message);
+    }
+    body_len = MIN(body_len, (int)sizeof(body) - 1);
+
+    header_len = snprintf(c->header, sizeof(c->header), "HTTP/1.%d %s\r\n" \
                 "Content-type: text/plain\r\n" \
+                "Content-Length: %d\r\n" \
+                "%s" \
                 STD_HEADER \
+                "%s" \
                 "\r\n" \
-                "501: Not Implemented!\r\n" \
-                "%s", message);
+                "%s", c->http_minor, status, body_len, response_connection(c), extra, body);
+
+    connection_reset_output(c);
+    connection_queue(c, c->header, MIN(header_len, (int)sizeof(c->header) - 1));
+    connection_respond(c, C_RESPONSE);
+}
+
+/******************************************************************************
+Description.: find the slots of a client address
+Input Value.: pc: server context, admission_lock held
+              peer: numeric client address
+              create: add the address if it holds no slots yet
+Return Value: entry or NULL
+******************************************************************************/
+static peer_slots *admission_peer(context *pc, const char *peer, int create)
+{
+    peer_slots *grown;
+    int i;
+
+    for(i = 0; i < pc->peer_count; i++) {
+        if(strcmp(pc->peers[i].peer, peer) == 0)
+            return &pc->peers[i];
+    }
+    if(!create)
+        return NULL;
+
+    if(pc->peer_count == pc->peer_capacity) {
+        grown = realloc(pc->peers, (pc->peer_capacity ? pc->peer_capacity * 2 : 16) * sizeof(peer_slots));
+        if(grown == NULL)
+            return NULL;
+        pc->peers = grown;
+        pc->peer_capacity = pc->peer_capacity ? pc->peer_capacity * 2 : 16;
+    }
+    snprintf(pc->peers[pc->peer_count].peer, sizeof(pc->peers[0].peer), "%s", peer);
+    pc->peers[pc->peer_count].slots = 0;
+    return &pc->peers[pc->peer_count++];
+}
+
+/******************************************************************************
+Description.: Admit a stream or snapshot within the configured limits, before
+              any frame work is done for it. Otherwise the client is answered
+              503 with Retry-After right away.
+Input Value.: c: connection
+              type: A_STREAM or A_SNAPSHOT
+              input: input the client asks for
+Return Value: 0 if admitted, -1 if the request was turned away
+******************************************************************************/
+static int admission_acquire(connection *c, answer_t type, int input)
+{
+    static const char *messages[REJECT_REASONS] = {
+        "too many streams", "too many streams of this input", "too many snapshots",
+        "too many requests from this address", "bandwidth limit reached"
+    };
+    context *pc = c->loop->pc;
+    config *conf = &pc->conf;
+    long long rate;
+    peer_slots *p = NULL;
+    int reason = -1;
+
+    if(c->slot != A_UNKNOWN)
+        return 0;
+
+    pthread_mutex_lock(&pc->admission_lock);
+    if(type == A_STREAM) {
+        rate = __atomic_load_n(&pc->egress_rate, __ATOMIC_RELAXED);
+        if(conf->max_streams > 0 && pc->stream_count >= conf->max_streams)
+            reason = REJECT_STREAMS;
+        else if(conf->max_input_streams > 0 && pc->input_streams[input] >= conf->max_input_streams)
+            reason = REJECT_INPUT_STREAMS;
+        /* a new stream is expected to cost what the average one does */
+        else if(conf->max_egress > 0 && rate + (pc->stream_count > 0 ? rate / pc->stream_count : 0) > conf->max_egress)
+            reason = REJECT_EGRESS;
+    } else if(conf->max_snapshots > 0 && pc->snapshot_count >= conf->max_snapshots) {
+        reason = REJECT_SNAPSHOTS;
+    }
+    if(reason < 0 && conf->max_per_ip > 0) {
+        p = admission_peer(pc, c->peer, 1);
+        if(p == NULL || p->slots >= conf->max_per_ip)
+            reason = REJECT_PER_IP;
+    }
+
+    if(reason < 0) {
+        c->input = input;
+        c->slot_input = input;
+        if(type == A_STREAM) {
+            pc->stream_count++;
+            pc->input_streams[input]++;
+        } else {
+            pc->snapshot_count++;
+        }
+        if(p != NULL)
+            p->slots++;
+        c->slot = type;
+    }
+    pthread_mutex_unlock(&pc->admission_lock);
+
+    if(reason < 0)
+        return 0;
+
+    DBG("turning %s away: %s\n", c->peer, messages[reason]);
+    metric_add(pc->m_rejected[reason], 1);
+    c->keep_alive = 0;
+    send_error(c, 503, messages[reason]);
+    return -1;
+}
+
+/******************************************************************************
+Description.: give the admission slot of a connection back
+Input Value.: c: connection
+Return Value: -
+******************************************************************************/
+static void admission_release(connection *c)
+{
+    context *pc = c->loop->pc;
+    peer_slots *p;
+
+    if(c->slot == A_UNKNOWN)
+        return;
+
+    pthread_mutex_lock(&pc->admission_lock);
+    if(c->slot == A_STREAM) {
+        pc->stream_count--;
+        pc->input_streams[c->slot_input]--;
+    } else {
+        pc->snapshot_count--;
+    }
+    if(pc->conf.max_per_ip > 0 && (p = admission_peer(pc, c->peer, 0)) != NULL && --p->slots <= 0)
+        *p = pc->peers[--pc->peer_count];
+    pthread_mutex_unlock(&pc->admission_lock);
+    c->slot = A_UNKNOWN;
+}
+
+/******************************************************************************
+Description.: measure the egress of the server, the first event loop does so
+              once per second
+Input Value.: pc: server context
+              now: time_monotonic_us()
+Return Value: -
+******************************************************************************/
+static void egress_update(context *pc, long long now)
+{
+    unsigned long long bytes = __atomic_load_n(&pc->bytes_out, __ATOMIC_RELAXED);
+    long long rate;
+
+    if(now - pc->egress_us < 1000000LL)
+        return;
+    if(pc->egress_us != 0) {
+        rate = (long long)((bytes - pc->egress_bytes) * 1000000ULL / (now - pc->egress_us));
+        __atomic_store_n(&pc->egress_rate, rate, __ATOMIC_RELAXED);
+        metric_set(pc->m_egress, rate);
+    }
+    pc->egress_bytes = bytes;
+    pc->egress_us = now;
+}
+
+/******************************************************************************
+Description.: format the entity tag of a snapshot, it is the frame sequence
+              plus the ?scale=&q= variant if there is one
+Input Value.: c: connection
+              sequence: frame sequence
+              etag, size: output buffer
+Return Value: -
+******************************************************************************/
+static void snapshot_etag(connection *c, unsigned int sequence, char *etag, size_t size)
+{
+    if(c->quality > 0)
+        snprintf(etag, size, "\"%u-%d-%d\"", sequence, c->scale, c->quality);
+    else
+        snprintf(etag, size, "\"%u\"", sequence);
+}
+
+/******************************************************************************
+Description.: check If-None-Match of the request against a response
+Input Value.: c: connection
+              etag: entity tag of the snapshot or file to send
+Return Value: 1 if the client already has it, 0 otherwise
+******************************************************************************/
+static int etag_cached(connection *c, const char *etag)
+{
+    if(c->if_none_match[0] == '\0')
+        return 0;
+    return strcmp(c->if_none_match, "*") == 0 || strstr(c->if_none_match, etag) != NULL;
+}
+
+/******************************************************************************
+Description.: answer a conditional request for a snapshot or file the client
+              already has, or an ?after= long-poll that saw no newer frame
+Input Value.: c: connection
+              etag: entity tag of the current frame or file
+Return Value: -
+******************************************************************************/
+static void send_not_modified(connection *c, const char *etag)
+{
+    int header_len;
+
+    if(c->state != C_REQUEST && c->state != C_SNAPSHOT)
+        return;
+
+    header_len = snprintf(c->header, sizeof(c->header),
+        "HTTP/1.%d 304 Not Modified\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "%s"
+        "Server: MJPG-Streamer/0.2\r\n"
+        "Cache-Control: no-cache\r\n"
+        "ETag: %s\r\n"
+        "\r\n", c->http_minor, response_connection(c), etag);
+
+    connection_reset_output(c);
+    connection_queue(c, c->header, header_len);
+    connection_respond(c, C_RESPONSE);
+}
+
+/******************************************************************************
+Description.: transcode the newest frame of the source if it is a new one
+Input Value.: v: variant
+Return Value: 1 if a variant was published, 0 otherwise
+******************************************************************************/
+static int variant_tick(variant *v)
+{
+    const unsigned char *jpeg;
+    frame_buffer *fb, *out;
+    size_t size;
+    int published = 0;
+
+    if((fb = input_frame_get(v->src)) == NULL)
+        return 0;
+    if(fb->sequence != __atomic_load_n(&v->src_sequence, __ATOMIC_RELAXED)) {
+        /* other servers asking for the same variant share the encode */
+        if((jpeg = input_frame_variant(fb, v->scale, v->quality, &size)) != NULL &&
+           (out = input_frame_acquire(&v->in, size)) != NULL) {
+            memcpy(out->data, jpeg, size);
+            out->capture_us = fb->capture_us;
+            input_frame_publish(&v->in, out, size, &fb->timestamp);
+            published = 1;
+        }
+        __atomic_store_n(&v->src_sequence, fb->sequence, __ATOMIC_RELAXED);
+    }
+    input_frame_put(fb);
+    return published;
+}
+
+/******************************************************************************
+Description.: tell if the variant has to be transcoded, for streams or for
+              a snapshot waiting for it
+Input Value.: v: variant, lock held
+Return Value: 1 if so, 0 if the thread may sleep
+******************************************************************************/
+static int variant_busy(variant *v)
+{
+    return __atomic_load_n(&v->viewers, __ATOMIC_RELAXED) > 0 ||
+           v->wanted_us > time_monotonic_us();
+}
+
+/******************************************************************************
+Description.: give the slot of a variant nobody used for VARIANT_LINGER
+              seconds back, together with its frames
+Input Value.: v: variant
+              busy_us: when the thread last had something to do
+Return Value: 1 if the slot is free now and the thread has to end, 0 if the
+              variant is still or again in use
+******************************************************************************/
+static int variant_release(variant *v, long long busy_us)
+{
+    long long now = time_monotonic_us();
+    int released = 0;
+
+    pthread_mutex_lock(v->slots_lock);
+    pthread_mutex_lock(&v->lock);
+    if(!variant_busy(v) && now - MAX(v->used_us, busy_us) > VARIANT_LINGER * 1000000LL) {
+        DBG("releasing variant scale 1/%d q %d of source %d\n", v->scale, v->quality, v->source);
+        input_frames_release(&v->in);
+        __atomic_store_n(&v->src_sequence, 0, __ATOMIC_RELAXED);
+        v->source = -1;
+        v->started = 0;
+        released = 1;
+    }
+    pthread_mutex_unlock(&v->lock);
+    pthread_mutex_unlock(v->slots_lock);
+    return released;
+}
+
+/******************************************************************************
+Description.: Transcode each frame of the source of a variant while it is
+              streamed. For snapshots only the next new frame is transcoded,
+              once for all snapshots waiting at that time. The slot is given
+              back after VARIANT_LINGER idle seconds.
+Input Value.: arg: variant
+Return Value: NULL
+******************************************************************************/
+static void *variant_thread(void *arg)
+{
+    variant *v = arg;
+    input *src = v->src;
+    long long busy_us = time_monotonic_us();
+    unsigned int requests;
+    struct timespec until;
+    struct pollfd pfd;
+    int busy;
+
+    pfd.fd = input_frame_subscribe(src);
+    pfd.events = POLLIN;
+
+    while(!pglobal->stop) {
+        pthread_mutex_lock(&v->lock);
+        if(!(busy = variant_busy(v))) {
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += 1;
+            pthread_cond_timedwait(&v->wake, &v->lock, &until);
+            busy = variant_busy(v);
+        }
+        requests = v->requests;
+        pthread_mutex_unlock(&v->lock);
+
+        if(!busy) {
+            if(variant_release(v, busy_us))
+                break;
+            continue;
+        }
+        busy_us = time_monotonic_us();
+
+        /* snapshots that asked before this frame are answered by it */
+        if(variant_tick(v)) {
+            pthread_mutex_lock(&v->lock);
+            if(v->requests == requests)
+                v->wanted_us = 0;
+            pthread_mutex_unlock(&v->lock);
+        }
+
+        /* wait for the next frame of the source, without a notification
+           descriptor it is polled */
+        if(pfd.fd < 0)
+            usleep(1000000 / MOSAIC_FPS);
+        else if(poll(&pfd, 1, 100) > 0)
+            input_frame_drain(pfd.fd);
+    }
+
+    if(pfd.fd >= 0)
+        input_frame_unsubscribe(src, pfd.fd);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: find the variant of a frame source, taking a free slot on first
+              use, and make sure its thread runs
+Input Value.: pc: server context
+              source: stream source to transcode
+              scale, quality: variant key
+Return Value: variant or NULL if all VARIANT_MAX slots are in use
+******************************************************************************/
+static variant *variant_get(context *pc, int source, int scale, int quality)
+{
+    variant *v = NULL;
+    pthread_t thread;
+    int i;
+
+    pthread_mutex_lock(&pc->variants_lock);
+    for(i = 0; i < VARIANT_MAX && v == NULL; i++) {
+        if(pc->variants[i].source == source && pc->variants[i].scale == scale &&
+           pc->variants[i].quality == quality)
+            v = &pc->variants[i];
+    }
+    for(i = 0; i < VARIANT_MAX && v == NULL; i++) {
+        if(pc->variants[i].source >= 0)
+            continue;
+        v = &pc->variants[i];
+        v->src = stream_source(pc, source);
+        v->in.fps = v->src->fps;
+        v->scale = scale;
+        v->quality = quality;
+        v->source = source;
+    }
+    /* the slot is not released while this is recent */
+    if(v != NULL)
+        v->used_us = time_monotonic_us();
+    pthread_mutex_unlock(&pc->variants_lock);
+    if(v == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&v->lock);
+    if(!v->started && pthread_create(&thread, NULL, variant_thread, v) == 0) {
+        pthread_detach(thread);
+        v->started = 1;
+    }
+    pthread_mutex_unlock(&v->lock);
+    return v->started ? v : NULL;
+}
+
+/******************************************************************************
+Description.: tell if the newest frame of a stream source is up to date, only
+              a variant can fall behind the source it is transcoded from
+Input Value.: pc: server context
+              n: stream source
+Return Value: 1 if up to date, 0 if the next transcode has to be waited for
+******************************************************************************/
+static int variant_current(context *pc, int n)
+{
+    variant *v;
+    frame_meta meta;
+
+    if(n < pglobal->incnt + MOSAIC_COUNT)
+        return 1;
+    v = &pc->variants[n - pglobal->incnt - MOSAIC_COUNT];
+    input_meta_read(v->src, &meta);
+    return meta.sequence != 0 && meta.sequence == __atomic_load_n(&v->src_sequence, __ATOMIC_RELAXED);
+}
+
+/******************************************************************************
+Description.: ask the thread of a variant for the next new frame of its
+              source on behalf of a waiting snapshot
+Input Value.: pc: server context
+              n: stream source of the variant
+              until_us: deadline of the snapshot
+Return Value: -
+******************************************************************************/
+static void variant_request(context *pc, int n, long long until_us)
+{
+    variant *v = &pc->variants[n - pglobal->incnt - MOSAIC_COUNT];
+
+    pthread_mutex_lock(&v->lock);
+    v->requests++;
+    v->wanted_us = MAX(v->wanted_us, until_us);
+    pthread_cond_signal(&v->wake);
+    pthread_mutex_unlock(&v->lock);
+}
+
+/******************************************************************************
+Description.: Point a request for a ?scale=&q= variant at the frame source of
+              the variant. The event loop never transcodes, a client waits
+              for the variant thread like it waits for an input.
+Input Value.: c: connection, c->scale and c->quality give the variant
+              input_number: stream source the client asked for
+              stream: 1 for streams, which count as viewers, 0 for snapshots
+Return Value: stream source to serve, -1 if the client was answered
+******************************************************************************/
+static int variant_source(connection *c, int input_number, int stream)
+{
+    context *pc = c->loop->pc;
+    variant *v;
+
+    if(c->quality <= 0)
+        return input_number;
+
+    if((v = variant_get(pc, input_number, c->scale, c->quality)) == NULL) {
+        c->keep_alive = 0;
+        send_error(c, 503, "too many image variants");
+        return -1;
+    }
+    if(stream) {
+        c->variant = v;
+        pthread_mutex_lock(&v->lock);
+        __atomic_add_fetch(&v->viewers, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&v->wake);
+        pthread_mutex_unlock(&v->lock);
+    }
+    return pglobal->incnt + MOSAIC_COUNT + (int)(v - pc->variants);
+}
+
+/******************************************************************************
+Description.: Send a complete HTTP response and a single JPG-frame.
+Input Value.: c: connection
+              fb: referenced frame, the connection takes over the reference
+Return Value: -
+******************************************************************************/
+static void send_snapshot_frame(connection *c, frame_buffer *fb)
+{
+    const unsigned char *data = fb->data;
+    size_t size = fb->size;
+    char etag[48];
+    int header_len;
+
+    DBG("got frame (size: %d kB)\n", fb->size / 1024);
+
+    snapshot_etag(c, fb->sequence, etag, sizeof(etag));
+    if(etag_cached(c, etag)) {
+        input_frame_put(fb);
+        send_not_modified(c, etag);
+        return;
+    }
+
+    /* write the response header with dynamic values */
+    header_len = snprintf(c->header, sizeof(c->header),
+        "HTTP/1.%d 200 OK\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "%s"
+        "Server: MJPG-Streamer/0.2\r\n"
+        "Cache-Control: no-cache, must-revalidate, max-age=0\r\n"
+        "Pragma: no-cache\r\n"
+        "Expires: Mon, 3 Jan 2000 12:34:56 GMT\r\n"
+        "Content-type: image/jpeg\r\n"
+        "Content-Length: %zu\r\n"
+        "ETag: %s\r\n"
+        "X-Timestamp: %d.%06d\r\n"
+        "X-Framerate: 0\r\n"
+        "\r\n",
+        c->http_minor, response_connection(c), size,
+        etag, (int)fb->timestamp.tv_sec, (int)fb->timestamp.tv_usec);
+
+    /* send image data straight from the shared frame */
+    connection_reset_output(c);
+    c->frame = fb;
+    connection_queue(c, c->header, header_len);
+    connection_queue(c, data, size);
+    connection_respond(c, C_RESPONSE);
+}
+
+/******************************************************************************
+Description.: Answer with the current frame, or wait up to SNAPSHOT_WAIT_MS
+              for the first one if the input has not published yet. With
+              ?after=<sequence> the request waits up to LONG_POLL_TIMEOUT
+              while that frame is still the current one. A conditional
+              request for the current frame gets 304 without the frame
+              being referenced.
+Input Value.: c: connection
+              input_number: input to take the frame from
+Return Value: -
+******************************************************************************/
+void send_snapshot(connection *c, int input_number)
+{
+    frame_buffer *fb;
+    frame_meta meta;
+    char etag[48];
+
+    if(c->state != C_REQUEST)
+        return;
+    if(admission_acquire(c, A_SNAPSHOT, input_number) < 0)
+        return;
+    if((input_number = variant_source(c, input_number, 0)) < 0)
+        return;
+    c->input = input_number;
+
+    /* a variant transcoded after this is announced, see variant_request() */
+    if(c->quality > 0 && loop_watch_input(c->loop, input_number) < 0) {
+        send_error(c, 500, "no frame available");
+        return;
+    }
+
+    input_meta_read(stream_source(c->loop->pc, input_number), &meta);
+    if(meta.sequence != 0 && meta.sequence != c->after && variant_current(c->loop->pc, input_number)) {
+        snapshot_etag(c, meta.sequence, etag, sizeof(etag));
+        if(etag_cached(c, etag)) {
+            send_not_modified(c, etag);
+            return;
+        }
+
+        fb = input_frame_get(stream_source(c->loop->pc, input_number));
+        if(fb != NULL) {
+            send_snapshot_frame(c, fb);
+            return;
+        }
+    }
+
+    if(loop_watch_input(c->loop, input_number) < 0) {
+        send_error(c, 500, "no frame available");
+        return;
+    }
+    c->state = C_SNAPSHOT;
+    c->deadline_us = time_monotonic_us() +
+                     (c->after != 0 ? LONG_POLL_TIMEOUT * 1000000LL : SNAPSHOT_WAIT_MS * 1000LL);
+    if(c->quality > 0)
+        variant_request(c->loop->pc, input_number, c->deadline_us);
+}
+
+/******************************************************************************
+Description.: format the multipart header of a frame
+Input Value.: part: PART_HEADER_SIZE bytes output
+              fb: frame
+              size: bytes of the JPEG sent for it
+Return Value: length of the header
+******************************************************************************/
+static size_t format_part_header(char *part, frame_buffer *fb, size_t size)
+{
+    frame_meta meta;
+    int len;
+
+    /*
+     * print the individual mimetype and the length
+     * sending the content-length fixes random stream disruption observed
+     * with firefox
+     */
+    input_meta_read(fb->owner, &meta);
+    len = snprintf(part, PART_HEADER_SIZE, "Content-Type: image/jpeg\r\n" \
+                   "Content-Length: %zu\r\n" \
+                   "X-Timestamp: %d.%06d\r\n" \
+                   "X-Framerate: %d\r\n" \
+                   "\r\n", size, (int)fb->timestamp.tv_sec, (int)fb->timestamp.tv_usec, meta.fps);
+    return MIN((size_t)len, PART_HEADER_SIZE - 1);
+}
+
+/******************************************************************************
+Description.: format the multipart header of a frame unless the event loop
+              already did so for another stream of the same input
+Input Value.: w: input watch of the event loop
+              fb: frame
+Return Value: -
+******************************************************************************/
+static void stream_part_header(input_watch *w, frame_buffer *fb)
+{
+    if(w->sequence == fb->sequence && w->part_len > 0)
+        return;
+
+    w->part_len = format_part_header(w->part, fb, fb->size);
+    w->sequence = fb->sequence;
+}
+
+/******************************************************************************
+Description.: format the header of a binary WebSocket message carrying a
+              frame, followed by its metadata: the frame sequence as 32 bit
+              and the capture time in microseconds since the epoch as 64 bit
+              integer, both big endian
+Input Value.: part: PART_HEADER_SIZE bytes output
+              fb: frame
+              size: bytes of the JPEG sent for it
+Return Value: length of header and metadata
+******************************************************************************/
+static size_t ws_frame_header(char *part, frame_buffer *fb, size_t size)
+{
+    unsigned char *p = (unsigned char *)part;
+    unsigned long long payload = size + WS_PREFIX_SIZE;
+    unsigned long long us = (unsigned long long)fb->timestamp.tv_sec * 1000000ULL + fb->timestamp.tv_usec;
+    int i;
+
+    *p++ = 0x82;                     /* FIN, binary */
+    if(payload < 126) {
+        *p++ = payload;
+    } else if(payload < 65536) {
+        *p++ = 126;
+        *p++ = payload >> 8;
+        *p++ = payload;
+    } else {
+        *p++ = 127;
+        for(i = 7; i >= 0; i--)
+            *p++ = payload >> (8 * i);
+    }
+
+    for(i = 3; i >= 0; i--)
+        *p++ = fb->sequence >> (8 * i);
+    for(i = 7; i >= 0; i--)
+        *p++ = us >> (8 * i);
+    return p - (unsigned char *)part;
+}
+
+/******************************************************************************
+Description.: answer the control frames of a WebSocket client between two
+              frames: a pending pong, or the close handshake
+Input Value.: c: idle WebSocket connection
+Return Value: 1 if something is being sent, 0 otherwise
+******************************************************************************/
+static int ws_send_control(connection *c)
+{
+    static const char close_frame[] = { (char)0x88, 0x00 };
+
+    if(c->ws_closing) {
+        connection_reset_output(c);
+        connection_queue(c, close_frame, sizeof(close_frame));
+        connection_respond(c, C_RESPONSE);
+        return 1;
+    }
+    if(c->ws_control_len > 0) {
+        connection_reset_output(c);
+        connection_queue(c, c->ws_control, c->ws_control_len);
+        c->ws_control_len = 0;
+        connection_respond(c, C_STREAM_PART);
+        return 1;
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: Send the next multipart part if the input published a frame the
+              client has not seen yet. Frames published while a part was
+              being written are skipped, the client always gets the newest.
+              Header, frame and boundary leave with one writev(), together
+              with the stream header if that is still pending. WebSocket
+              clients get a binary message instead, as long as they have
+              credits.
+Input Value.: c: idle stream connection
+Return Value: -
+******************************************************************************/
+static void stream_next(connection *c)
+{
+    input_watch *w = &c->loop->inputs[c->input];
+    int lowat = c->loop->pc->conf.notsent_lowat;
+    const unsigned char *data;
+    frame_buffer *fb;
+    size_t i, size, part_len;
+    int notsent;
+
+    if(c->state != C_STREAM_IDLE)
+        return;
+    if(c->websocket && (ws_send_control(c) || c->credits <= 0))
+        return;
+
+    /*
+     * nothing is queued behind a frame the kernel has not sent yet, the
+     * socket polls writable below TCP_NOTSENT_LOWAT and the newest frame
+     * goes out then
+     */
+    if(lowat > 0 && (notsent = socket_notsent(c->src.fd)) >= 0) {
+        __atomic_store_n(&c->notsent, notsent, __ATOMIC_RELAXED);
+        if(notsent >= lowat) {
+            if(c->deadline_us == 0)
+                c->deadline_us = time_monotonic_us() + STALL_TIMEOUT * 1000000LL;
+            connection_want_write(c, 1);
+            return;
+        }
+    }
+
+    fb = input_frame_get(stream_source(c->loop->pc, c->input));
+    if(fb == NULL)
+        return;
+    if(fb->sequence == c->sequence) {
+        input_frame_put(fb);
+        return;
+    }
+
+    /* ?fps= passes over frames between its slots without touching them */
+    if(!frame_rate_take(&c->next_frame_us, c->frame_interval_us, fb)) {
+        __atomic_store_n(&c->sequence, fb->sequence, __ATOMIC_RELAXED);
+        input_frame_put(fb);
+        return;
+    }
+
+    /* frames published while the previous part was pending were skipped */
+    if(c->sequence != 0 && fb->sequence - c->sequence > 1) {
+        __atomic_store_n(&c->frames_dropped, c->frames_dropped + (fb->sequence - c->sequence - 1), __ATOMIC_RELAXED);
+        metric_add(c->loop->pc->m_dropped, fb->sequence - c->sequence - 1);
+    }
+
+    c->wakeup_us = time_monotonic_us();
+    __atomic_store_n(&c->sequence, fb->sequence, __ATOMIC_RELAXED);
+    c->frame = fb;
+
+    /* variants come finished from their own frame source */
+    data = fb->data;
+    size = fb->size;
+    if(c->websocket) {
+        part_len = ws_frame_header(c->part, fb, size);
+        __atomic_store_n(&c->credits, c->credits - 1, __ATOMIC_RELAXED);
+    } else {
+        /* the shared header is rewritten by the next frame while this part
+           may still be pending, so the connection sends its own copy */
+        stream_part_header(w, fb);
+        memcpy(c->part, w->part, w->part_len);
+        part_len = w->part_len;
+    }
+
+    connection_queue(c, c->part, part_len);
+    if(c->zerocopy && size >= ZEROCOPY_MIN)
+        c->zc_iov = c->iov_count;
+    connection_queue(c, data, size);
+    if(!c->websocket)
+        connection_queue(c, "\r\n--" BOUNDARY "\r\n", strlen("\r\n--" BOUNDARY "\r\n"));
+    c->part_bytes = 0;
+    for(i = c->iov_first; i < (size_t)c->iov_count; i++)
+        c->part_bytes += c->iov[i].iov_len;
+    __atomic_store_n(&c->unsent, c->part_bytes, __ATOMIC_RELAXED);
+    connection_respond(c, C_STREAM_PART);
+}
+
+/******************************************************************************
+Description.: turn a connection into a stream client once its response
+              header is formatted, the first frame goes out with the header
+              if one is available
+Input Value.: c: connection, c->header holds the response header
+              header_len: length of the header
+              input_number: input to stream
+              fps: frames per second to send at most, 0 = all of them
+Return Value: -
+******************************************************************************/
+static void stream_start(connection *c, int header_len, int input_number, int fps)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "http:%d", ntohs(c->loop->pc->conf.port));
+    c->latency = latency_register(name, input_number);
+    c->input = input_number;
+    c->sequence = 0;
+    c->streaming = 1;
+    c->keep_alive = 0;
+    c->started_us = time_monotonic_us();
+    c->frame_interval_us = fps > 0 ? 1000000LL / fps : 0;
+    c->next_frame_us = 0;
+    metric_add(c->loop->pc->m_clients, 1);
+#if defined(__linux__) && defined(SO_ZEROCOPY)
+    if(c->loop->pc->conf.zerocopy) {
+        int on = 1;
+        c->zerocopy = setsockopt(c->src.fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+    }
+#endif
+    if(c->loop->pc->conf.notsent_lowat > 0)
+        socket_notsent_lowat(c->src.fd, c->loop->pc->conf.notsent_lowat);
+
+    connection_reset_output(c);
+    connection_queue(c, c->header, header_len);
+    c->state = C_STREAM_IDLE;
+    c->deadline_us = 0;
+    stream_next(c);
+    if(c->state == C_STREAM_IDLE) {
+        c->unsent = header_len;
+        connection_respond(c, C_STREAM_PART);
+    }
+}
+
+/******************************************************************************
+Description.: Send the stream header, frames follow as the input publishes
+              them, see stream_next().
+Input Value.: c: connection
+              input_number: input to stream
+              fps: frames per second to send at most, 0 = all of them
+Return Value: -
+******************************************************************************/
+void send_stream(connection *c, int input_number, int fps)
+{
+    frame_meta meta;
+    int header_len;
+
+    if(admission_acquire(c, A_STREAM, input_number) < 0)
+        return;
+    if((input_number = variant_source(c, input_number, 1)) < 0)
+        return;
+    if(loop_watch_input(c->loop, input_number) < 0) {
+        send_error(c, 500, "could not watch the input");
+        return;
+    }
+
+    DBG("preparing header\n");
+    /* Get initial timestamp and fps for stream header, no need to lock */
+    input_meta_read(stream_source(c->loop->pc, input_number), &meta);
+    if(fps > 0 && (meta.fps <= 0 || fps < meta.fps))
+        meta.fps = fps;
+
+    /* Write stream header with dynamic values, the stream ends with the connection */
+    header_len = snprintf(c->header, sizeof(c->header),
+        "HTTP/1.0 200 OK\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Connection: close\r\n"
+        "Server: MJPG-Streamer/0.2\r\n"
+        "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n"
+        "Pragma: no-cache\r\n"
+        "Expires: Mon, 3 Jan 2000 12:34:56 GMT\r\n"
+        "Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n"
+        "X-Timestamp: %d.%06d\r\n"
+        "X-Framerate: %d\r\n"
+        "\r\n"
+        "--" BOUNDARY "\r\n",
+        (int)meta.timestamp.tv_sec, (int)meta.timestamp.tv_usec, meta.fps);
+
+    stream_start(c, header_len, input_number, fps);
+}
+
+/******************************************************************************
+Description.: Accept a WebSocket upgrade of /ws/stream. Each frame is sent as
+              one binary message of WS_PREFIX_SIZE bytes metadata and the
+              JPEG, but only while the client has credits left, see
+              ws_receive() for how it grants more.
+Input Value.: c: connection
+              input_number: input to stream
+              fps: frames per second to send at most, 0 = all of them
+              credits: frames the client accepts before granting more
+              key: Sec-WebSocket-Key of the request
+Return Value: -
+******************************************************************************/
+static void send_websocket(connection *c, int input_number, int fps, int credits, const char *key)
+{
+    char accept_key[64], accept[32];
+    unsigned char digest[20];
+    int header_len;
+
+    if(key[0] == '\0') {
+        send_error(c, 400, "WebSocket handshake expected");
+        return;
+    }
+    if(admission_acquire(c, A_STREAM, input_number) < 0)
+        return;
+    if((input_number = variant_source(c, input_number, 1)) < 0)
+        return;
+    if(loop_watch_input(c->loop, input_number) < 0) {
+        send_error(c, 500, "could not watch the input");
+        return;
+    }
+
+    snprintf(accept_key, sizeof(accept_key), "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", key);
+    sha1((const unsigned char *)accept_key, strlen(accept_key), digest);
+    encodeBase64(digest, sizeof(digest), accept);
+
+    header_len = snprintf(c->header, sizeof(c->header),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n"
+        "Server: MJPG-Streamer/0.2\r\n"
+        "\r\n", accept);
+
+    /* from now on the request buffer collects the frames of the client */
+    c->request_len -= c->request_end;
+    memmove(c->request, c->request + c->request_end, c->request_len + 1);
+    c->request_end = 0;
+    c->websocket = 1;
+    c->credits = MIN(MAX(credits, 1), WS_CREDITS_MAX);
+
+    stream_start(c, header_len, input_number, fps);
+}
+
+/******************************************************************************
+Description.: paint a rectangle of the mosaic canvas black
+Input Value.: m: mosaic
+              x, y, width, height: even luma coordinates
+Return Value: -
+******************************************************************************/
+static void mosaic_clear(mosaic *m, int x, int y, int width, int height)
+{
+    int row;
+
+    for(row = 0; row < height; row++)
+        memset(m->planes[0] + (size_t)(y + row) * m->strides[0] + x, 0, width);
+    for(row = 0; row < height / 2; row++) {
+        memset(m->planes[1] + (size_t)(y / 2 + row) * m->strides[1] + x / 2, 128, width / 2);
+        memset(m->planes[2] + (size_t)(y / 2 + row) * m->strides[2] + x / 2, 128, width / 2);
+    }
+}
+
+/******************************************************************************
+Description.: Decode a frame into its tile. TurboJPEG scales in the DCT
+              domain to the largest size that fits and decodes straight to
+              YUV, the chroma of other subsamplings is resampled to 4:2:0
+              while copying. The picture is centered in the tile.
+Input Value.: m: mosaic
+              tile: index of the tile, row by row
+              fb: newest frame of the input of the tile
+Return Value: 0 if the tile was updated, -1 on error
+******************************************************************************/
+static int mosaic_tile(mosaic *m, int tile, frame_buffer *fb)
+{
+    int x0 = (tile % m->grid) * m->tile_width, y0 = (tile / m->grid) * m->tile_height;
+    int scale, width, height, copy_width, copy_height, x, y, i, sx, sy;
+    int plane_width[3], plane_height[3];
+    unsigned char *src[3], *scratch;
+    size_t need;
+
+    if(!fb->jpeg.valid || fb->jpeg.subsamp < 0)
+        return -1;
+
+    scale = MAX((fb->jpeg.width + m->tile_width - 1) / m->tile_width,
+                (fb->jpeg.height + m->tile_height - 1) / m->tile_height);
+    if(jpeg_scaled_size(fb->jpeg.width, fb->jpeg.height, scale, &width, &height) < 0)
+        return -1;
+
+    need = jpeg_yuv_size(width, height, fb->jpeg.subsamp);
+    if(need == 0)
+        return -1;
+    if(m->scratch_size < need) {
+        if((scratch = realloc(m->scratch, need)) == NULL)
+            return -1;
+        m->scratch = scratch;
+        m->scratch_size = need;
+    }
+    if(jpeg_decode_scaled_yuv(fb->data, fb->size, m->scratch, m->scratch_size, width, height,
+                              fb->jpeg.subsamp, src, plane_width, plane_height) < 0)
+        return -1;
+    metric_add(m->m_decodes, 1);
+
+    /* a picture of another size leaves parts of the old one behind */
+    if(m->tile_size[tile][0] != width || m->tile_size[tile][1] != height) {
+        mosaic_clear(m, x0, y0, m->tile_width, m->tile_height);
+        m->tile_size[tile][0] = width;
+        m->tile_size[tile][1] = height;
+    }
+
+    copy_width = MIN(width, m->tile_width) & ~1;
+    copy_height = MIN(height, m->tile_height) & ~1;
+    x0 += ((m->tile_width - copy_width) / 2) & ~1;
+    y0 += ((m->tile_height - copy_height) / 2) & ~1;
+
+    for(y = 0; y < copy_height; y++)
+        memcpy(m->planes[0] + (size_t)(y0 + y) * m->strides[0] + x0, src[0] + (size_t)y * plane_width[0], copy_width);
+    if(src[1] == NULL)
+        return 0;
+
+    for(i = 1; i < 3; i++) {
+        for(y = 0; y < copy_height / 2; y++) {
+            unsigned char *dst = m->planes[i] + (size_t)(y0 / 2 + y) * m->strides[i] + x0 / 2;
+            sy = MIN(y * 2 * plane_height[i] / height, plane_height[i] - 1);
+            if(plane_width[i] * 2 == width) {
+                memcpy(dst, src[i] + (size_t)sy * plane_width[i], copy_width / 2);
+                continue;
+            }
+            for(x = 0; x < copy_width / 2; x++) {
+                sx = MIN(x * 2 * plane_width[i] / width, plane_width[i] - 1);
+                dst[x] = src[i][(size_t)sy * plane_width[i] + sx];
+            }
+        }
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: Bring the tiles up to date and publish the canvas if one of
+              them changed. The canvas is encoded once no matter how many
+              clients watch it.
+Input Value.: m: mosaic
+Return Value: -
+******************************************************************************/
+static void mosaic_tick(mosaic *m)
+{
+    long long capture_us = 0;
+    frame_buffer *fb;
+    size_t size;
+    int tile;
+
+    for(tile = 0; tile < m->grid * m->grid && tile < pglobal->incnt; tile++) {
+        if((fb = input_frame_get(&pglobal->in[tile])) == NULL)
+            continue;
+        if(fb->sequence != m->tile_sequence[tile] && mosaic_tile(m, tile, fb) == 0) {
+            m->tile_sequence[tile] = fb->sequence;
+            /* the mosaic is as old as the oldest picture that changed */
+            if(capture_us == 0 || fb->capture_us < capture_us)
+                capture_us = fb->capture_us;
+        }
+        input_frame_put(fb);
+    }
+    if(capture_us == 0)
+        return;
+
+    if((fb = input_frame_acquire(&m->in, jpeg_encode_bound(m->width, m->height))) == NULL)
+        return;
+    if(jpeg_encode_yuv420((const unsigned char **)m->planes, m->strides, m->width, m->height, MOSAIC_QUALITY,
+                          fb->data, fb->capacity, &size) < 0) {
+        DBG("could not encode the %dx%d mosaic\n", m->grid, m->grid);
+        input_frame_put(fb);
+        return;
+    }
+    metric_add(m->m_encodes, 1);
+    fb->capture_us = capture_us;
+    input_frame_publish(&m->in, fb, size, NULL);
+}
+
+/******************************************************************************
+Description.: compose a mosaic MOSAIC_FPS times per second while it has
+              viewers, sleep otherwise
+Input Value.: arg: mosaic
+Return Value: NULL
+******************************************************************************/
+static void *mosaic_thread(void *arg)
+{
+    mosaic *m = arg;
+    long long next_us = 0, now;
+    struct timespec until;
+
+    while(!pglobal->stop) {
+        if(__atomic_load_n(&m->viewers, __ATOMIC_RELAXED) == 0) {
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += 1;
+            pthread_mutex_lock(&m->lock);
+            if(__atomic_load_n(&m->viewers, __ATOMIC_RELAXED) == 0)
+                pthread_cond_timedwait(&m->wake, &m->lock, &until);
+            pthread_mutex_unlock(&m->lock);
+            next_us = 0;
+            continue;
+        }
+
+        now = time_monotonic_us();
+        if(next_us > now)
+            usleep(next_us - now);
+        next_us = MAX(next_us, now) + 1000000 / MOSAIC_FPS;
+        mosaic_tick(m);
+    }
+    return NULL;
+}
+
+/******************************************************************************
+Description.: allocate the canvas of a mosaic, black until the first tick
+Input Value.: m: mosaic
+Return Value: 0 on success, -1 on error
+******************************************************************************/
+static int mosaic_canvas(mosaic *m)
+{
+    m->planes[0] = malloc((size_t)m->width * m->height * 3 / 2);
+    if(m->planes[0] == NULL)
+        return -1;
+    m->planes[1] = m->planes[0] + (size_t)m->width * m->height;
+    m->planes[2] = m->planes[1] + (size_t)m->width * m->height / 4;
+    mosaic_clear(m, 0, 0, m->width, m->height);
+    return 0;
+}
+
+/******************************************************************************
+Description.: prepare a mosaic, its canvas and thread come with the first
+              viewer, so servers whose mosaics are never watched do not
+              hold megabytes of canvas
+Input Value.: pc: server context
+              grid: tiles per row and column
+Return Value: 0 on success, -1 on error
+******************************************************************************/
+static int mosaic_init(context *pc, int grid)
+{
+    mosaic *m = &pc->mosaics[grid - MOSAIC_GRID_MIN];
+    char labels[64];
+
+    m->grid = grid;
+    m->tile_width = (MOSAIC_WIDTH / grid) & ~1;
+    m->tile_height = (MOSAIC_HEIGHT / grid) & ~1;
+    m->width = m->tile_width * grid;
+    m->height = m->tile_height * grid;
+    m->strides[0] = m->width;
+    m->strides[1] = m->strides[2] = m->width / 2;
+
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->wake, NULL);
+    pthread_mutex_init(&m->in.db, NULL);
+    pthread_cond_init(&m->in.db_update, NULL);
+    m->in.width = m->width;
+    m->in.height = m->height;
+    m->in.fps = MOSAIC_FPS;
+    /* not an input, so not labeled as one */
+    snprintf(labels, sizeof(labels), "port=\"%d\",grid=\"%d\"", ntohs(pc->conf.port), grid);
+    if(input_frames_init_labels(&m->in, labels, 2) < 0)
+        return -1;
+
+    m->m_decodes = metric_counter("mjpg_http_mosaic_decodes_total", labels, "Tiles decoded for the mosaic");
+    m->m_encodes = metric_counter("mjpg_http_mosaic_encodes_total", labels, "Mosaic frames encoded");
+    return 0;
+}
+
+/******************************************************************************
+Description.: stream the mosaic of the first grid x grid inputs
+Input Value.: c: connection
+              grid: tiles per row and column
+              fps: frames per second to send at most, 0 = all of them
+Return Value: -
+******************************************************************************/
+static void send_mosaic(connection *c, int grid, int fps)
+{
+    mosaic *m = &c->loop->pc->mosaics[grid - MOSAIC_GRID_MIN];
+    pthread_t thread;
+
+    pthread_mutex_lock(&m->lock);
+    if(!m->started && (m->planes[0] != NULL || mosaic_canvas(m) == 0) &&
+       pthread_create(&thread, NULL, mosaic_thread, m) == 0) {
+        pthread_detach(thread);
+        m->started = 1;
+    }
+    pthread_mutex_unlock(&m->lock);
+    if(!m->started) {
+        send_error(c, 500, "could not start the mosaic");
+        return;
+    }
+
+    send_stream(c, pglobal->incnt + grid - MOSAIC_GRID_MIN, fps);
+    if(!c->streaming)
+        return;
+
+    c->mosaic = m;
+    pthread_mutex_lock(&m->lock);
+    __atomic_add_fetch(&m->viewers, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&m->wake);
+    pthread_mutex_unlock(&m->lock);
+}
+
+/******************************************************************************
+Description.: Send the metrics registry of all plugins.
+Input Value.: c: connection
+              json: 1 for JSON, 0 for the prometheus text format
+Return Value: -
+******************************************************************************/
+void send_metrics(connection *c, int json)
+{
+    size_t length;
+    char *text = metrics_format(json, &length);
+
+    send_text(c, json ? "application/json" : "text/plain; version=0.0.4", text, length);
+}
+
+/******************************************************************************
+Description.: Send the frame stage latencies or the Chrome trace dump.
+Input Value.: c: connection
+              trace: 1 for the trace of the latest frames, 0 for the summary
+Return Value: -
+******************************************************************************/
+void send_latency(connection *c, int trace)
+{
+    size_t length;
+    char *text = trace ? latency_trace_format(&length) : latency_format(&length);
+
+    send_text(c, "application/json", text, length);
+}
+
+/******************************************************************************
+Description.: Send the stream clients of all event loops of this server as
+              JSON, with the frames and bytes each one got, the frames it had
+              to skip and how far the part being written lags behind its
+              input, followed by the connections each event loop serves.
+Input Value.: c: connection
+Return Value: -
+******************************************************************************/
+void send_clients(connection *c)
+{
+    context *pc = c->loop->pc;
+    long long now = time_monotonic_us();
+    size_t length = 0, size = 4096;
+    char *text = malloc(size), *grown;
+    frame_meta meta;
+    connection *s;
+    long long seconds_us;
+    unsigned long long bytes;
+    int i;
+
+    if(text != NULL)
+        length = snprintf(text, size, "{\"clients\":[");
+
+    for(i = 0; text != NULL && i < pc->loop_count; i++) {
+        event_loop *l = &pc->loops[i];
+
+        pthread_mutex_lock(&l->lock);
+        for(s = l->connections; s != NULL; s = s->next) {
+            if(!s->streaming)
+                continue;
+            if(size - length < 448) {
+                if((grown = realloc(text, size * 2)) == NULL) {
+                    free(text);
+                    text = NULL;
+                    break;
+                }
+                text = grown;
+                size *= 2;
+            }
+            input_meta_read(stream_source(pc, s->input), &meta);
+            seconds_us = now - s->started_us;
+            bytes = __atomic_load_n(&s->bytes_sent, __ATOMIC_RELAXED);
+            length += snprintf(text + length, size - length,
+                "%s{\"loop\":%d,\"peer\":\"%s\",\"input\":%d,\"fps\":%lld,\"scale\":%d,\"quality\":%d,\"seconds\":%lld,"
+                "\"frames_sent\":%lu,\"bytes_sent\":%llu,\"bytes_per_second\":%llu,\"frames_dropped\":%lu,\"frames_behind\":%u,\"unsent_bytes\":%zu,"
+                "\"delay_ms\":%lld,\"delay_max_ms\":%lld,\"notsent_bytes\":%d,"
+                "\"websocket\":%d,\"credits\":%d}",
+                text[length - 1] == '[' ? "" : ",", i, s->peer, s->input,
+                s->frame_interval_us > 0 ? 1000000LL / s->frame_interval_us : 0LL,
+                s->scale, s->quality,
+                seconds_us / 1000000,
+                __atomic_load_n(&s->frames_sent, __ATOMIC_RELAXED),
+                bytes, seconds_us > 0 ? (unsigned long long)(bytes * 1000000.0 / seconds_us) : 0ULL,
+                __atomic_load_n(&s->frames_dropped, __ATOMIC_RELAXED),
+                meta.sequence - __atomic_load_n(&s->sequence, __ATOMIC_RELAXED),
+                __atomic_load_n(&s->unsent, __ATOMIC_RELAXED),
+                __atomic_load_n(&s->delay_us, __ATOMIC_RELAXED) / 1000,
+                __atomic_load_n(&s->delay_max_us, __ATOMIC_RELAXED) / 1000,
+                __atomic_load_n(&s->notsent, __ATOMIC_RELAXED),
+                s->websocket, s->websocket ? __atomic_load_n(&s->credits, __ATOMIC_RELAXED) : 0);
+        }
+        pthread_mutex_unlock(&l->lock);
+    }
+
+    /* 128 bytes per loop */
+    if(text != NULL && size - length < 128 * (size_t)pc->loop_count + 16) {
+        size = length + 128 * pc->loop_count + 16;
+        if((grown = realloc(text, size)) == NULL) {
+            free(text);
+            text = NULL;
+        } else {
+            text = grown;
+        }
+    }
+
+    if(text != NULL)
+        length += snprintf(text + length, size - length, "],\"loops\":[");
+
+    for(i = 0; text != NULL && i < pc->loop_count; i++) {
+        event_loop *l = &pc->loops[i];
+        int streams = 0, connections;
+        unsigned long accepted;
+
+        pthread_mutex_lock(&l->lock);
+        for(s = l->connections; s != NULL; s = s->next)
+            streams += s->streaming;
+        connections = l->connection_count;
+        accepted = l->accepted;
+        pthread_mutex_unlock(&l->lock);
+
+        length += snprintf(text + length, size - length,
+            "%s{\"loop\":%d,\"connections\":%d,\"streams\":%d,\"accepted\":%lu}",
+            i > 0 ? "," : "", i, connections, streams, accepted);
+    }
+
+    if(text != NULL)
+        length += snprintf(text + length, size - length, "]}\n");
+
+    send_text(c, "application/json", text, length);
+}
+
+/******************************************************************************
+Description.: Send a generated, uncacheable document, the connection frees it.
+Input Value.: c: connection
+              content_type: MIME type of text
+              text: malloc'ed document, NULL sends an error
+              length: bytes of text
+Return Value: -
+******************************************************************************/
+static void send_text(connection *c, const char *content_type, char *text, size_t length)
+{
+    int header_len;
+
+    if(text == NULL) {
+        send_error(c, 500, "could not allocate memory");
+        return;
+    }
+
+    header_len = snprintf(c->header, sizeof(c->header),
+        "HTTP/1.%d 200 OK\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "%s"
+        "Server: MJPG-Streamer/0.2\r\n"
+        "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "\r\n",
+        c->http_minor, response_connection(c), content_type, length);
+
+    connection_reset_output(c);
+    c->out = text;
+    connection_queue(c, c->header, header_len);
+    connection_queue(c, text, length);
+    connection_respond(c, C_RESPONSE);
+}
+
+/******************************************************************************
+Description.: look up the mimetype of a file by its extension
+Input Value.: name: file name
+Return Value: mimetype or NULL if files with that extension are not served
+******************************************************************************/
+static const char *www_mimetype(const char *name)
+{
+    const char *extension = strrchr(name, '.');
+    int i;
+
+    if(extension == NULL || extension == name)
+        return NULL;
+    for(i = 0; i < LENGTH_OF(mimetypes); i++) {
+        if(strcmp(mimetypes[i].dot_extension, extension) == 0)
+            return mimetypes[i].mimetype;
+    }
+    return NULL;
+}
+
+static int www_compare(const void *a, const void *b)
+{
+    return strcmp(((const www_file *)a)->name, ((const www_file *)b)->name);
+}
+
+/******************************************************************************
+Description.: find a preloaded file of the www folder
+Input Value.: pc: server context
+              name: file name relative to the www folder
+Return Value: cached file or NULL
+******************************************************************************/
+static www_file *www_cache_find(context *pc, const char *name)
+{
+    www_file key;
+
+    if(pc->www_count == 0)
+        return NULL;
+    key.name = (char *)name;
+    return bsearch(&key, pc->www, pc->www_count, sizeof(www_file), www_compare);
+}
+
+/******************************************************************************
+Description.: map the servable files of the www folder and their .gz siblings
+              into memory, so serving the web interface reads nothing from
+              the SD card. Files that are too large stay on disk.
+Input Value.: pc: server context
+Return Value: -
+******************************************************************************/
+static void www_cache_load(context *pc)
+{
+    char path[BUFFER_SIZE], plain[NAME_MAX + 1];
+    size_t total = 0, len;
+    int fd, i, capacity = 0;
+    struct dirent *de;
+    struct stat st;
+    www_file *f;
+    void *data;
+    DIR *dir;
+
+    if(pc->conf.www_folder == NULL || (dir = opendir(pc->conf.www_folder)) == NULL)
+        return;
+
+    while((de = readdir(dir)) != NULL) {
+        /* only names send_file() could be asked for */
+        len = strlen(de->d_name);
+        if(strspn(de->d_name, FILE_NAME_CHARS) != len)
+            continue;
+        snprintf(plain, sizeof(plain), "%s", de->d_name);
+        if(len > 3 && strcmp(plain + len - 3, ".gz") == 0)
+            plain[len - 3] = '\0';
+        if(www_mimetype(plain) == NULL)
+            continue;
+
+        snprintf(path, sizeof(path), "%s%s", pc->conf.www_folder, de->d_name);
+        if((fd = open(path, O_RDONLY)) < 0)
+            continue;
+        if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+           st.st_size > WWW_CACHE_FILE_MAX || total + st.st_size > WWW_CACHE_SIZE) {
+            close(fd);
+            continue;
+        }
+#ifdef MAP_POPULATE
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+#else
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+#endif
+        close(fd);
+        if(data == MAP_FAILED)
+            continue;
+
+        if(pc->www_count == capacity) {
+            www_file *grown = realloc(pc->www, (capacity ? capacity * 2 : 16) * sizeof(www_file));
+            if(grown == NULL) {
+                munmap(data, st.st_size);
+                break;
+            }
+            pc->www = grown;
+            capacity = capacity ? capacity * 2 : 16;
+        }
+
+        f = &pc->www[pc->www_count];
+        if((f->name = strdup(de->d_name)) == NULL) {
+            munmap(data, st.st_size);
+            continue;
+        }
+        f->mimetype = www_mimetype(plain);
+        f->data = data;
+        f->size = st.st_size;
+        f->mtime = st.st_mtime;
+        f->gz = NULL;
+        pc->www_count++;
+        total += st.st_size;
     }
+    closedir(dir);
 
-    if(write(fd, buffer, strlen(buffer)) < 0) {
-        DBG("write failed, done anyway\n");
+    qsort(pc->www, pc->www_count, sizeof(www_file), www_compare);
+
+    /* link the precompressed siblings, the table does not change afterwards */
+    for(i = 0; i < pc->www_count; i++) {
+        len = strlen(pc->www[i].name);
+        if(len <= 3 || strcmp(pc->www[i].name + len - 3, ".gz") != 0)
+            continue;
+        snprintf(plain, sizeof(plain), "%.*s", (int)(len - 3), pc->www[i].name);
+        if((f = www_cache_find(pc, plain)) != NULL)
+            f->gz = &pc->www[i];
     }
+
+    DBG("preloaded %d files of %s, %zu bytes\n", pc->www_count, pc->conf.www_folder, total);
 }
 
 /******************************************************************************
-Description.: Send HTTP header and copy the content of a file. To keep things
+Description.: Send HTTP header and the content of a file. To keep things
               simple, just a single folder gets searched for the file. Just
               files with known extension and supported mimetype get served.
-              If no parameter was given, the file "index.html" will be copied.
-Input Value.: * fd.......: filedescriptor to send data to
-              * id.......: specifies which server-context is the right one
+              If no parameter was given, the file "index.html" will be sent.
+              Files are sent from the www cache while they are unchanged on
+              disk, otherwise with sendfile(). A name.gz sibling is sent
+              instead to clients that accept gzip.
+Input Value.: * c........: connection to send data to
               * parameter: string that consists of the filename
 Return Value: -
 ******************************************************************************/
-void send_file(int id, int fd, char *parameter)
+void send_file(connection *c, char *parameter)
 {
-    char buffer[BUFFER_SIZE] = {0};
-    char *extension, *mimetype = NULL;
-    int i, lfd;
-    config conf = servers[id].conf;
+    context *pc = c->loop->pc;
+    char path[BUFFER_SIZE], gz_path[BUFFER_SIZE + 3];
+    char etag[48], last_modified[40];
+    const char *mimetype;
+    struct stat st, gz_st;
+    struct tm tm;
+    www_file *f;
+    int fd = -1, gzip = 0, header_len;
 
     /* in case no parameter was given */
     if(parameter == NULL || strlen(parameter) == 0)
         parameter = "index.html";
 
-    /* find file-extension */
-    char * pch;
-    pch = strchr(parameter, '.');
-    int lastDot = 0;
-    while(pch != NULL) {
-        lastDot = pch - parameter;
-        pch = strchr(pch + 1, '.');
+    if(strrchr(parameter, '.') == NULL || strrchr(parameter, '.') == parameter) {
+        send_error(c, 400, "No file extension found");
+        return;
+    }
+
+    /* in case of unknown mimetype or extension leave */
+    if((mimetype = www_mimetype(parameter)) == NULL) {
+        send_error(c, 404, "MIME-TYPE not known");
+        return;
+    }
+
+    /* a stat() is all the I/O a cached file costs, it tells if the cache is current */
+    snprintf(path, sizeof(path), "%s%s", pc->conf.www_folder, parameter);
+    if(stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        DBG("file %s not accessible\n", path);
+        send_error(c, 404, "Could not open file");
+        return;
+    }
+    f = www_cache_find(pc, parameter);
+
+    /* prefer a precompressed sibling that is not older than the file */
+    if(c->accept_gzip) {
+        snprintf(gz_path, sizeof(gz_path), "%s.gz", path);
+        if(stat(gz_path, &gz_st) == 0 && S_ISREG(gz_st.st_mode) && gz_st.st_mtime >= st.st_mtime) {
+            gzip = 1;
+            st = gz_st;
+            f = f != NULL ? f->gz : NULL;
+            memcpy(path, gz_path, sizeof(path) - 1);
+            path[sizeof(path) - 1] = '\0';
+        }
+    }
+    if(f != NULL && (f->size != (size_t)st.st_size || f->mtime != st.st_mtime))
+        f = NULL;
+
+    snprintf(etag, sizeof(etag), "\"%lx-%lx%s\"", (unsigned long)st.st_size,
+             (unsigned long)st.st_mtime, gzip ? "-gz" : "");
+    gmtime_r(&st.st_mtime, &tm);
+    strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    if(etag_cached(c, etag) ||
+       (c->if_none_match[0] == '\0' && strcmp(c->if_modified_since, last_modified) == 0)) {
+        send_not_modified(c, etag);
+        return;
     }
 
-    if(lastDot == 0) {
-        send_error(fd, 400, "No file extension found");
+    if(f == NULL && (fd = open(path, O_RDONLY)) < 0) {
+        DBG("file %s not accessible\n", path);
+        send_error(c, 404, "Could not open file");
         return;
+    }
+    DBG("serving file \"%s\" (%s), mime: \"%s\"\n", path, f != NULL ? "cached" : "sendfile", mimetype);
+
+    header_len = snprintf(c->header, sizeof(c->header), "HTTP/1.%d 200 OK\r\n" \
+             "Content-type: %s\r\n" \
+             "Content-Length: %lld\r\n" \
+             "ETag: %s\r\n" \
+             "Last-Modified: %s\r\n" \
+             "%s" \
+             "Vary: Accept-Encoding\r\n" \
+             "%s" \
+             "Server: MJPG-Streamer/0.2\r\n" \
+             "Cache-Control: no-cache\r\n" \
+             "\r\n", c->http_minor, mimetype, (long long)st.st_size, etag, last_modified,
+             gzip ? "Content-Encoding: gzip\r\n" : "", response_connection(c));
+
+    connection_reset_output(c);
+    connection_queue(c, c->header, header_len);
+    if(f != NULL)
+        connection_queue(c, f->data, f->size);
+    else
+        c->file_fd = fd;
+    connection_respond(c, C_RESPONSE);
+}
+
+/******************************************************************************
+Description.: Save the current frame with the output_file plugin before
+              sending it. If that plugin is not loaded, or the file could not
+              be saved then we won't transmit the frame.
+Input Value.: c: connection
+              parameter: query string with filename=
+              input_number: input to take the frame from
+Return Value: -
+******************************************************************************/
+static void send_take(connection *c, char *parameter, int input_number)
+{
+    int i, ret = 0, found = 0;
+
+    for (i = 0; i<pglobal->outcnt; i++) {
+        if (pglobal->out[i].name != NULL) {
+            if (strstr(pglobal->out[i].name, "FILE output plugin")) {
+                found = 255;
+                DBG("output_file found id: %d\n", i);
+                char *filename = NULL;
+                char *filenamearg = NULL;
+                int len = 0;
+                DBG("Buffer: %s \n", parameter);
+                if(parameter != NULL && (filename = strstr(parameter, "filename=")) != NULL) {
+                    filename += strlen("filename=");
+                    char *fn = strchr(filename, '&');
+                    if (fn == NULL)
+                        len = strlen(filename);
+                    else
+                        len = (int)(fn - filename);
+                    filenamearg = (char*)calloc(len + 1, sizeof(char));
+                    memcpy(filenamearg, filename, len);
+                    DBG("Filename = %s\n", filenamearg);
+                    //int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int value, char *valueStr)
+                    ret = pglobal->out[i].cmd(i, OUT_FILE_CMD_TAKE, IN_CMD_GENERIC, 0, filenamearg);
+                } else {
+                    DBG("filename is not specified int the URL\n");
+                    send_error(c, 404, "The &filename= must present for the take command in the URL");
+                }
+                break;
+            }
+        }
+    }
+
+    if (found == 0) {
+        LOG("FILE CHANGE TEST output plugin not loaded\n");
+        send_error(c, 404, "FILE output plugin not loaded, taking snapshot not possible");
     } else {
-        extension = parameter + lastDot;
-        DBG("%s EXTENSION: %s\n", parameter, extension);
+        if (ret == 0) {
+            send_snapshot(c, input_number);
+        } else {
+            send_error(c, 404, "Taking snapshot failed!");
+        }
     }
+}
 
-    /* determine mime-type */
-    for(i = 0; i < LENGTH_OF(mimetypes); i++) {
-        if(strcmp(mimetypes[i].dot_extension, extension) == 0) {
-            mimetype = (char *)mimetypes[i].mimetype;
+/******************************************************************************
+Description.: Parse a complete request header and start the answer.
+Input Value.: c: connection, c->request holds the NUL terminated header
+Return Value: -
+******************************************************************************/
+static void handle_request(connection *c)
+{
+    context *pc = c->loop->pc;
+    int query_suffixed = 0;
+    int input_number = 0;
+    int json = 0, trace = 0, fps = 0, variant = 0;
+    int keep_alive, body = 0, credits = WS_CREDITS, grid = 0;
+    const route *rt;
+    const char *format;
+    char *target;
+    size_t len;
+    request req;
+
+    metric_add(pc->m_requests, 1);
+    c->keep_alive = 0;
+
+    if(request_parse(c, &req) != 0) {
+        DBG("HTTP request seems to be malformed\n");
+        send_error(c, 400, "Malformed HTTP request");
+        return;
+    }
+    target = req.target;
+
+    /* HTTP/1.1 connections persist unless the client says otherwise */
+    c->http_minor = req.version != NULL && strcmp(req.version, "HTTP/1.1") == 0;
+    keep_alive = c->http_minor;
+
+    /* determine what to deliver */
+    if((strcmp(req.method, "GET") == 0 || strcmp(req.method, "POST") == 0) &&
+       (rt = request_route(&req, &input_number)) != NULL) {
+        req.type = rt->type;
+        query_suffixed = rt->per_input ? 255 : 0;
+    } else if(strcmp(req.method, "GET") == 0) {
+        DBG("try to serve a file\n");
+        req.type = A_FILE;
+        req.parameter = target + 1;
+        len = MIN(strspn(req.parameter, FILE_NAME_CHARS), 100);
+        req.parameter[len] = '\0';
+        DBG("parameter (len: %d): \"%s\"\n", (int)len, req.parameter);
+    } else {
+        DBG("HTTP request seems to be malformed\n");
+        send_error(c, 400, "Malformed HTTP request");
+        return;
+    }
+
+    switch(req.type) {
+    case A_SNAPSHOT:
+        variant = parse_variant(target, &c->scale, &c->quality);
+        c->after = parse_query_int(target, "after", 0);
+        break;
+    case A_WEBSOCKET:
+        fps = parse_query_int(target, "fps", 0);
+        credits = parse_query_int(target, "credits", WS_CREDITS);
+        variant = parse_variant(target, &c->scale, &c->quality);
+        break;
+    case A_STREAM:
+        fps = parse_query_int(target, "fps", 0);
+        variant = parse_variant(target, &c->scale, &c->quality);
+        break;
+    case A_MOSAIC:
+        query_suffixed = 255;
+        input_number = 0;
+        fps = parse_query_int(target, "fps", 0);
+        grid = parse_query_int(target, "grid", MOSAIC_GRID_MIN);
+        variant = parse_variant(target, &c->scale, &c->quality);
+        break;
+    case A_METRICS:
+        format = parse_query_value(target, "format");
+        json = format != NULL && strncmp(format, "json", 4) == 0;
+        break;
+    case A_LATENCY:
+        format = parse_query_value(target, "format");
+        trace = format != NULL && strncmp(format, "trace", 5) == 0;
+        break;
+    case A_TAKE:
+        /* the query is the last part of the target, unescape it where it is */
+        if((req.parameter = strchr(target, '?')) != NULL) {
+            req.parameter++;
+            len = MIN(strspn(req.parameter, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./"), 100);
+            req.parameter[len] = '\0';
+            if(unescape(req.parameter) == -1) {
+                send_error(c, 500, "could not properly parse parameter string");
+                return;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    DBG("plugin_no: %d\n", input_number);
+
+    /* the header values, all of them NUL terminated by request_parse() */
+    if(req.if_none_match != NULL)
+        snprintf(c->if_none_match, sizeof(c->if_none_match), "%s", req.if_none_match);
+    if(req.if_modified_since != NULL)
+        snprintf(c->if_modified_since, sizeof(c->if_modified_since), "%s", req.if_modified_since);
+    if(req.accept_encoding != NULL)
+        c->accept_gzip = strstr(req.accept_encoding, "gzip") != NULL;
+    if(req.connection != NULL) {
+        if(strncasecmp(req.connection, "close", strlen("close")) == 0)
+            keep_alive = 0;
+        else if(strncasecmp(req.connection, "keep-alive", strlen("keep-alive")) == 0)
+            keep_alive = 1;
+    }
+    if(req.content_length != NULL)
+        body = atoi(req.content_length) > 0;
+    if(req.transfer_encoding != NULL)
+        body = 1;
+    if(req.credentials != NULL) {
+        if(strncasecmp(req.credentials, "Basic ", strlen("Basic ")) == 0) {
+            req.credentials += strlen("Basic ");
+            decodeBase64(req.credentials);
+            DBG("username:password: %s\n", req.credentials);
+        } else {
+            req.credentials = NULL;
+        }
+    }
+
+    /*
+     * request bodies are not read, so the next request could not be found,
+     * and the connection closes after keepalive_max requests
+     */
+    c->requests++;
+    c->keep_alive = keep_alive && !body && pc->conf.keepalive_timeout > 0 &&
+                    c->requests < (unsigned int)pc->conf.keepalive_max;
+
+    /* check for username and password if parameter -c was given */
+    if(pc->conf.credentials != NULL) {
+        if(req.credentials == NULL || strcmp(pc->conf.credentials, req.credentials) != 0) {
+            DBG("access denied\n");
+            send_error(c, 401, "username and password do not match to configuration");
+            return;
+        }
+        DBG("access granted\n");
+    }
+
+    /* now it's time to answer */
+    if (query_suffixed) {
+        if(input_number < 0 || input_number >= pglobal->incnt) {
+            DBG("Input number: %d out of range (valid: 0..%d)\n", input_number, pglobal->incnt-1);
+            send_error(c, 404, "Invalid input plugin number");
+            req.type = A_UNKNOWN;
+        } else if(variant < 0) {
+            send_error(c, 400, "scale must be 1/2, 1/4 or 1/8 and q between 1 and 100");
+            req.type = A_UNKNOWN;
+        } else if(req.type == A_MOSAIC && (grid < MOSAIC_GRID_MIN || grid > MOSAIC_GRID_MAX)) {
+            send_error(c, 400, "grid must be 2, 3 or 4");
+            req.type = A_UNKNOWN;
+        }
+    }
+
+    switch(req.type) {
+    case A_SNAPSHOT:
+        DBG("Request for snapshot from input: %d\n", input_number);
+        send_snapshot(c, input_number);
+        break;
+    case A_STREAM:
+        DBG("Request for stream from input: %d\n", input_number);
+        send_stream(c, input_number, fps);
+        break;
+    case A_WEBSOCKET:
+        DBG("Request for WebSocket stream from input: %d\n", input_number);
+        send_websocket(c, input_number, fps, credits, req.ws_key != NULL ? req.ws_key : "");
+        break;
+    case A_MOSAIC:
+        DBG("Request for the %dx%d mosaic\n", grid, grid);
+        send_mosaic(c, grid, fps);
+        break;
+    case A_METRICS:
+        send_metrics(c, json);
+        break;
+    case A_LATENCY:
+        send_latency(c, trace);
+        break;
+    case A_CLIENTS:
+        send_clients(c);
+        break;
+    case A_FILE:
+        if(pc->conf.www_folder == NULL)
+            send_error(c, 501, "no www-folder configured");
+        else
+            send_file(c, req.parameter);
+        break;
+    case A_TAKE:
+        send_take(c, req.parameter, input_number);
+        break;
+    default:
+        DBG("unknown request\n");
+    }
+
+    /* no answer was started, e.g. for an invalid input number */
+    if(c->state == C_REQUEST)
+        connection_close(c);
+}
+
+/******************************************************************************
+Description.: find the end of the first request header in the buffer, the
+              search resumes where the previous call stopped, so each byte
+              of a header arriving in pieces is looked at once
+Input Value.: c: connection
+Return Value: length of the header including the empty line, 0 if incomplete
+******************************************************************************/
+static size_t request_header_end(connection *c)
+{
+    char *p = c->request + c->request_scan, *end = c->request + c->request_len, *lf;
+
+    while((lf = memchr(p, '\n', end - p)) != NULL) {
+        /* LF LF or LF CR LF, the request line does not count as empty */
+        if(lf > c->request + 1 && (lf[-1] == '\n' || (lf[-1] == '\r' && lf[-2] == '\n'))) {
+            c->request_scan = 0;
+            return lf + 1 - c->request;
+        }
+        p = lf + 1;
+    }
+
+    /* an LF arriving later looks back at the bytes before it itself */
+    c->request_scan = c->request_len;
+    return 0;
+}
+
+/******************************************************************************
+Description.: answer the buffered requests one after the other, as long as
+              each response goes out at once and the connection persists
+Input Value.: c: connection in C_REQUEST
+Return Value: -
+******************************************************************************/
+static void connection_dispatch(connection *c)
+{
+    c->dispatching = 1;
+    while(c->src.fd >= 0 && c->state == C_REQUEST) {
+        if((c->request_end = request_header_end(c)) == 0) {
+            if(c->request_len == sizeof(c->request) - 1) {
+                c->keep_alive = 0;
+                send_error(c, 400, "Request header too large");
+            }
             break;
         }
+
+        c->answered = 0;
+        handle_request(c);
+        if(c->src.fd >= 0 && c->answered)
+            connection_next_request(c);
     }
+    c->dispatching = 0;
+}
 
-    /* in case of unknown mimetype or extension leave */
-    if(mimetype == NULL) {
-        send_error(fd, 404, "MIME-TYPE not known");
+/******************************************************************************
+Description.: Handle the frames a WebSocket client sent. A text message with
+              a number grants that many frames, any other data message
+              grants one, so a client can either send an ack per frame or
+              top its credits up in batches and stop the stream by sending
+              nothing. Pings are answered between two frames.
+Input Value.: c: WebSocket connection, c->request holds the received bytes
+Return Value: -
+******************************************************************************/
+static void ws_receive(connection *c)
+{
+    unsigned char *p = (unsigned char *)c->request, *payload;
+    unsigned long long len;
+    size_t header, i;
+    int opcode, grant;
+    char number[12], *end;
+    long value;
+
+    while(c->src.fd >= 0 && c->request_len >= 2) {
+        opcode = p[0] & 0x0f;
+        len = p[1] & 0x7f;
+        header = 2;
+        if(len == 126) {
+            if(c->request_len < 4)
+                break;
+            len = p[2] << 8 | p[3];
+            header = 4;
+        } else if(len == 127) {
+            if(c->request_len < 10)
+                break;
+            for(len = 0, i = 2; i < 10; i++)
+                len = len << 8 | p[i];
+            header = 10;
+        }
+
+        /* client frames are masked and have to fit into the request buffer */
+        if(!(p[1] & 0x80) || len > sizeof(c->request) - 1 - header - 4) {
+            DBG("invalid WebSocket frame from %s\n", c->peer);
+            connection_close(c);
+            return;
+        }
+        header += 4;
+        if(c->request_len < header + len)
+            break;
+
+        payload = p + header;
+        for(i = 0; i < len; i++)
+            payload[i] ^= p[header - 4 + (i & 3)];
+
+        switch(opcode) {
+        case 0x0:                    /* continuation */
+        case 0x1:                    /* text */
+        case 0x2:                    /* binary */
+            grant = 1;
+            if(opcode == 0x1 && len > 0 && len < sizeof(number)) {
+                memcpy(number, payload, len);
+                number[len] = '\0';
+                /* clamped before adding, a huge number must not wrap */
+                value = strtol(number, &end, 10);
+                if(end != number)
+                    grant = (int)MIN(MAX(value, 0), WS_CREDITS_MAX);
+            }
+            __atomic_store_n(&c->credits, MIN(c->credits + grant, WS_CREDITS_MAX), __ATOMIC_RELAXED);
+            break;
+        case 0x8:                    /* close */
+            c->ws_closing = 1;
+            break;
+        case 0x9:                    /* ping */
+            if(len <= 125) {
+                c->ws_control[0] = 0x8A;
+                c->ws_control[1] = len;
+                memcpy(c->ws_control + 2, payload, len);
+                c->ws_control_len = 2 + len;
+            }
+            break;
+        }
+
+        c->request_len -= header + len;
+        memmove(c->request, c->request + header + len, c->request_len + 1);
+    }
+
+    if(c->state == C_STREAM_IDLE)
+        stream_next(c);
+}
+
+/******************************************************************************
+Description.: Read from a connection. Requests are collected and answered in
+              order, a persistent connection keeps reading pipelined ones
+              while a response is written, WebSocket clients send their
+              frames. Once the connection is going to close, the bytes are
+              discarded and only end of file matters.
+Input Value.: c: connection
+Return Value: -
+******************************************************************************/
+static void connection_read(connection *c)
+{
+    char discard[256];
+    ssize_t n;
+    int collect;
+
+    /* watched for hangups only, see connection_pause_read() */
+    if(c->read_paused) {
+        connection_close(c);
         return;
     }
 
-    /* now filename, mimetype and extension are known */
-    DBG("trying to serve file \"%s\", extension: \"%s\" mime: \"%s\"\n", parameter, extension, mimetype);
+    while(c->src.fd >= 0) {
+        collect = c->state == C_REQUEST || (c->keep_alive && !c->streaming) || c->websocket;
+        if(collect && c->request_len == sizeof(c->request) - 1) {
+            /* the buffer is full of pipelined requests, continue after the response */
+            connection_pause_read(c, 1);
+            return;
+        }
+
+        if(collect)
+            n = read(c->src.fd, c->request + c->request_len, sizeof(c->request) - 1 - c->request_len);
+        else
+            n = read(c->src.fd, discard, sizeof(discard));
+
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                connection_close(c);
+            return;
+        }
+        if(n == 0) {
+            DBG("client closed the connection\n");
+            connection_close(c);
+            return;
+        }
+        if(!collect)
+            continue;
+
+        c->request_len += n;
+        c->request[c->request_len] = '\0';
+        if(c->websocket)
+            ws_receive(c);
+        else if(c->state == C_REQUEST)
+            connection_dispatch(c);
+    }
+}
+
+/******************************************************************************
+Description.: accept pending connections of a listening socket
+Input Value.: l: event loop that owns the new connections
+              fd: listening socket
+Return Value: -
+******************************************************************************/
+static void loop_accept(event_loop *l, int fd)
+{
+    struct sockaddr_storage client_addr;
+    socklen_t addr_len;
+    connection *c;
+    int cfd;
 
-    /* build the absolute path to the file */
-    strncat(buffer, conf.www_folder, sizeof(buffer) - 1);
-    strncat(buffer, parameter, sizeof(buffer) - strlen(buffer) - 1);
+    while(!pglobal->stop) {
+        addr_len = sizeof(client_addr);
+        if((cfd = accept(fd, (struct sockaddr *)&client_addr, &addr_len)) < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                DBG("accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
 
-    /* try to open that file */
-    if((lfd = open(buffer, O_RDONLY)) < 0) {
-        DBG("file %s not accessible\n", buffer);
-        send_error(fd, 404, "Could not open file");
-        return;
-    }
-    DBG("opened file: %s\n", buffer);
+        if(fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL, 0) | O_NONBLOCK) < 0 ||
+           (c = calloc(1, sizeof(connection))) == NULL) {
+            close(cfd);
+            continue;
+        }
+        metric_add(l->pc->m_connections, 1);
 
-    /* prepare HTTP header */
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", mimetype);
-    i = strlen(buffer);
+        if(getnameinfo((struct sockaddr *)&client_addr, addr_len, c->peer, sizeof(c->peer), NULL, 0, NI_NUMERICHOST) == 0) {
+            DBG("serving client: %s\n", c->peer);
+        }
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    do {
-        if(write(fd, buffer, i) < 0) {
-            close(lfd);
-            return;
+        c->src.type = SRC_CLIENT;
+        c->src.fd = cfd;
+        c->loop = l;
+        c->state = C_REQUEST;
+        c->file_fd = -1;
+        c->zc_iov = -1;
+        c->deadline_us = time_monotonic_us() + REQUEST_TIMEOUT * 1000000LL;
+        if(loop_add(l, &c->src, LOOP_READ) < 0) {
+            close(cfd);
+            free(c);
+            continue;
         }
-    } while((i = read(lfd, buffer, sizeof(buffer))) > 0);
 
-    /* close file, job done */
-    close(lfd);
+        pthread_mutex_lock(&l->lock);
+        c->next = l->connections;
+        if(c->next != NULL)
+            c->next->prev = c;
+        l->connections = c;
+        l->connection_count++;
+        l->accepted++;
+        pthread_mutex_unlock(&l->lock);
+        metric_add(l->m_connections, 1);
+        metric_add(l->m_accepted, 1);
+    }
 }
 
 /******************************************************************************
-Description.: Serve a connected TCP-client. This thread function is called
-              for each connect of a HTTP client like a webbrowser. It determines
-              if it is a valid HTTP request and dispatches between the different
-              response options.
-Input Value.: arg is the filedescriptor and server-context of the connected TCP
-              socket. It must have been allocated so it is freeable by this
-              thread function.
-Return Value: always NULL
+Description.: hand a newly published frame to the waiting connections
+Input Value.: l: event loop
+              s: frame notification of the input
+Return Value: -
 ******************************************************************************/
-/* thread for clients that connected to this server */
-void *client_thread(void *arg)
+static void loop_frame(event_loop *l, loop_source *s)
 {
-    int cnt;
-    int query_suffixed = 0;
-    int input_number = 0;
-    char buffer[BUFFER_SIZE] = {0}, *pb = buffer;
-    iobuffer iobuf;
-    request req;
-    cfd lcfd; /* local-connected-file-descriptor */
+    connection *c, *next;
+    frame_buffer *fb;
 
-    /* we really need the fildescriptor and it must be freeable by us */
-    if(arg != NULL) {
-        memcpy(&lcfd, arg, sizeof(cfd));
-        free(arg);
-    } else
-        return NULL;
+    input_frame_drain(s->fd);
 
-    /* initializes the structures */
-    init_iobuffer(&iobuf);
-    init_request(&req);
+    for(c = l->connections; c != NULL; c = next) {
+        next = c->next;
+        if(c->input != s->input)
+            continue;
 
-    /* What does the client want to receive? Read the request. */
-    memset(buffer, 0, sizeof(buffer));
-    if((cnt = _readline(lcfd.fd, &iobuf, buffer, sizeof(buffer) - 1, 5)) == -1) {
-        close(lcfd.fd);
-        return NULL;
+        if(c->state == C_STREAM_IDLE) {
+            stream_next(c);
+        } else if(c->state == C_SNAPSHOT) {
+            if((fb = input_frame_get(stream_source(l->pc, s->input))) == NULL)
+                continue;
+            if(fb->sequence != c->after)
+                send_snapshot_frame(c, fb);
+            else
+                input_frame_put(fb);
+        }
     }
+}
 
-    req.query_string = NULL;
-
-    /* determine what to deliver - new short paths */
-    if(parse_short_path(buffer, "snapshot", &input_number)) {
-        req.type = A_SNAPSHOT;
-        query_suffixed = 255;
-        if (check_and_handle_client_status(&lcfd, &req, &query_suffixed)) {
-            close(lcfd.fd);
-            return NULL;
-        }
-    } else if(parse_short_path(buffer, "stream", &input_number)) {
-        req.type = A_STREAM;
-        query_suffixed = 255;
-        if (check_and_handle_client_status(&lcfd, &req, &query_suffixed)) {
-            close(lcfd.fd);
-            return NULL;
-        }
-    } else if(parse_short_path(buffer, "take", &input_number)) {
-        req.type = A_TAKE;
-        query_suffixed = 255;
-        // Parse parameters after ? or end of path
-        const char *pb = strstr(buffer, "GET /take");
-        if (pb == NULL) {
-            pb = strstr(buffer, "POST /take");
-        }
-        if (pb != NULL) {
-            if (strncmp(pb, "GET", 3) == 0) {
-                pb += strlen("GET /take");
-            } else {
-                pb += strlen("POST /take");
-            }
-            // Skip number if present
-            while (*pb >= '0' && *pb <= '9') pb++;
-            if (*pb == '?') {
-                pb++; // Skip ?
-                int len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./"), 0), 100);
-                req.parameter = malloc(len + 1);
-                if (req.parameter == NULL) {
-                    send_error(lcfd.fd, 500, "could not allocate memory");
-            close(lcfd.fd);
-            return NULL;
-        }
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
-                if (unescape(req.parameter) == -1) {
-            free(req.parameter);
-                    send_error(lcfd.fd, 500, "could not properly parse parameter string");
-            close(lcfd.fd);
-            return NULL;
+/******************************************************************************
+Description.: close connections that did not send their request in time or
+              fell behind their stream and answer snapshots that waited in
+              vain for a frame
+Input Value.: l: event loop
+Return Value: -
+******************************************************************************/
+static void loop_timeouts(event_loop *l)
+{
+    long long max_delay = l->pc->conf.max_delay_us;
+    connection *c, *next;
+    long long now = time_monotonic_us();
+    char etag[48];
+
+    for(c = l->connections; c != NULL; c = next) {
+        next = c->next;
+
+        /* --max-delay: a frame nobody could see in time is not worth finishing */
+        if(max_delay > 0 && c->state == C_STREAM_PART && c->frame != NULL &&
+           now - c->wakeup_us > max_delay) {
+            DBG("stream client %s is %lld ms behind, disconnecting\n", c->peer, (now - c->wakeup_us) / 1000);
+            metric_add(l->pc->m_late, 1);
+            connection_close(c);
+            continue;
         }
+
+        if(c->deadline_us == 0 || now < c->deadline_us)
+            continue;
+
+        if(c->state == C_SNAPSHOT && c->after != 0) {
+            /* nothing newer than the frame the long-poll named */
+            snapshot_etag(c, c->after, etag, sizeof(etag));
+            send_not_modified(c, etag);
+        } else if(c->state == C_SNAPSHOT) {
+            send_error(c, 500, "no frame available");
+        } else {
+            if(c->streaming) {
+                DBG("stream client %s stalled, disconnecting\n", c->peer);
+                metric_add(l->pc->m_stalled, 1);
             }
+            connection_close(c);
         }
-    } else {
-        DBG("try to serve a file\n");
-        req.type = A_FILE;
+    }
+}
 
-        if((pb = strstr(buffer, "GET /")) == NULL) {
-            DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
-            return NULL;
-        }
+/******************************************************************************
+Description.: prepare an event loop, the listening sockets must be open
+Input Value.: l: event loop
+              pc: server context
+              id: number of the loop
+Return Value: 0 on success, -1 on error
+******************************************************************************/
+static int loop_init(event_loop *l, context *pc, int id)
+{
+    loop_source *sd = l->sd_len > 0 ? l->sd : pc->sd;
+    int sd_len = l->sd_len > 0 ? l->sd_len : pc->sd_len;
+    char labels[64];
+    int i;
 
-        pb += strlen("GET /");
-        int len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890"), 0), 100);
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
-        }
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
+    l->pc = pc;
+    l->id = id;
+    pthread_mutex_init(&l->lock, NULL);
+
+    snprintf(labels, sizeof(labels), "port=\"%d\",loop=\"%d\"", ntohs(pc->conf.port), id);
+    l->m_connections = metric_gauge("mjpg_http_loop_connections", labels, "Connections served by the event loop");
+    l->m_accepted = metric_counter("mjpg_http_loop_accepted_total", labels, "Connections accepted by the event loop");
 
-        DBG("parameter (len: %d): \"%s\"\n", len, req.parameter);
+#ifdef __linux__
+    if((l->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+        return -1;
     }
+#endif
 
-    /*
-     * For short paths, input_number is already set by parse_short_path
-     * For compatibility with old format, check for _[plugin number suffix]
-     */
-    if(query_suffixed && input_number == 0) {
-        char *sch = strchr(buffer, '_');
-        if(sch != NULL) {  // there is an _ in the url so the input number should be present
-            DBG("Suffix character: %s\n", sch + 1); // FIXME if more than 10 input plugin is added
-            char numStr[3];
-            memset(numStr, 0, 3);
-            strncpy(numStr, sch + 1, 1);
-            input_number = atoi(numStr);
+    l->inputs = calloc(SOURCE_COUNT, sizeof(input_watch));
+    if(l->inputs == NULL)
+        return -1;
+    for(i = 0; i < SOURCE_COUNT; i++) {
+        l->inputs[i].src.type = SRC_FRAMES;
+        l->inputs[i].src.fd = -1;
+        l->inputs[i].src.input = i;
+    }
 
+    for(i = 0; i < sd_len; i++) {
+        if(loop_add(l, &sd[i], LOOP_READ) < 0) {
+            perror("add listening socket");
+            return -1;
         }
-        DBG("plugin_no: %d\n", input_number);
     }
+    return 0;
+}
 
-    /*
-     * parse the rest of the HTTP-request
-     * the end of the request-header is marked by a single, empty line with "\r\n"
-     */
-    do {
-        memset(buffer, 0, sizeof(buffer));
+/******************************************************************************
+Description.: release the connections and descriptors of an event loop
+Input Value.: l: event loop
+Return Value: -
+******************************************************************************/
+static void loop_cleanup(event_loop *l)
+{
+    connection *c;
+    int i;
 
-        if((cnt = _readline(lcfd.fd, &iobuf, buffer, sizeof(buffer) - 1, 5)) == -1) {
-            free_request(&req);
-            close(lcfd.fd);
-            return NULL;
-        }
+    while(l->connections != NULL)
+        connection_close(l->connections);
+    while((c = l->closed) != NULL) {
+        l->closed = c->next;
+        free(c->chunk);
+        free(c);
+    }
 
-        if(strcasestr(buffer, "User-Agent: ") != NULL) {
-            req.client = strdup(buffer + strlen("User-Agent: "));
-        } else if(strcasestr(buffer, "Authorization: Basic ") != NULL) {
-            req.credentials = strdup(buffer + strlen("Authorization: Basic "));
-            decodeBase64(req.credentials);
-            DBG("username:password: %s\n", req.credentials);
-        }
+    for(i = 0; l->inputs != NULL && i < SOURCE_COUNT; i++) {
+        if(l->inputs[i].src.fd >= 0)
+            input_frame_unsubscribe(stream_source(l->pc, i), l->inputs[i].src.fd);
+    }
+    free(l->inputs);
+    l->inputs = NULL;
+    pthread_mutex_destroy(&l->lock);
 
-    } while(cnt > 2 && !(buffer[0] == '\r' && buffer[1] == '\n'));
+    for(i = 0; i < l->sd_len; i++)
+        close(l->sd[i].fd);
+    l->sd_len = 0;
 
-    /* check for username and password if parameter -c was given */
-    if(lcfd.pc->conf.credentials != NULL) {
-        if(req.credentials == NULL || strcmp(lcfd.pc->conf.credentials, req.credentials) != 0) {
-            DBG("access denied\n");
-            send_error(lcfd.fd, 401, "username and password do not match to configuration");
-            close(lcfd.fd);
-            free_request(&req);
-            return NULL;
-        }
-        DBG("access granted\n");
-    }
+#ifdef __linux__
+    close(l->epfd);
+#else
+    free(l->pfds);
+    free(l->sources);
+#endif
+}
 
-    /* now it's time to answer */
-    if (query_suffixed) {
-            if(!(input_number < pglobal->incnt)) {
-                DBG("Input number: %d out of range (valid: 0..%d)\n", input_number, pglobal->incnt-1);
-                send_error(lcfd.fd, 404, "Invalid input plugin number");
-                req.type = A_UNKNOWN;
+/******************************************************************************
+Description.: Serve connections until the application stops. Each event loop
+              accepts from the shared listening sockets and owns the
+              connections it accepted, nothing blocks on a single client.
+Input Value.: arg: event loop
+Return Value: NULL
+******************************************************************************/
+static void *event_loop_thread(void *arg)
+{
+    event_loop *l = arg;
+    loop_source *ready[MAX_EPOLL_EVENTS];
+    int events[MAX_EPOLL_EVENTS];
+    long long next_tick = 0, now;
+    connection *c;
+    int i, n;
+
+    while(!pglobal->stop) {
+        n = loop_wait(l, ready, events, MAX_EPOLL_EVENTS, LOOP_TICK_MS);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
         }
-    }
 
-    switch(req.type) {
-    case A_SNAPSHOT:
-        DBG("Request for snapshot from input: %d\n", input_number);
-        send_snapshot(&lcfd, input_number);
-        break;
-    case A_STREAM:
-        DBG("Request for stream from input: %d\n", input_number);
-        send_stream(&lcfd, input_number);
-        break;
-    case A_FILE:
-        if(lcfd.pc->conf.www_folder == NULL)
-            send_error(lcfd.fd, 501, "no www-folder configured");
-        else
-            send_file(lcfd.pc->id, lcfd.fd, req.parameter);
-        break;
-    /*
-        With the take argument we try to save the current image to file before we transmit it to the user.
-        This is done trough the output_file plugin.
-        If it not loaded, or the file could not be saved then we won't transmit the frame.
-    */
-    case A_TAKE: {
-        int i, ret = 0, found = 0;
-        for (i = 0; i<pglobal->outcnt; i++) {
-            if (pglobal->out[i].name != NULL) {
-                if (strstr(pglobal->out[i].name, "FILE output plugin")) {
-                    found = 255;
-                    DBG("output_file found id: %d\n", i);
-                    char *filename = NULL;
-                    char *filenamearg = NULL;
-                    int len = 0;
-                    DBG("Buffer: %s \n", req.parameter);
-                    if((filename = strstr(req.parameter, "filename=")) != NULL) {
-                        filename += strlen("filename=");
-                        char *fn = strchr(filename, '&');
-                        if (fn == NULL)
-                            len = strlen(filename);
-                        else
-                            len = (int)(fn - filename);
-                        filenamearg = (char*)calloc(len, sizeof(char));
-                        memcpy(filenamearg, filename, len);
-                        DBG("Filename = %s\n", filenamearg);
-                        //int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int value, char *valueStr)
-                        ret = pglobal->out[i].cmd(i, OUT_FILE_CMD_TAKE, IN_CMD_GENERIC, 0, filenamearg);
-                    } else {
-                        DBG("filename is not specified int the URL\n");
-                        send_error(lcfd.fd, 404, "The &filename= must present for the take command in the URL");
-                    }
-                    break;
+        for(i = 0; i < n; i++) {
+            switch(ready[i]->type) {
+            case SRC_LISTEN:
+                loop_accept(l, ready[i]->fd);
+                break;
+            case SRC_FRAMES:
+                loop_frame(l, ready[i]);
+                break;
+            case SRC_CLIENT:
+                c = (connection *)ready[i];
+                if(c->src.fd >= 0 && c->zc_count > 0)
+                    connection_zerocopy_reap(c);
+                if(c->src.fd >= 0 && (events[i] & LOOP_READ))
+                    connection_read(c);
+                if(c->src.fd >= 0 && (events[i] & LOOP_WRITE) && c->want_write && c->state == C_STREAM_IDLE) {
+                    /* the kernel sent the last frame, see stream_next() */
+                    connection_want_write(c, 0);
+                    c->deadline_us = 0;
+                    stream_next(c);
+                } else if(c->src.fd >= 0 && (events[i] & LOOP_WRITE) && c->want_write) {
+                    connection_flush(c);
                 }
+                break;
             }
         }
 
-        if (found == 0) {
-            LOG("FILE CHANGE TEST output plugin not loaded\n");
-            send_error(lcfd.fd, 404, "FILE output plugin not loaded, taking snapshot not possible");
-        } else {
-            if (ret == 0) {
-                send_snapshot(&lcfd, input_number);
-            } else {
-                send_error(lcfd.fd, 404, "Taking snapshot failed!");
-            }
+        now = time_monotonic_us();
+        if(now >= next_tick) {
+            if(l->id == 0)
+                egress_update(l->pc, now);
+            loop_timeouts(l);
+            next_tick = now + LOOP_TICK_MS * 1000LL;
         }
-        } break;
-    default:
-        DBG("unknown request\n");
-    }
 
-    close(lcfd.fd);
-    
-    free_request(&req);
+        /* nothing refers to connections closed in this batch anymore */
+        while((c = l->closed) != NULL) {
+            l->closed = c->next;
+            free(c->chunk);
+            free(c);
+        }
+    }
 
-    DBG("leaving HTTP client thread\n");
+    DBG("leaving event loop\n");
+    loop_cleanup(l);
     return NULL;
 }
 
@@ -1154,228 +3476,253 @@ void server_cleanup(void *arg)
     OPRINT("cleaning up resources allocated by server thread #%02d\n", pcontext->id);
 
     for(i = 0; i < MAX_SD_LEN; i++)
-        close(pcontext->sd[i]);
+        if(pcontext->sd[i].fd >= 0)
+            close(pcontext->sd[i].fd);
 }
 
 /******************************************************************************
-Description.: Open a TCP socket and wait for clients to connect. If clients
-              connect, start a new thread for each accepted connection.
-Input Value.: arg is a pointer to the globals struct
-Return Value: always NULL, will only return on exit
+Description.: open the listening sockets, one per address family
+Input Value.: aip: addresses to listen on
+              sd: receives MAX_SD_LEN sockets at most
+              reuseport: allow other sockets to bind the same port, the
+                         kernel balances the connections between them
+Return Value: number of sockets listening
 ******************************************************************************/
-void *server_thread(void *arg)
+static int server_listen(struct addrinfo *aip, loop_source *sd, int reuseport)
 {
-    int on;
-    pthread_t client;
-    struct addrinfo *aip, *aip2;
-    struct addrinfo hints;
-    struct sockaddr_storage client_addr;
-    socklen_t addr_len = sizeof(struct sockaddr_storage);
-    fd_set selectfds;
-    int max_fds = 0;
-    char name[NI_MAXHOST];
-    int err;
-    int i;
-
-    context *pcontext = arg;
-    pglobal = pcontext->pglobal;
-
-    /* Initialize SIMD capabilities on first server start */
-    static int simd_initialized = 0;
-    if (!simd_initialized) {
-        detect_simd_capabilities();
-        simd_initialized = 1;
-    }
-
-    /* set cleanup handler to cleanup resources */
-    pthread_cleanup_push(server_cleanup, pcontext);
-
-    bzero(&hints, sizeof(hints));
-    hints.ai_family = PF_UNSPEC;
-    hints.ai_flags = AI_PASSIVE;
-    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *aip2;
+    int i, on;
 
-    snprintf(name, sizeof(name), "%d", ntohs(pcontext->conf.port));
-    if((err = getaddrinfo(pcontext->conf.hostname, name, &hints, &aip)) != 0) {
-        perror(gai_strerror(err));
-        exit(EXIT_FAILURE);
+    for(i = 0; i < MAX_SD_LEN; i++) {
+        sd[i].type = SRC_LISTEN;
+        sd[i].fd = -1;
     }
 
-    for(i = 0; i < MAX_SD_LEN; i++)
-        pcontext->sd[i] = -1;
-
     /* open sockets for server (1 socket / address family) */
     i = 0;
     for(aip2 = aip; aip2 != NULL; aip2 = aip2->ai_next) {
-        if((pcontext->sd[i] = socket(aip2->ai_family, aip2->ai_socktype, 0)) < 0) {
+        if((sd[i].fd = socket(aip2->ai_family, aip2->ai_socktype, 0)) < 0) {
             continue;
         }
 
         /* ignore "socket already in use" errors */
         on = 1;
-        if(setsockopt(pcontext->sd[i], SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+        if(setsockopt(sd[i].fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
             perror("setsockopt(SO_REUSEADDR) failed\n");
         }
 
+#ifdef SO_REUSEPORT
+        on = 1;
+        if(reuseport && setsockopt(sd[i].fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            perror("setsockopt(SO_REUSEPORT) failed\n");
+        }
+#endif
+
         /* IPv6 socket should listen to IPv6 only, otherwise we will get "socket already in use" */
         on = 1;
-        if(aip2->ai_family == AF_INET6 && setsockopt(pcontext->sd[i], IPPROTO_IPV6, IPV6_V6ONLY,
+        if(aip2->ai_family == AF_INET6 && setsockopt(sd[i].fd, IPPROTO_IPV6, IPV6_V6ONLY,
                 (const void *)&on , sizeof(on)) < 0) {
             perror("setsockopt(IPV6_V6ONLY) failed\n");
         }
 
-        /* perhaps we will use this keep-alive feature oneday */
-        /* setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)); */
+        /* several event loops may accept from this socket, none may block in accept() */
+        if(fcntl(sd[i].fd, F_SETFL, fcntl(sd[i].fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+            perror("fcntl(O_NONBLOCK) failed\n");
+        }
 
-        if(bind(pcontext->sd[i], aip2->ai_addr, aip2->ai_addrlen) < 0) {
+        if(bind(sd[i].fd, aip2->ai_addr, aip2->ai_addrlen) < 0) {
             perror("bind");
-            pcontext->sd[i] = -1;
+            close(sd[i].fd);
+            sd[i].fd = -1;
             continue;
         }
 
-        if(listen(pcontext->sd[i], 10) < 0) {
+        if(listen(sd[i].fd, 10) < 0) {
             perror("listen");
-            pcontext->sd[i] = -1;
+            close(sd[i].fd);
+            sd[i].fd = -1;
         } else {
-            /* Add server socket to epoll for async I/O */
-            if (add_server_socket(&pcontext->async_io, pcontext->sd[i]) < 0) {
-                perror("add_server_socket");
-                close(pcontext->sd[i]);
-                pcontext->sd[i] = -1;
-            } else {
-                i++;
-                if(i >= MAX_SD_LEN) {
-                    OPRINT("%s(): maximum number of server sockets exceeded", __FUNCTION__);
-                    i--;
-                    break;
-                }
+            i++;
+            if(i >= MAX_SD_LEN) {
+                OPRINT("%s(): maximum number of server sockets exceeded", __FUNCTION__);
+                i--;
+                break;
             }
         }
     }
+    return i;
+}
+
+/******************************************************************************
+Description.: Open the TCP sockets and run the event loops that serve the
+              clients, one of them in this thread.
+Input Value.: arg is a pointer to the globals struct
+Return Value: always NULL, will only return on exit
+******************************************************************************/
+void *server_thread(void *arg)
+{
+    struct addrinfo *aip;
+    struct addrinfo hints;
+    char name[NI_MAXHOST];
+    int err;
+    int i;
+
+    context *pcontext = arg;
+    pglobal = pcontext->pglobal;
 
-    pcontext->sd_len = i;
+    snprintf(name, sizeof(name), "port=\"%d\"", ntohs(pcontext->conf.port));
+    pcontext->m_clients = metric_gauge("mjpg_http_stream_clients", name, "Clients currently receiving a stream");
+    pcontext->m_frames = metric_counter("mjpg_http_frames_sent_total", name, "Stream frames sent to clients");
+    pcontext->m_bytes = metric_counter("mjpg_http_bytes_sent_total", name, "Stream bytes sent to clients");
+    pcontext->m_send = metric_histogram("mjpg_http_frame_send_seconds", name,
+                                        "Time to write one stream frame to a client");
+    pcontext->m_dropped = metric_counter("mjpg_http_stream_dropped_frames_total", name,
+                                         "Frames skipped because a stream client was still sending the previous one");
+    pcontext->m_stalled = metric_counter("mjpg_http_stream_stalled_total", name,
+                                         "Stream clients disconnected because their socket took no data in time");
+    pcontext->m_late = metric_counter("mjpg_http_stream_late_total", name,
+                                      "Stream clients disconnected because a frame took longer than --max-delay");
+    pcontext->m_delay = metric_histogram("mjpg_http_stream_delay_seconds", name,
+                                         "Time from capture until a stream frame was written to the socket");
+    pcontext->m_connections = metric_counter("mjpg_http_connections_total", name, "Connections accepted");
+    pcontext->m_requests = metric_counter("mjpg_http_requests_total", name,
+                                          "Requests received, more than connections when they persist");
+    pcontext->m_zerocopy = metric_counter("mjpg_http_zerocopy_bytes_total", name,
+                                          "Stream bytes sent with MSG_ZEROCOPY");
+    pcontext->m_zerocopy_copied = metric_counter("mjpg_http_zerocopy_copied_total", name,
+                                                 "MSG_ZEROCOPY sends the kernel had to copy anyway, e.g. on loopback");
+    pcontext->m_egress = metric_gauge("mjpg_http_egress_bytes_per_second", name, "Bytes sent to all clients per second");
+    for(i = 0; i < REJECT_REASONS; i++) {
+        static const char *reasons[REJECT_REASONS] = { "streams", "input_streams", "snapshots", "per_ip", "egress" };
+        char labels[NI_MAXHOST + 32];
+
+        snprintf(labels, sizeof(labels), "%s,reason=\"%s\"", name, reasons[i]);
+        pcontext->m_rejected[i] = metric_counter("mjpg_http_rejected_total", labels,
+                                                 "Requests answered 503 by admission control");
+    }
 
-    if(pcontext->sd_len < 1) {
-        OPRINT("%s(): bind(%d) failed\n", __FUNCTION__, htons(pcontext->conf.port));
-        closelog();
+    pthread_mutex_init(&pcontext->admission_lock, NULL);
+    pcontext->input_streams = calloc(pglobal->incnt + MOSAIC_COUNT, sizeof(int));
+    if(pcontext->input_streams == NULL) {
+        OPRINT("%s(): could not allocate the admission counters\n", __FUNCTION__);
         exit(EXIT_FAILURE);
     }
 
-    /* create a child for every client that connects */
-    while(!pglobal->stop) {
-        //int *pfd = (int *)malloc(sizeof(int));
-        cfd *pcfd = malloc(sizeof(cfd));
-
-        if(pcfd == NULL) {
-            fprintf(stderr, "failed to allocate (a very small amount of) memory\n");
+    for(i = MOSAIC_GRID_MIN; i <= MOSAIC_GRID_MAX; i++) {
+        if(mosaic_init(pcontext, i) < 0) {
+            OPRINT("%s(): could not allocate the %dx%d mosaic\n", __FUNCTION__, i, i);
             exit(EXIT_FAILURE);
         }
+    }
 
-        DBG("waiting for clients to connect\n");
-        
-        /* Check for stop signal before waiting */
-        if(pglobal->stop) {
-            free(pcfd);
-            break;
-        }
-
-#ifdef __linux__
-        /* Use epoll for better performance with timeout for signal handling */
-        int nfds = epoll_wait(pcontext->async_io.epfd, pcontext->async_io.events, 
-                             pcontext->async_io.max_events, EPOLL_TIMEOUT_MS);
-        
-        if(nfds < 0) {
-            if(errno == EINTR) continue;
-            perror("epoll_wait");
+    /* the variant slots get their source with their first client */
+    pthread_mutex_init(&pcontext->variants_lock, NULL);
+    for(i = 0; i < VARIANT_MAX; i++) {
+        variant *v = &pcontext->variants[i];
+        char labels[64];
+
+        v->source = -1;
+        v->slots_lock = &pcontext->variants_lock;
+        pthread_mutex_init(&v->lock, NULL);
+        pthread_cond_init(&v->wake, NULL);
+        pthread_mutex_init(&v->in.db, NULL);
+        pthread_cond_init(&v->in.db_update, NULL);
+        snprintf(labels, sizeof(labels), "port=\"%d\",variant=\"%d\"", ntohs(pcontext->conf.port), i);
+        if(input_frames_init_labels(&v->in, labels, 2) < 0) {
+            OPRINT("%s(): could not allocate the variant slots\n", __FUNCTION__);
             exit(EXIT_FAILURE);
         }
-        
-        /* Check for stop signal if no events */
-        if(nfds == 0) {
-            if(pglobal->stop) {
-                DBG("stop signal received, exiting server thread\n");
-                break;
-            }
-            continue;
-        }
-        
-        /* Process all ready events */
-        for(int n = 0; n < nfds; n++) {
-            int ready_fd = pcontext->async_io.events[n].data.fd;
-            
-            /* Check if this is a server socket */
-            for(i = 0; i < MAX_SD_LEN; i++) {
-                if(pcontext->sd[i] == ready_fd) {
-                    pcfd->fd = accept(ready_fd, (struct sockaddr *)&client_addr, &addr_len);
-                    pcfd->pc = pcontext;
-#else
-        /* Fallback to select for non-Linux systems */
-        do {
-            FD_ZERO(&selectfds);
+    }
 
-            for(i = 0; i < MAX_SD_LEN; i++) {
-                if(pcontext->sd[i] != -1) {
-                    FD_SET(pcontext->sd[i], &selectfds);
+    /* Initialize SIMD capabilities on first server start */
+    static int simd_initialized = 0;
+    if (!simd_initialized) {
+        detect_simd_capabilities();
+        simd_initialized = 1;
+    }
 
-                    if(pcontext->sd[i] > max_fds)
-                        max_fds = pcontext->sd[i];
-                }
-            }
+    /* set cleanup handler to cleanup resources */
+    pthread_cleanup_push(server_cleanup, pcontext);
 
-            err = select(max_fds + 1, &selectfds, NULL, NULL, NULL);
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_socktype = SOCK_STREAM;
 
-            if(err < 0 && errno != EINTR) {
-                perror("select");
-                exit(EXIT_FAILURE);
-            }
-        } while(err <= 0);
+    snprintf(name, sizeof(name), "%d", ntohs(pcontext->conf.port));
+    if((err = getaddrinfo(pcontext->conf.hostname, name, &hints, &aip)) != 0) {
+        perror(gai_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    pcontext->loop_count = pcontext->conf.threads;
+    pcontext->loops = calloc(pcontext->loop_count, sizeof(event_loop));
+    if(pcontext->loops == NULL) {
+        OPRINT("%s(): could not allocate the event loops\n", __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < MAX_SD_LEN; i++) {
+        pcontext->sd[i].type = SRC_LISTEN;
+        pcontext->sd[i].fd = -1;
+    }
+
+#if !defined(__linux__) || !defined(SO_ZEROCOPY)
+    if(pcontext->conf.zerocopy) {
+        OPRINT("MSG_ZEROCOPY is not supported, stream frames are copied\n");
+        pcontext->conf.zerocopy = 0;
+    }
+#endif
 
-        for(i = 0; i < max_fds + 1; i++) {
-            if(pcontext->sd[i] != -1 && FD_ISSET(pcontext->sd[i], &selectfds)) {
-                pcfd->fd = accept(pcontext->sd[i], (struct sockaddr *)&client_addr, &addr_len);
-                pcfd->pc = pcontext;
+#ifndef SO_REUSEPORT
+    if(pcontext->conf.reuseport) {
+        OPRINT("SO_REUSEPORT is not supported, the event loops share the listening sockets\n");
+        pcontext->conf.reuseport = 0;
+    }
 #endif
 
-                    /* start new thread that will handle this TCP connected client */
-                    DBG("create thread to handle client that just established a connection\n");
-
-                    if(getnameinfo((struct sockaddr *)&client_addr, addr_len, name, sizeof(name), NULL, 0, NI_NUMERICHOST) == 0) {
-                        DBG("serving client: %s\n", name);
-                    }
-
-                    if(pthread_create(&client, NULL, &client_thread, pcfd) != 0) {
-                        DBG("could not launch another client thread\n");
-                        close(pcfd->fd);
-                        free(pcfd);
-                        continue;
-                    }
-                    pthread_detach(client);
-                    pcfd = NULL; /* Prevent double-free, pcfd now owned by client_thread */
-#ifdef __linux__
-                    break; /* Found and processed the server socket */
-                }
+    /* with --reuseport the kernel spreads the connections over the event loops */
+    if(pcontext->conf.reuseport) {
+        for(i = 0; i < pcontext->loop_count; i++) {
+            pcontext->loops[i].sd_len = server_listen(aip, pcontext->loops[i].sd, 1);
+            if(pcontext->loops[i].sd_len < 1) {
+                OPRINT("%s(): bind(%d) failed for event loop %d\n", __FUNCTION__, htons(pcontext->conf.port), i);
+                closelog();
+                exit(EXIT_FAILURE);
             }
         }
-#else
-                }
-            }
-#endif
-        
-        /* Free pcfd if no connection was accepted */
-        if (pcfd != NULL) {
-            free(pcfd);
+    } else {
+        pcontext->sd_len = server_listen(aip, pcontext->sd, 0);
+        if(pcontext->sd_len < 1) {
+            OPRINT("%s(): bind(%d) failed\n", __FUNCTION__, htons(pcontext->conf.port));
+            closelog();
+            exit(EXIT_FAILURE);
         }
-        
-        /* Check for stop signal after processing events */
-        if(pglobal->stop) {
-            DBG("stop signal received, exiting server thread\n");
-            break;
+    }
+    freeaddrinfo(aip);
+
+    /* the table is read without locks by all event loops, so build it first */
+    www_cache_load(pcontext);
+
+    /* start the event loops, this thread runs the first one */
+    for(i = 0; i < pcontext->loop_count; i++) {
+        if(loop_init(&pcontext->loops[i], pcontext, i) < 0) {
+            OPRINT("%s(): could not set up event loop %d\n", __FUNCTION__, i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for(i = 1; i < pcontext->loop_count; i++) {
+        if(pthread_create(&pcontext->loops[i].thread, NULL, event_loop_thread, &pcontext->loops[i]) != 0) {
+            OPRINT("%s(): could not start event loop %d\n", __FUNCTION__, i);
+            exit(EXIT_FAILURE);
         }
+        pthread_detach(pcontext->loops[i].thread);
     }
 
+    event_loop_thread(&pcontext->loops[0]);
+
     DBG("leaving server thread, calling cleanup function now\n");
     pthread_cleanup_pop(1);
 
     return NULL;
 }
-
@@ -23,28 +23,106 @@
 #ifdef __linux__
 #include <sys/epoll.h>
 #endif
+#include <poll.h>
 #include <stddef.h>
+#include <sys/uio.h>
 
-#define IO_BUFFER 256
 #define BUFFER_SIZE 1024
 
 /* epoll constants for async I/O */
 #define MAX_EPOLL_EVENTS 64
 #define EPOLL_TIMEOUT_MS 1000
 
-/* the boundary is used for the M-JPEG stream, it separates the multipart stream of pictures */
-#define BOUNDARY "boundarydonotcross"
+/* granularity of the connection timeouts */
+#define LOOP_TICK_MS 100
+
+/* a request header must fit into this buffer and arrive within REQUEST_TIMEOUT seconds */
+#define REQUEST_SIZE 4096
+#define REQUEST_TIMEOUT 5
+
+/*
+ * persistent connections are closed after KEEPALIVE_TIMEOUT idle seconds or
+ * KEEPALIVE_MAX requests, both can be changed with --keepalive/--max-requests
+ */
+#define KEEPALIVE_TIMEOUT 5
+#define KEEPALIVE_MAX 100
+
+/* clients turned away by admission control are asked to come back after this many seconds */
+#define RETRY_AFTER 2
+
+/* a client whose socket takes no data for this many seconds is disconnected */
+#define STALL_TIMEOUT 10
+
+/*
+ * TCP_NOTSENT_LOWAT of stream sockets unless --notsent-lowat says otherwise,
+ * the next frame is only queued once less than this is waiting in the kernel
+ */
+#define NOTSENT_LOWAT (32 * 1024)
+
+/*
+ * frames a /ws/stream client gets before it grants more, unless it asks for
+ * another number with ?credits=, and the most it may have outstanding
+ */
+#define WS_CREDITS 2
+#define WS_CREDITS_MAX 1000
+
+/* metadata in front of the JPEG of a WebSocket message, see ws_frame_header() */
+#define WS_PREFIX_SIZE 12
+
+/* quality of ?scale= variants that do not ask for one with &q= */
+#define VARIANT_QUALITY 75
+
+/*
+ * ?scale=&q= variants are transcoded by a thread per (source, scale, quality)
+ * key, at most VARIANT_MAX keys at a time per server. A key nobody asked for
+ * during VARIANT_LINGER seconds gives its slot back.
+ */
+#define VARIANT_MAX 8
+#define VARIANT_LINGER 10
+
+/*
+ * /mosaic?grid=N puts the first N x N inputs into one picture of about
+ * MOSAIC_WIDTH x MOSAIC_HEIGHT, composed MOSAIC_FPS times per second while
+ * someone watches
+ */
+#define MOSAIC_GRID_MIN 2
+#define MOSAIC_GRID_MAX 4
+#define MOSAIC_COUNT (MOSAIC_GRID_MAX - MOSAIC_GRID_MIN + 1)
+#define MOSAIC_WIDTH 1920
+#define MOSAIC_HEIGHT 1080
+#define MOSAIC_FPS 10
+#define MOSAIC_QUALITY 75
+
+/* how long a snapshot waits for the first frame of an input */
+#define SNAPSHOT_WAIT_MS 1000
+
+/* how long /snapshot?after= waits for a newer frame before answering 304 */
+#define LONG_POLL_TIMEOUT 30
+
+/* files not served from the www cache are sent in chunks of this size */
+#define FILE_CHUNK_SIZE 65536
 
 /*
- * this defines the buffer size for a JPG-frame
- * selecting to large values will allocate much wasted RAM for each buffer
- * selecting to small values will lead to crashes due to to small buffers
+ * with --zerocopy, stream frames of at least ZEROCOPY_MIN bytes are sent with
+ * MSG_ZEROCOPY, a connection pins up to ZEROCOPY_PINS frames until the kernel
+ * reports them sent, further frames are copied
  */
-#define MAX_FRAME_SIZE (256*1024)
-#define TEN_K (10*1024)
+#define ZEROCOPY_MIN (64 * 1024)
+#define ZEROCOPY_PINS 8
+
+/* www files up to WWW_CACHE_FILE_MAX bytes are preloaded, WWW_CACHE_SIZE in total */
+#define WWW_CACHE_FILE_MAX (1024 * 1024)
+#define WWW_CACHE_SIZE (16 * 1024 * 1024)
+
+/* characters of file names send_file() serves */
+#define FILE_NAME_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890"
+
+/* the boundary is used for the M-JPEG stream, it separates the multipart stream of pictures */
+#define BOUNDARY "boundarydonotcross"
 
 /*
- * Standard header to be send along with other header information like mimetype.
+ * Standard header to be send along with other header information like mimetype
+ * and the Connection header, see response_connection().
  *
  * The parameters should ensure the browser does not cache our answer.
  * A browser should connect for each file and not serve files from his cache.
@@ -52,16 +130,7 @@
  * Many browser seem to ignore, or at least not always obey those headers
  * since i observed caching of files from time to time.
  */
-#define STD_HEADER "Connection: close\r\n" \
-    "Server: MJPG-Streamer/0.2\r\n" \
-    "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
-    "Pragma: no-cache\r\n" \
-    "Expires: Mon, 3 Jan 2000 12:34:56 GMT\r\n"
-
-/* Keep-Alive header for persistent connections */
-#define KEEP_ALIVE_HEADER "Connection: keep-alive\r\n" \
-    "Keep-Alive: timeout=5, max=100\r\n" \
-    "Server: MJPG-Streamer/0.2\r\n" \
+#define STD_HEADER "Server: MJPG-Streamer/0.2\r\n" \
     "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
     "Pragma: no-cache\r\n" \
     "Expires: Mon, 3 Jan 2000 12:34:56 GMT\r\n"
@@ -71,16 +140,6 @@
  */
 #define MAX_SD_LEN 50
 
-/* epoll async I/O context */
-typedef struct {
-    int epfd;
-    struct epoll_event *events;
-    int max_events;
-    int client_count;
-    int server_sockets[MAX_SD_LEN];
-    int server_socket_count;
-} async_io_context;
-
 /* Cached HTTP header */
 typedef struct {
     char *data;
@@ -138,26 +197,61 @@ typedef enum {
     A_SNAPSHOT,
     A_STREAM,
     A_FILE,
-    A_TAKE
+    A_TAKE,
+    A_METRICS,
+    A_LATENCY,
+    A_CLIENTS,
+    A_WEBSOCKET,
+    A_MOSAIC
 } answer_t;
 
 /*
  * the client sends information with each request
- * this structure is used to store the important parts
+ * this structure is used to store the important parts, request_parse()
+ * NUL terminates them in place, so they point into the request buffer of
+ * the connection and are valid until the next request moves up
  */
 typedef struct {
     answer_t type;
-    char *parameter;
+    char *method;
+    char *target;                    /* "/stream?fps=5", starts with '/' */
+    char *version;
+    char *parameter;                 /* file name or query of /take */
     char *client;
     char *credentials;
-    char *query_string;
+    char *if_none_match;
+    char *if_modified_since;
+    char *accept_encoding;
+    char *ws_key;
+    char *connection;
+    char *content_length;
+    char *transfer_encoding;
 } request;
 
-/* the iobuffer structure is used to read from the HTTP-client */
+/*
+ * Path of the request target answered by the server itself, requests
+ * not matching one of these are file requests
+ */
 typedef struct {
-    int level;              /* how full is the buffer */
-    char buffer[IO_BUFFER]; /* the data */
-} iobuffer;
+    const char *path;                /* without the leading '/' */
+    size_t len;
+    answer_t type;
+    int per_input;                   /* takes /path<N> or /path_<N>, N is range checked */
+} route;
+
+/*
+ * File of the www folder preloaded by www_cache_load(). The table is built
+ * before the event loops start and only read afterwards.
+ */
+typedef struct _www_file www_file;
+struct _www_file {
+    char *name;                      /* relative to the www folder */
+    const char *mimetype;            /* of the uncompressed file */
+    unsigned char *data;             /* read-only mapping of the content */
+    size_t size;
+    time_t mtime;
+    www_file *gz;                    /* precompressed name.gz sibling or NULL */
+};
 
 /* store configuration for each server instance */
 typedef struct {
@@ -165,8 +259,38 @@ typedef struct {
     char *hostname;
     char *credentials;
     char *www_folder;
+    int threads;            /* number of event loops */
+    int keepalive_timeout;  /* idle seconds between requests, 0 = close after each */
+    int keepalive_max;      /* requests per connection */
+    int reuseport;          /* every event loop listens on its own SO_REUSEPORT sockets */
+    int zerocopy;           /* send large stream frames with MSG_ZEROCOPY */
+    int notsent_lowat;      /* TCP_NOTSENT_LOWAT of stream sockets, 0 = off */
+    long long max_delay_us; /* stream clients still writing an older frame are dropped, 0 = never */
+
+    /* admission control, 0 = no limit */
+    int max_streams;        /* stream clients of the server */
+    int max_input_streams;  /* stream clients of each input */
+    int max_snapshots;      /* snapshots being answered at the same time */
+    int max_per_ip;         /* streams and snapshots of one client address */
+    long long max_egress;   /* bytes per second to all clients */
 } config;
 
+/* streams and snapshots a client address holds, see admission_acquire() */
+typedef struct {
+    char peer[INET6_ADDRSTRLEN];
+    int slots;
+} peer_slots;
+
+/* reasons admission_acquire() turns a request away */
+typedef enum {
+    REJECT_STREAMS,
+    REJECT_INPUT_STREAMS,
+    REJECT_SNAPSHOTS,
+    REJECT_PER_IP,
+    REJECT_EGRESS,
+    REJECT_REASONS
+} reject_reason;
+
 /* Write buffer for I/O optimization */
 typedef struct {
     char buffer[BUFFER_SIZE * 4];  /* 4KB write buffer */
@@ -175,9 +299,95 @@ typedef struct {
     int use_buffering;
 } write_buffer;
 
+/*
+ * Descriptors registered with an event loop. The loop gets the address of
+ * the loop_source back with each event, connections embed it as first member.
+ */
+typedef enum {
+    SRC_LISTEN,             /* listening socket, shared by all event loops */
+    SRC_FRAMES,             /* frame notification of an input */
+    SRC_CLIENT              /* connection */
+} source_type;
+
+typedef struct {
+    source_type type;
+    int fd;
+    int input;              /* SRC_FRAMES only */
+} loop_source;
+
+/* the multipart header of a stream part is at most this long */
+#define PART_HEADER_SIZE 128
+
+/*
+ * Frame notification of an input. The multipart header of the newest frame is
+ * formatted here once per frame and copied by each stream of the event loop.
+ */
+typedef struct {
+    loop_source src;                 /* keep first */
+    unsigned int sequence;           /* frame of part, 0 = none yet */
+    size_t part_len;
+    char part[PART_HEADER_SIZE];
+} input_watch;
+
+/* interest and readiness flags of loop sources */
+#define LOOP_READ  1
+#define LOOP_WRITE 2
+
+typedef struct _event_loop event_loop;
+
+/*
+ * Grid of the inputs as a frame source of its own. Its thread decodes only
+ * the tiles whose input published a new frame, in the DCT domain at about
+ * the tile size and straight to YUV, and encodes the canvas once per tick
+ * for all viewers. Streams address it as input incnt + grid - MOSAIC_GRID_MIN.
+ */
+typedef struct _mosaic {
+    input in;                        /* frames of the mosaic */
+    int grid;
+    int width, height;               /* canvas */
+    int tile_width, tile_height;
+    unsigned char *planes[3];        /* YUV 4:2:0 canvas */
+    int strides[3];
+    unsigned int tile_sequence[MOSAIC_GRID_MAX * MOSAIC_GRID_MAX];  /* frame in each tile, 0 = none */
+    int tile_size[MOSAIC_GRID_MAX * MOSAIC_GRID_MAX][2];            /* decoded picture in each tile */
+    unsigned char *scratch;          /* decoded tile */
+    size_t scratch_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;             /* signalled when the first viewer arrives */
+    int started;
+    int viewers;                     /* updated atomically */
+    struct _metric *m_decodes;
+    struct _metric *m_encodes;
+} mosaic;
+
+/*
+ * Downscaled or re-quality JPEGs of a frame source as a frame source of its
+ * own. Its thread transcodes each new frame of the source while the variant
+ * is streamed and a single one for waiting snapshots, so the event loops only
+ * send finished frames. Streams address it as input
+ * incnt + MOSAIC_COUNT + its index in context.variants.
+ */
+typedef struct _variant {
+    input in;                        /* transcoded frames */
+    input *src;                      /* frames to transcode */
+    int source;                      /* stream source of src, -1 = slot unused */
+    int scale, quality;
+    pthread_mutex_t *slots_lock;     /* context.variants_lock, guards the key */
+    long long used_us;               /* last asked for, under slots_lock */
+    unsigned int src_sequence;       /* source frame of the newest variant, 0 = none, atomic */
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;             /* signalled when it is asked for */
+    int started;
+    int viewers;                     /* streams, updated atomically */
+    unsigned int requests;           /* snapshot requests, under lock */
+    long long wanted_us;             /* a snapshot waits until then, under lock */
+} variant;
+
 /* context of each server thread */
 typedef struct {
-    int sd[MAX_SD_LEN];
+    loop_source sd[MAX_SD_LEN];
     int sd_len;
     int id;
     globals *pglobal;
@@ -185,36 +395,180 @@ typedef struct {
 
     config conf;
     
-    /* Performance optimization: static buffers */
-    unsigned char static_frame_buffer[MAX_FRAME_SIZE];
-    unsigned char static_header_buffer[BUFFER_SIZE];
-    int use_static_buffers;
     size_t current_buffer_size;
     
     /* I/O optimization: write buffering */
     write_buffer write_buf;
     
-    /* Stage 3 optimizations: async I/O and header caching */
-    async_io_context async_io;
+    /* event loops, the server thread runs the first one */
+    event_loop *loops;
+    int loop_count;
+
+    /* preloaded www folder sorted by name, see www_cache_find() */
+    www_file *www;
+    int www_count;
+
     header_cache headers;
+
+    /* registered by server_thread(), see metric_counter() */
+    struct _metric *m_clients;
+    struct _metric *m_frames;
+    struct _metric *m_bytes;
+    struct _metric *m_send;
+    struct _metric *m_dropped;
+    struct _metric *m_stalled;
+    struct _metric *m_late;
+    struct _metric *m_delay;
+    struct _metric *m_connections;
+    struct _metric *m_requests;
+
+    /* admission control, the counts are guarded by admission_lock */
+    pthread_mutex_t admission_lock;
+    int stream_count;
+    int snapshot_count;
+    int *input_streams;     /* per input */
+    peer_slots *peers;
+    int peer_count, peer_capacity;
+    struct _metric *m_rejected[REJECT_REASONS];
+
+    /* egress of all event loops, measured once per second by the first loop */
+    unsigned long long bytes_out;    /* updated atomically */
+    unsigned long long egress_bytes;
+    long long egress_us;
+    long long egress_rate;           /* bytes per second, read atomically */
+    struct _metric *m_egress;
+
+    struct _metric *m_zerocopy;
+    struct _metric *m_zerocopy_copied;
+
+    mosaic mosaics[MOSAIC_COUNT];    /* by grid - MOSAIC_GRID_MIN */
+    variant variants[VARIANT_MAX];   /* assigned on first use, see variant_get() */
+    pthread_mutex_t variants_lock;
 } context;
 
 
 
+/* state of a connection */
+typedef enum {
+    C_REQUEST,              /* collecting the request header */
+    C_RESPONSE,             /* writing a response, then closed or back to C_REQUEST */
+    C_SNAPSHOT,             /* snapshot waiting for the first frame of its input */
+    C_STREAM_IDLE,          /* stream waiting for a frame newer than the last one sent */
+    C_STREAM_PART           /* writing the stream header or a multipart part */
+} connection_state;
+
+#define MAX_IOV 4
+
 /*
- * this struct is just defined to allow passing all necessary details to a worker thread
- * "cfd" is for connected/accepted filedescriptor
+ * Non-blocking client connection. Pending output is a list of iovecs that
+ * point into header, part, out, frame or chunk and is written as the socket drains.
  */
-typedef struct {
+typedef struct _connection connection;
+struct _connection {
+    loop_source src;                 /* keep first */
+    connection_state state;
+    event_loop *loop;
+    connection *prev, *next;
+    long long deadline_us;           /* time_monotonic_us() limit of the state, 0 = none */
+    int want_write;                  /* LOOP_WRITE interest is registered */
+
+    char request[REQUEST_SIZE];      /* the request being answered and pipelined ones */
+    size_t request_len;
+    size_t request_end;              /* header bytes of the request being answered, 0 = none */
+    size_t request_scan;             /* bytes searched for the header end without finding it */
+    int dispatching;                 /* inside connection_dispatch() */
+    int answered;                    /* the response went out before handle_request() returned */
+    int read_paused;                 /* request buffer full, LOOP_READ interest removed */
+    int http_minor;                  /* HTTP/1.x of the request */
+    int keep_alive;                  /* wait for the next request after the response */
+    unsigned int requests;           /* answered on this connection */
+    char connection_header[64];      /* see response_connection() */
+
+    struct iovec iov[MAX_IOV];
+    int iov_first, iov_count;
+    char header[BUFFER_SIZE];        /* response or stream header */
+    char part[PART_HEADER_SIZE];     /* multipart header of frame */
+    char *out;                       /* malloc'ed response body */
+    frame_buffer *frame;             /* referenced frame being sent */
+    int file_fd;                     /* file content still to send, -1 = none */
+    int zc_iov;                      /* iov of the frame to send with MSG_ZEROCOPY, -1 = none */
+    char *chunk;                     /* read buffer for file_fd without sendfile() */
+
+    int input;
+    unsigned int sequence;           /* last frame sent, 0 = none */
+    int streaming;                   /* counted in the clients gauge */
+    answer_t slot;                   /* A_STREAM or A_SNAPSHOT while admitted, A_UNKNOWN = none */
+    int slot_input;                  /* input counted by the admitted stream */
+    size_t part_bytes;
+    int scale, quality;              /* ?scale=&q= variant, quality 0 = original */
+    unsigned int after;              /* ?after= of a snapshot, 0 = any frame */
+    char if_none_match[64];          /* entity tags the client has, "" = none */
+    char if_modified_since[40];
+    int accept_gzip;
+    int websocket;                   /* /ws/stream, c->request collects client frames */
+    int credits;                     /* frames the WebSocket client still accepts */
+    int ws_closing;                  /* close frame received, answer it when idle */
+    unsigned char ws_control[2 + 125]; /* pong to send when idle */
+    size_t ws_control_len;
+    long long frame_interval_us;     /* ?fps= limit, 0 = every frame */
+    long long next_frame_us;         /* see frame_rate_take() */
+
+    /* stream statistics, written by the owning loop and read by /clients */
+    char peer[INET6_ADDRSTRLEN];
+    long long started_us;
+    unsigned long frames_sent;
+    unsigned long long bytes_sent;   /* of the frames sent, with their part headers */
+    unsigned long frames_dropped;    /* skipped because the client was still busy */
+    size_t unsent;                   /* bytes of the current part not yet written */
+    int notsent;                     /* bytes the kernel had not sent at the last frame */
+    long long delay_us;              /* capture to written of the last frame */
+    long long delay_max_us;
+    /* frames the kernel may still read, see connection_send_zerocopy() */
+    int zerocopy;                    /* SO_ZEROCOPY is enabled on the socket */
+    struct {
+        frame_buffer *fb;
+        unsigned int last;           /* id of the last send that referenced fb */
+    } zc_pins[ZEROCOPY_PINS];
+    int zc_head, zc_count;
+    unsigned int zc_next;            /* id the kernel gives the next MSG_ZEROCOPY send */
+
+    long long wakeup_us;             /* frame picked up, see latency_record() */
+    struct _latency *latency;
+    mosaic *mosaic;                  /* viewer of this mosaic, NULL = none */
+    variant *variant;                /* viewer of this variant, NULL = none */
+};
+
+/* one event loop thread, it owns the connections it accepted */
+struct _event_loop {
     context *pc;
-    int fd;
-} cfd;
+    int id;
+    pthread_t thread;
+#ifdef __linux__
+    int epfd;
+#else
+    struct pollfd *pfds;
+    loop_source **sources;
+    int count, capacity;
+#endif
+    input_watch *inputs;             /* per input, fd -1 until the first client */
+    loop_source sd[MAX_SD_LEN];      /* own listening sockets with --reuseport */
+    int sd_len;                      /* 0 = accept from the sockets of the context */
+    pthread_mutex_t lock;            /* guards connections against send_clients() */
+    connection *connections;
+    int connection_count;
+    unsigned long accepted;
+    connection *closed;              /* freed after the current batch of events */
+
+    /* registered by loop_init(), labelled with the loop */
+    struct _metric *m_connections;
+    struct _metric *m_accepted;
+};
 
 
 
 /* prototypes */
 void *server_thread(void *arg);
-void send_error(int fd, int which, char *message);
+void send_error(connection *c, int which, const char *message);
 
 
 
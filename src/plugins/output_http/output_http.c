@@ -51,16 +51,13 @@ void *worker_thread(void *arg);
 /* Global variables */
 static int input_number = 0;
 
-/* Forward declarations for Stage 3 functions */
-int init_async_io(async_io_context *ctx, int max_events);
-void cleanup_async_io(async_io_context *ctx);
-
 #define OUTPUT_PLUGIN_NAME "HTTP output plugin"
 
 /*
- * keep context for each server
+ * keep context for each server, indexed by output id and sized on the first
+ * output_init() from the number of output plugins
  */
-context servers[MAX_OUTPUT_PLUGINS];
+context *servers = NULL;
 
 /******************************************************************************
 Description.: print help for this plugin to stdout
@@ -79,6 +76,30 @@ void help(void)
 	        " [-l ] --listen ]........: Listen on Hostname / IP\n" \
             " [-c | --credentials ]...: ask for \"username:password\" on connect\n" \
             " [-i | --input ]........: input plugin number (default: 0)\n"
+            " [-n | --threads ]......: event loop threads serving the clients\n"
+            "                           (default: one per CPU)\n"
+            " [-k | --keepalive ]....: idle seconds a persistent connection waits\n"
+            "                           for the next request, 0 closes after each\n"
+            "                           response (default: 5)\n"
+            " [-m | --max-requests ].: requests per connection (default: 100)\n"
+            " [-r | --reuseport ]....: every event loop listens on its own\n"
+            "                           SO_REUSEPORT socket, the kernel spreads\n"
+            "                           the connections over the loops\n"
+            " [-z | --zerocopy ].....: send large stream frames with MSG_ZEROCOPY\n"
+            "                           instead of copying them (Linux 4.14+)\n"
+            " [--notsent-lowat ].....: kB a stream client may have unsent in the\n"
+            "                           kernel before the next frame is queued,\n"
+            "                           0 = fill the socket buffer (default: 32)\n"
+            " [--max-delay ].........: ms a stream frame may take to be written,\n"
+            "                           slower clients are disconnected\n"
+            "                           (default: 0 = no limit)\n"
+            " Admission control, clients over a limit get 503 (default: no limit)\n"
+            " [--max-streams ].......: stream clients of this server\n"
+            " [--max-input-streams ].: stream clients of each input\n"
+            " [--max-snapshots ].....: snapshots answered at the same time\n"
+            " [--max-per-ip ]........: streams and snapshots of one client address\n"
+            " [--max-egress ]........: kB/s to all clients, new streams are refused\n"
+            "                           when they would exceed it\n"
             " ---------------------------------------------------------------\n");
 }
 
@@ -96,6 +117,9 @@ int output_init(output_parameter *param, int id)
 {
     int i;
     int  port;
+    int threads, keepalive_timeout, keepalive_max, reuseport = 0, zerocopy = 0;
+    int notsent_lowat = NOTSENT_LOWAT / 1024, max_delay = 0;
+    int max_streams = 0, max_input_streams = 0, max_snapshots = 0, max_per_ip = 0, max_egress = 0;
     char *credentials, *www_folder, *hostname = NULL;
 
     DBG("output #%02d\n", param->id);
@@ -103,6 +127,11 @@ int output_init(output_parameter *param, int id)
     port = htons(8080);
     credentials = NULL;
     www_folder = NULL;
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads < 1)
+        threads = 1;
+    keepalive_timeout = KEEPALIVE_TIMEOUT;
+    keepalive_max = KEEPALIVE_MAX;
 
     param->argv[0] = OUTPUT_PLUGIN_NAME;
     
@@ -129,6 +158,23 @@ int output_init(output_parameter *param, int id)
             {"www", required_argument, 0, 0},
             {"i", required_argument, 0, 0},
             {"input", required_argument, 0, 0},
+            {"n", required_argument, 0, 0},
+            {"threads", required_argument, 0, 0},
+            {"k", required_argument, 0, 0},
+            {"keepalive", required_argument, 0, 0},
+            {"m", required_argument, 0, 0},
+            {"max-requests", required_argument, 0, 0},
+            {"r", no_argument, 0, 0},
+            {"reuseport", no_argument, 0, 0},
+            {"max-streams", required_argument, 0, 0},
+            {"max-input-streams", required_argument, 0, 0},
+            {"max-snapshots", required_argument, 0, 0},
+            {"max-per-ip", required_argument, 0, 0},
+            {"max-egress", required_argument, 0, 0},
+            {"z", no_argument, 0, 0},
+            {"zerocopy", no_argument, 0, 0},
+            {"notsent-lowat", required_argument, 0, 0},
+            {"max-delay", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -189,6 +235,98 @@ int output_init(output_parameter *param, int id)
             DBG("case 12,13\n");
             input_number = atoi(optarg);
             break;
+
+            /* n, threads */
+        case 12:
+        case 13:
+            DBG("case 12,13\n");
+            threads = atoi(optarg);
+            if(threads < 1) {
+                OPRINT("ERROR: at least one thread is needed\n");
+                return 1;
+            }
+            break;
+
+            /* k, keepalive */
+        case 14:
+        case 15:
+            DBG("case 14,15\n");
+            keepalive_timeout = atoi(optarg);
+            if(keepalive_timeout < 0) {
+                OPRINT("ERROR: the keepalive timeout must not be negative\n");
+                return 1;
+            }
+            break;
+
+            /* m, max-requests */
+        case 16:
+        case 17:
+            DBG("case 16,17\n");
+            keepalive_max = atoi(optarg);
+            if(keepalive_max < 1) {
+                OPRINT("ERROR: at least one request per connection is needed\n");
+                return 1;
+            }
+            break;
+
+            /* r, reuseport */
+        case 18:
+        case 19:
+            DBG("case 18,19\n");
+            reuseport = 1;
+            break;
+
+            /* admission control */
+        case 20:
+            DBG("case 20\n");
+            max_streams = MAX(atoi(optarg), 0);
+            break;
+
+        case 21:
+            DBG("case 21\n");
+            max_input_streams = MAX(atoi(optarg), 0);
+            break;
+
+        case 22:
+            DBG("case 22\n");
+            max_snapshots = MAX(atoi(optarg), 0);
+            break;
+
+        case 23:
+            DBG("case 23\n");
+            max_per_ip = MAX(atoi(optarg), 0);
+            break;
+
+        case 24:
+            DBG("case 24\n");
+            max_egress = MAX(atoi(optarg), 0);
+            break;
+
+            /* z, zerocopy */
+        case 25:
+        case 26:
+            DBG("case 25,26\n");
+            zerocopy = 1;
+            break;
+
+            /* latency bound of stream clients */
+        case 27:
+            DBG("case 27\n");
+            notsent_lowat = MAX(atoi(optarg), 0);
+            break;
+
+        case 28:
+            DBG("case 28\n");
+            max_delay = MAX(atoi(optarg), 0);
+            break;
+        }
+    }
+
+    if(servers == NULL) {
+        servers = calloc(param->global->outcnt, sizeof(context));
+        if(servers == NULL) {
+            OPRINT("ERROR: could not allocate server contexts\n");
+            return 1;
         }
     }
 
@@ -198,34 +336,43 @@ int output_init(output_parameter *param, int id)
     servers[param->id].conf.hostname = hostname;
     servers[param->id].conf.credentials = credentials;
     servers[param->id].conf.www_folder = www_folder;
+    servers[param->id].conf.threads = threads;
+    servers[param->id].conf.keepalive_timeout = keepalive_timeout;
+    servers[param->id].conf.keepalive_max = keepalive_max;
+    servers[param->id].conf.reuseport = reuseport;
+    servers[param->id].conf.max_streams = max_streams;
+    servers[param->id].conf.max_input_streams = max_input_streams;
+    servers[param->id].conf.max_snapshots = max_snapshots;
+    servers[param->id].conf.max_per_ip = max_per_ip;
+    servers[param->id].conf.max_egress = max_egress * 1000LL;
+    servers[param->id].conf.zerocopy = zerocopy;
+    servers[param->id].conf.notsent_lowat = notsent_lowat * 1024;
+    servers[param->id].conf.max_delay_us = max_delay * 1000LL;
     
-    /* Initialize static buffers for performance optimization */
-    servers[param->id].use_static_buffers = 1;
     servers[param->id].current_buffer_size = 0;
-    memset(servers[param->id].static_frame_buffer, 0, MAX_FRAME_SIZE);
-    memset(servers[param->id].static_header_buffer, 0, BUFFER_SIZE);
     
     /* Initialize write buffer for I/O optimization */
     servers[param->id].write_buf.buffer_pos = 0;
     servers[param->id].write_buf.fd = -1;  /* Will be set when client connects */
     
     /* Validate input plugin number */
-    if(!(input_number < param->global->incnt)) {
+    if(input_number < 0 || input_number >= param->global->incnt) {
         OPRINT("ERROR: the %d input_plugin number is too much only %d plugins loaded\n", input_number, param->global->incnt);
         return 1;
     }
     OPRINT("input plugin.....: %d: %s\n", input_number, param->global->in[input_number].plugin);
     servers[param->id].write_buf.use_buffering = 1;
-    
-    /* Initialize Stage 3 optimizations: async I/O and header caching */
-    if (init_async_io(&servers[param->id].async_io, MAX_EPOLL_EVENTS) != 0) {
-        OPRINT("Failed to initialize async I/O\n");
-        return -1;
-    }
+
     OPRINT("www-folder-path......: %s\n", (www_folder == NULL) ? "disabled" : www_folder);
     OPRINT("HTTP TCP port........: %d\n", ntohs(port));
     OPRINT("HTTP Listen Address..: %s\n", hostname);
     OPRINT("username:password....: %s\n", (credentials == NULL) ? "disabled" : credentials);
+    OPRINT("event loop threads...: %d%s\n", threads, reuseport ? ", one SO_REUSEPORT listener each" : "");
+    OPRINT("keep-alive...........: %d s, %d requests\n", keepalive_timeout, keepalive_max);
+    OPRINT("client limits........: streams %d, per input %d, snapshots %d, per IP %d, %d kB/s (0 = none)\n",
+           max_streams, max_input_streams, max_snapshots, max_per_ip, max_egress);
+    OPRINT("MSG_ZEROCOPY.........: %s\n", zerocopy ? "enabled" : "disabled");
+    OPRINT("stream latency.......: %d kB unsent, %d ms per frame (0 = no limit)\n", notsent_lowat, max_delay);
 
     param->global->out[id].name = malloc((strlen(OUTPUT_PLUGIN_NAME) + 1) * sizeof(char));
     sprintf(param->global->out[id].name, OUTPUT_PLUGIN_NAME);
@@ -235,10 +382,8 @@ int output_init(output_parameter *param, int id)
 }
 
 /******************************************************************************
-Description.: this will stop the server thread, client threads
-              will not get cleaned properly, because they run detached and
-              no pointer is kept. This is not a huge issue, because this
-              funtion is intended to clean up the biggest mess on shutdown.
+Description.: this will stop the server thread, the other event loops
+              notice the stop flag and close their connections themselves.
 Input Value.: id determines which server instance to send commands to
 Return Value: always 0
 ******************************************************************************/
@@ -247,10 +392,7 @@ int output_stop(int id)
 
     DBG("will cancel server thread #%02d\n", id);
     pthread_cancel(servers[id].threadID);
-    
-    /* Clean up Stage 3 optimizations */
-    cleanup_async_io(&servers[id].async_io);
-    
+
 
     return 0;
 }
@@ -83,7 +83,6 @@ static int input_number = 0;
 static int frame_counter = 0;
 static int motion_sequence_count = 0;  // Counter for consecutive motion frames
 static unsigned char *prev_frame = NULL;
-static unsigned char *current_frame = NULL;
 static unsigned char *blur_buffer = NULL;  // Buffer for blur filter
 static unsigned char *autolevels_buffer = NULL;  // Buffer for auto levels
 static int scaled_width = 0, scaled_height = 0;
@@ -258,11 +257,6 @@ void worker_cleanup(void *arg)
         prev_frame = NULL;
     }
     
-    if(current_frame != NULL) {
-        free(current_frame);
-        current_frame = NULL;
-    }
-    
     if(blur_buffer != NULL) {
         free(blur_buffer);
         blur_buffer = NULL;
@@ -336,7 +330,7 @@ Description.: Apply optimized 3x3 blur filter using separable convolution
 Input Value.: input frame, output frame, width, height
 Return Value: 0 on success, -1 on error
 ******************************************************************************/
-int apply_fast_blur_3x3(unsigned char *input, unsigned char *output, int width, int height)
+int apply_fast_blur_3x3(const unsigned char *input, unsigned char *output, int width, int height)
 {
     if(input == NULL || output == NULL || width <= 0 || height <= 0) {
         return -1;
@@ -399,7 +393,7 @@ Description.: Apply auto levels to improve contrast and normalize brightness
 Input Value.: input frame, output frame, width, height
 Return Value: 1 if auto levels were applied, 0 if skipped (range too small)
 ******************************************************************************/
-int apply_auto_levels(unsigned char *input, unsigned char *output, int width, int height)
+int apply_auto_levels(const unsigned char *input, unsigned char *output, int width, int height)
 {
     if(input == NULL || output == NULL || width <= 0 || height <= 0) {
         return 0;
@@ -441,7 +435,7 @@ Description.: Calculate motion level using pixel-by-pixel comparison
 Input Value.: current frame, previous frame, dimensions
 Return Value: motion level in percentage (0.0 - 100.0)
 ******************************************************************************/
-double calculate_motion_level(unsigned char *current_frame, unsigned char *prev_frame, int width, int height)
+double calculate_motion_level(const unsigned char *current_frame, const unsigned char *prev_frame, int width, int height)
 {
     // Input validation - critical for stability
     if(width <= 0 || height <= 0 || current_frame == NULL || prev_frame == NULL) {
@@ -588,7 +582,7 @@ int save_debug_frame(unsigned char *gray_data, int width, int height, double mot
     return 0;
 }
 
-int create_debug_frame_with_zones(unsigned char *gray_data, int width, int height, double motion_level, int frame_num, const char *suffix)
+int create_debug_frame_with_zones(const unsigned char *gray_data, int width, int height, double motion_level, int frame_num, const char *suffix)
 {
     if(save_folder == NULL || gray_data == NULL) {
         return 0; // No save folder specified or invalid data
@@ -855,6 +849,15 @@ void *worker_thread(void *arg)
     int frame_size = 0;
     unsigned char *scaled_frame = NULL;
     double motion_level = 0.0;
+    long long start;
+    char labels[32];
+    struct _metric *processing;
+    struct _latency *latency;
+
+    snprintf(labels, sizeof(labels), "input=\"%d\"", input_number);
+    processing = metric_histogram("mjpg_motion_processing_seconds", labels,
+                                  "Time to decode and compare one frame for motion");
+    latency = latency_register("motion", input_number);
 
     /* Initialize SIMD capabilities */
     static int simd_initialized = 0;
@@ -871,113 +874,68 @@ void *worker_thread(void *arg)
 
         static unsigned int last_motion_sequence = UINT_MAX;
         
-        /* Wait for fresh frame using condition variable (efficient) */
-        if (!wait_for_fresh_frame(&pglobal->in[input_number], &last_motion_sequence)) {
+        /* reference the next frame; decoding and saving work on the shared
+         * buffer without holding the input mutex */
+        frame_buffer *fb = input_frame_wait(&pglobal->in[input_number], &last_motion_sequence, 1000);
+        if (fb == NULL) {
             continue;
         }
         
-        /* read buffer */
-        frame_size = pglobal->in[input_number].current_size;
-        
-        /* Fallback to size if current_size is 0 */
-        if(frame_size == 0) {
-            frame_size = pglobal->in[input_number].size;
-        }
+        frame_size = fb->size;
         
         /* check if frame size is within reasonable limits */
-        if(frame_size == 0) {
-            pthread_mutex_unlock(&pglobal->in[input_number].db);
+        if(frame_size == 0 || frame_size > 10 * 1024 * 1024) { // 10MB limit
+            input_frame_put(fb);
             continue;
         }
-        
-        if(frame_size > 10 * 1024 * 1024) { // 10MB limit
-            pthread_mutex_unlock(&pglobal->in[input_number].db);
+
+        /* frames without a complete marker index cannot be decoded */
+        if(!fb->jpeg.valid) {
+            input_frame_put(fb);
             continue;
         }
         
-        /* allocate buffer for frame copy */
-        if(current_frame == NULL || pglobal->in[input_number].prev_size != frame_size) {
-            if(current_frame != NULL) free(current_frame);
-            current_frame = malloc(frame_size);
-            if(current_frame == NULL) {
-                LOG("not enough memory for frame buffer\n");
-                break;
-            }
-        }
-        
-        /* RELAY SYSTEM: Work directly with global buffer, no copying needed */
-        /* Use global buffer directly for processing */
-        unsigned char *frame_data = pglobal->in[input_number].buf;
-        
-        /* Copy only if we need to save motion frames (for file output) */
-        if(save_folder != NULL) {
-            if(current_frame == NULL || pglobal->in[input_number].prev_size != frame_size) {
-                if(current_frame != NULL) free(current_frame);
-                current_frame = malloc(frame_size);
-                if(current_frame == NULL) {
-                    LOG("not enough memory for frame buffer\n");
-                    break;
-                }
-            }
-            simd_memcpy(current_frame, frame_data, frame_size);
-        }
-        
-        /* Use frame_data directly if save_folder is not specified */
-        unsigned char *frame_to_process = (save_folder != NULL) ? current_frame : frame_data;
-
         frame_counter++;
 
         /* Check if we should process this frame */
         if(check_interval > 1 && frame_counter % check_interval != 0) {
-            /* Don't wait for signal if we're skipping - let others get it */
-            pthread_mutex_unlock(&pglobal->in[input_number].db);
-            if (current_frame && save_folder == NULL) {
-                free(current_frame);
-                current_frame = NULL;
-            }
+            input_frame_put(fb);
             continue;
         }
 
         /* Check if JPEG size changed significantly - use global metadata */
         if(!is_jpeg_size_changed(pglobal->in[input_number].current_size, pglobal->in[input_number].prev_size, size_threshold)) {
-            pthread_mutex_unlock(&pglobal->in[input_number].db);
-            if (current_frame && save_folder == NULL) {
-                free(current_frame);
-                current_frame = NULL;
-            }
+            input_frame_put(fb);
             continue;
         }
 
         /* Initialize scaled frame buffer if needed */
         if(scaled_frame == NULL) {
-            // Use global metadata instead of parsing JPEG header
-            int width = pglobal->in[input_number].width;
-            int height = pglobal->in[input_number].height;
+            // Use the frame's marker index instead of parsing the JPEG header
+            int width = fb->jpeg.width;
+            int height = fb->jpeg.height;
             
             scaled_width = width / scale_factor;
             scaled_height = height / scale_factor;
             scaled_frame = malloc(scaled_width * scaled_height);
             if(scaled_frame == NULL) {
                 LOG("not enough memory for scaled frame\n");
+                input_frame_put(fb);
                 break;
             }
         }
 
-        /* Use global frame dimensions - no need to parse JPEG header again */
-        int width = pglobal->in[input_number].width / scale_factor;
-        int height = pglobal->in[input_number].height / scale_factor;
-        
+        /* Dimensions come from the marker index built at publication */
+        int width = fb->jpeg.width / scale_factor;
+        int height = fb->jpeg.height / scale_factor;
         
-        /* Convert current frame to grayscale with integrated scaling */
-        // Universal decoder - handles JPEG, MJPEG, raw RGB, raw YUV
-        unsigned char *gray_data = NULL;
         
-        if(decode_any_to_y_component(frame_to_process, frame_size, scale_factor, &gray_data, &width, &height, pglobal->in[input_number].width, pglobal->in[input_number].height, pglobal->in[input_number].format) < 0) {
-            pthread_mutex_unlock(&pglobal->in[input_number].db);
-            if (current_frame && save_folder == NULL) {
-                free(current_frame);
-                current_frame = NULL;
-            }
+        /* Scaled Y plane from the frame's decode cache, other analysing
+         * outputs asking for the same scale share this single decode */
+        start = time_monotonic_us();
+        const unsigned char *gray_data = input_frame_plane(fb, scale_factor, TJPF_GRAY, &width, &height);
+        if(gray_data == NULL) {
+            input_frame_put(fb);
             continue;
         }
         
@@ -985,9 +943,8 @@ void *worker_thread(void *arg)
         scaled_width = width;
         scaled_height = height;
         
-        // Use gray_data directly instead of copying - avoid unnecessary memcpy
-        // This eliminates one memory copy operation per frame
-        unsigned char *current_scaled_frame = gray_data;
+        // Use gray_data directly instead of copying - it is shared and read-only
+        const unsigned char *current_scaled_frame = gray_data;
         
         /* Apply blur filter if enabled */
         if(enable_blur) {
@@ -996,7 +953,7 @@ void *worker_thread(void *arg)
                 blur_buffer = malloc(scaled_width * scaled_height);
                 if(blur_buffer == NULL) {
                     LOG("not enough memory for blur buffer\n");
-                    free(gray_data);
+                    input_frame_put(fb);
                     break;
                 }
             }
@@ -1014,7 +971,7 @@ void *worker_thread(void *arg)
                 autolevels_buffer = malloc(scaled_width * scaled_height);
                 if(autolevels_buffer == NULL) {
                     LOG("not enough memory for auto levels buffer\n");
-                    free(gray_data);
+                    input_frame_put(fb);
                     break;
                 }
             }
@@ -1030,18 +987,19 @@ void *worker_thread(void *arg)
             prev_frame = malloc(scaled_width * scaled_height);
             if(prev_frame == NULL) {
                 LOG("not enough memory for previous frame\n");
-                free(gray_data);
+                input_frame_put(fb);
                 break;
             }
             simd_memcpy(prev_frame, current_scaled_frame, scaled_width * scaled_height);
             
-            free(gray_data);
-            pthread_mutex_unlock(&pglobal->in[input_number].db);
+            input_frame_put(fb);
             continue;
         }
 
         /* Calculate motion level using pixel-by-pixel comparison */
         motion_level = calculate_motion_level(current_scaled_frame, prev_frame, scaled_width, scaled_height);
+        metric_observe_us(processing, time_monotonic_us() - start);
+        latency_record(latency, fb, start, time_monotonic_us());
         
         DBG("motion level: %.2f%%, threshold: %d%%, overload: %d%%, sequence: %d/%d\n", 
             motion_level, brightness_threshold, overload_threshold, motion_sequence_count, sequence_frames);
@@ -1077,9 +1035,7 @@ void *worker_thread(void *arg)
                     
                     /* Save motion frame and debug frames if folder specified */
                     if(save_folder != NULL) {
-                        /* Use current_frame if available, otherwise use global buffer */
-                        unsigned char *motion_frame_data = (current_frame != NULL) ? current_frame : frame_data;
-                        save_motion_frame(motion_frame_data, frame_size, motion_level);
+                        save_motion_frame(fb->data, frame_size, motion_level);
                         create_debug_frame_with_zones(current_scaled_frame, scaled_width, scaled_height, motion_level, frame_counter, "current");
                         create_debug_frame_with_zones(prev_frame, scaled_width, scaled_height, motion_level, frame_counter, "previous");
                     }
@@ -1104,11 +1060,8 @@ void *worker_thread(void *arg)
             simd_memcpy(prev_frame, current_scaled_frame, scaled_width * scaled_height);
         }
         
-        /* Free the gray_data after processing */
-        free(gray_data);
-        
-        /* allow others to access the global buffer again */
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        /* release the frame */
+        input_frame_put(fb);
         
     }
 
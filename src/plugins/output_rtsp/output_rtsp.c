@@ -24,7 +24,7 @@
 #define RTP_SSRC 0x12345678
 #define MAX_RTP_PACKET_SIZE 1500  // Standard Ethernet MTU
 #define MAX_TCP_PACKET_SIZE 8192  // Larger packet size for TCP to reduce fragmentation
-#define MAX_FRAME_SIZE (10 * 1024 * 1024)  // 10MB max frame size
+#define NOTSENT_LOWAT (32 * 1024) // unsent bytes a TCP client may have before it misses frames
 
 /* RTSP response templates */
 #define RTSP_SERVER_NAME "MJPG-Streamer RTSP Server"
@@ -41,6 +41,10 @@ typedef struct {
     uint16_t sequence_number;
     uint32_t timestamp;
     int playing;
+    long long frame_interval_us;  /* ?fps= limit, 0 = every frame */
+    long long next_frame_us;      /* see frame_rate_take() */
+    long long delay_us;           /* capture to sent of the last frame */
+    unsigned long frames_skipped; /* TCP frames skipped while the kernel still had the previous one */
 } rtsp_client_t;
 
 static rtsp_client_t clients[MAX_CLIENTS];
@@ -56,15 +60,15 @@ static uint32_t rtp_ts_increment = 3000;
 static int cached_sdp_width = 640;
 static int cached_sdp_height = 480;
 static int sdp_dimensions_cached = 0;
-static unsigned char static_frame_buffer[MAX_FRAME_SIZE];
-static int use_static_buffers = 1;
-static unsigned char *snapshot_buffer = NULL;
-static size_t snapshot_size = 0;
-static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int notsent_lowat = NOTSENT_LOWAT;  /* bytes, 0 = queue every frame */
+static long long max_delay_us = 0;         /* frames older than this are not sent, 0 = no limit */
+static struct _metric *m_delay[MAX_CLIENTS];
+static struct _metric *m_skipped;
+static struct _metric *m_late;
 
 
 typedef struct {
-    unsigned char *rtp_payload;
+    const unsigned char *rtp_payload;   /* points into the referenced frame */
     size_t rtp_payload_size;
     int width;
     int height;
@@ -79,8 +83,7 @@ typedef struct {
 } rtp_jpeg_frame_t;
 
 static void free_rtp_jpeg_frame(rtp_jpeg_frame_t *frame);
-static int prepare_rtp_jpeg_frame(const unsigned char *jpeg_data, size_t jpeg_size,
-                                  rtp_jpeg_frame_t *frame_info);
+static int prepare_rtp_jpeg_frame(const frame_buffer *fb, rtp_jpeg_frame_t *frame_info);
 static int send_rtsp_response(int client_socket, int cseq, int status_code, const char *status_text, 
                               const char *headers, const char *body);
 static int find_client_by_socket(int client_socket);
@@ -93,8 +96,9 @@ static void build_http_headers(char *headers, size_t headers_size, int status_co
 static int send_http_error(int client_socket, int status_code, const char *status_text, 
                           const char *content_type, const char *error_body);
 static void handle_rtsp_options(int client_socket, int cseq);
-static void handle_rtsp_describe(int client_socket, int cseq, struct sockaddr_in client_addr, int input_number);
-static void handle_rtsp_setup(int client_socket, int cseq, struct sockaddr_in client_addr, char *request);
+static int parse_fps(const char *uri);
+static void handle_rtsp_describe(int client_socket, int cseq, struct sockaddr_in client_addr, int input_number, int max_fps);
+static void handle_rtsp_setup(int client_socket, int cseq, struct sockaddr_in client_addr, char *request, int max_fps);
 static void handle_rtsp_play(int client_socket, int cseq, int session_id, int input_number);
 static void handle_rtsp_pause(int client_socket, int cseq, int session_id);
 static void handle_rtsp_teardown(int client_socket, int cseq, int session_id);
@@ -104,134 +108,34 @@ static void free_rtp_jpeg_frame(rtp_jpeg_frame_t *frame)
     if (!frame) {
         return;
     }
-    if (frame->rtp_payload) {
-        free(frame->rtp_payload);
-        frame->rtp_payload = NULL;
-        frame->rtp_payload_size = 0;
-    }
+    frame->rtp_payload = NULL;
+    frame->rtp_payload_size = 0;
 }
 
-static int prepare_rtp_jpeg_frame(const unsigned char *jpeg_data, size_t jpeg_size,
-                                  rtp_jpeg_frame_t *frame_info)
+static int prepare_rtp_jpeg_frame(const frame_buffer *fb, rtp_jpeg_frame_t *frame_info)
 {
-    if (!jpeg_data || jpeg_size == 0 || !frame_info) {
-        return -1;
-    }
-
-    memset(frame_info, 0, sizeof(*frame_info));
-    
+    const jpeg_index *idx;
 
-    int input_width = 0;
-    int input_height = 0;
-    int input_subsamp = -1;
-    if (turbojpeg_header_info(jpeg_data, (int)jpeg_size, &input_width, &input_height, &input_subsamp) != 0) {
-        OPRINT("[RTP ERROR] turbojpeg_header_info failed during preparation\n");
+    if (!fb || fb->size <= 0 || !frame_info) {
         return -1;
     }
 
-    size_t eoi_pos = jpeg_size;
-    size_t soi_pos = 0;
-    if (jpeg_size < 2 || jpeg_data[0] != 0xFF || jpeg_data[1] != 0xD8) {
-        OPRINT("[RTP ERROR] JPEG does not start with SOI (0xFF 0xD8)\n");
-        return -1;
-    }
-    soi_pos = 0;
-    
-    for (size_t i = soi_pos + 2; i < jpeg_size; ) {
-        if (jpeg_data[i-1] == 0xFF) {
-            if (jpeg_data[i] == 0xD9) {
-                eoi_pos = i + 1;
-                break;
-            } else if (jpeg_data[i] == 0x00) {
-                i += 2;
-                continue;
-            } else {
-                i++;
-            }
-        } else {
-            i++;
-        }
-    }
-    
-    if (eoi_pos < jpeg_size) {
-        if (eoi_pos + 1 < jpeg_size && jpeg_data[eoi_pos] == 0xFF) {
-            unsigned char next_byte = jpeg_data[eoi_pos + 1];
-            if (next_byte == 0xD9 || next_byte == 0xD8) {
-            }
-        }
-    }
-    
-    if (eoi_pos < 2 || eoi_pos > jpeg_size) {
-        OPRINT("[RTP ERROR] Invalid EOI position: eoi_pos=%zu, jpeg_size=%zu\n", eoi_pos, jpeg_size);
-        return -1;
-    }
-    if (jpeg_data[eoi_pos - 2] != 0xFF || jpeg_data[eoi_pos - 1] != 0xD9) {
-        OPRINT("[RTP ERROR] EOI marker not found at expected position: eoi_pos=%zu\n", eoi_pos);
-        return -1;
-    }
-    
-    size_t check_pos = eoi_pos;
-    while (check_pos < jpeg_size && (jpeg_data[check_pos] == 0x00 || jpeg_data[check_pos] == 0xFF)) {
-        check_pos++;
-    }
-    if (check_pos < jpeg_size) {
-    }
-    
-    size_t sos_pos = 0, scan_start = 0;
-    for (size_t i = soi_pos + 2; i + 3 < jpeg_size; ) {
-        if (jpeg_data[i] == 0xFF && jpeg_data[i + 1] == 0xDA) {
-            sos_pos = i;
-            break;
-        }
-        if (jpeg_data[i] == 0xFF && jpeg_data[i + 1] == 0x00) {
-            i += 2;
-            continue;
-        }
-        i++;
-    }
-    if (sos_pos == 0) {
-        OPRINT("[RTP ERROR] SOS not found in JPEG\n");
-        return -1;
-    }
-    if (sos_pos + 3 >= jpeg_size) {
-        OPRINT("[RTP ERROR] SOS header truncated\n");
-        return -1;
-    }
-    uint16_t sos_len = ((uint16_t)jpeg_data[sos_pos + 2] << 8) | (uint16_t)jpeg_data[sos_pos + 3];
-    if (sos_pos + 2 + sos_len > jpeg_size) {
-        OPRINT("[RTP ERROR] SOS segment length exceeds JPEG size (sos_len=%u)\n", sos_len);
-        return -1;
-    }
-    scan_start = sos_pos + 2 + sos_len;
-    if (scan_start >= jpeg_size || scan_start > eoi_pos - 2) {
-        OPRINT("[RTP ERROR] Invalid scan_start computed (scan_start=%zu, eoi_pos=%zu)\n", scan_start, eoi_pos);
-        return -1;
-    }
+    memset(frame_info, 0, sizeof(*frame_info));
 
-    size_t scan_len = (eoi_pos - 2) - scan_start;
-    if (scan_len == 0) {
-        OPRINT("[RTP ERROR] Empty scan segment\n");
+    /* the marker index was built once when the frame was published */
+    idx = &fb->jpeg;
+    if (!idx->valid) {
+        OPRINT("[RTP ERROR] frame has no valid SOF/SOS/EOI markers\n");
         return -1;
     }
-    
-    if (scan_len >= 2 && jpeg_data[scan_start + scan_len - 2] == 0xFF && jpeg_data[scan_start + scan_len - 1] == 0xD9) {
-        OPRINT("[RTP ERROR] Scan buffer ends with EOI unexpectedly\n");
-        return -1;
-    }
-    
-    unsigned char *scan_only = (unsigned char *)malloc(scan_len);
-    if (!scan_only) {
-        OPRINT("[RTP ERROR] Failed to allocate scan buffer (%zu bytes)\n", scan_len);
-        return -1;
-    }
-    simd_memcpy(scan_only, jpeg_data + scan_start, scan_len);
 
-    frame_info->rtp_payload = scan_only;
-    frame_info->rtp_payload_size = scan_len;
+    /* the scan is sent straight from the referenced frame, no copy needed */
+    frame_info->rtp_payload = fb->data + idx->scan;
+    frame_info->rtp_payload_size = idx->eoi - idx->scan;
     frame_info->is_rtp_format = 1;
-    frame_info->width = input_width;
-    frame_info->height = input_height;
-    frame_info->subsamp = input_subsamp;
+    frame_info->width = idx->width;
+    frame_info->height = idx->height;
+    frame_info->subsamp = idx->subsamp;
 
                switch (frame_info->subsamp) {
                    case TJSAMP_422: frame_info->jpeg_type = 0; break;
@@ -253,23 +157,14 @@ static int prepare_rtp_jpeg_frame(const unsigned char *jpeg_data, size_t jpeg_si
                }
 
 
-    rtpjpeg_cache_qtables_from_jpeg(jpeg_data, eoi_pos);
-    const uint8_t *qt_luma_ptr = NULL, *qt_chroma_ptr = NULL;
-    int have_luma = 0, have_chroma = 0, qt_precision = 0;
-    if (rtpjpeg_get_cached_qtables(&qt_luma_ptr, &qt_chroma_ptr, &have_luma, &have_chroma, &qt_precision) == 0) {
-        frame_info->have_luma = have_luma;
-        frame_info->have_chroma = have_chroma;
-        frame_info->qt_precision = qt_precision;
-        if (have_luma && qt_luma_ptr) {
-            simd_memcpy(frame_info->qt_luma, qt_luma_ptr, 64);
-        }
-        if (have_chroma && qt_chroma_ptr) {
-            simd_memcpy(frame_info->qt_chroma, qt_chroma_ptr, 64);
-        }
-    } else {
-        frame_info->have_luma = 0;
-        frame_info->have_chroma = 0;
-        frame_info->qt_precision = 0;
+    frame_info->have_luma = idx->have_luma;
+    frame_info->have_chroma = idx->have_chroma;
+    frame_info->qt_precision = idx->qt_precision;
+    if (idx->have_luma) {
+        simd_memcpy(frame_info->qt_luma, idx->qt_luma, 64);
+    }
+    if (idx->have_chroma) {
+        simd_memcpy(frame_info->qt_chroma, idx->qt_chroma, 64);
     }
 
     return 0;
@@ -332,6 +227,10 @@ static void clear_client(int client_idx)
     clients[client_idx].rtcp_port = 0;
     clients[client_idx].sequence_number = 0;
     clients[client_idx].timestamp = 0;
+    clients[client_idx].frame_interval_us = 0;
+    clients[client_idx].next_frame_us = 0;
+    clients[client_idx].delay_us = 0;
+    clients[client_idx].frames_skipped = 0;
     memset(&clients[client_idx].addr, 0, sizeof(clients[client_idx].addr));
 }
 
@@ -681,21 +580,43 @@ static void handle_rtsp_options(int client_socket, int cseq) {
                       "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN\r\n", NULL);
 }
 
+/******************************************************************************
+Description.: Frame rate limit requested with ?fps=N on the stream URL
+Input Value.: request URI
+Return Value: frames per second, 0 for no limit
+******************************************************************************/
+static int parse_fps(const char *uri) {
+    const char *p = strstr(uri, "fps=");
+    long fps;
+
+    if (p == NULL || p == uri || (p[-1] != '?' && p[-1] != '&')) {
+        return 0;
+    }
+    fps = strtol(p + 4, NULL, 10);
+    return (fps > 0 && fps <= 1000) ? (int)fps : 0;
+}
+
 /******************************************************************************
 Description.: Handle RTSP DESCRIBE request
-Input Value.: client socket, CSeq, client address, input number
+Input Value.: client socket, CSeq, client address, input number, ?fps= limit
 Return Value: none
 ******************************************************************************/
-static void handle_rtsp_describe(int client_socket, int cseq, struct sockaddr_in client_addr, int input_number) {
+static void handle_rtsp_describe(int client_socket, int cseq, struct sockaddr_in client_addr, int input_number, int max_fps) {
     char sdp[512];
     int width = 640, height = 480;
+    frame_meta meta;
+    
+    memset(&meta, 0, sizeof(meta));
+    if (pglobal != NULL && input_number >= 0 && input_number < pglobal->incnt) {
+        input_meta_read(&pglobal->in[input_number], &meta);
+    }
     
     if (sdp_dimensions_cached && cached_sdp_width > 0 && cached_sdp_height > 0) {
         width = cached_sdp_width;
         height = cached_sdp_height;
     } else if (pglobal != NULL && input_number >= 0 && input_number < pglobal->incnt) {
-        int current_width = pglobal->in[input_number].width;
-        int current_height = pglobal->in[input_number].height;
+        int current_width = (meta.width > 0) ? meta.width : pglobal->in[input_number].width;
+        int current_height = (meta.height > 0) ? meta.height : pglobal->in[input_number].height;
         
         if (current_width > 0 && current_height > 0) {
             cached_sdp_width = current_width;
@@ -707,9 +628,14 @@ static void handle_rtsp_describe(int client_socket, int cseq, struct sockaddr_in
     }
     
     int fps = 30;
-    if (pglobal != NULL && input_number >= 0 && input_number < pglobal->incnt && pglobal->in[input_number].fps > 0) {
+    if (meta.fps > 0) {
+        fps = meta.fps;
+    } else if (pglobal != NULL && input_number >= 0 && input_number < pglobal->incnt && pglobal->in[input_number].fps > 0) {
         fps = pglobal->in[input_number].fps;
     }
+    if (max_fps > 0 && max_fps < fps) {
+        fps = max_fps;
+    }
     
     snprintf(sdp, sizeof(sdp),
              "v=0\r\n"
@@ -733,10 +659,10 @@ static void handle_rtsp_describe(int client_socket, int cseq, struct sockaddr_in
 
 /******************************************************************************
 Description.: Handle RTSP SETUP request
-Input Value.: client socket, CSeq, client address, request buffer
+Input Value.: client socket, CSeq, client address, request buffer, ?fps= limit
 Return Value: none
 ******************************************************************************/
-static void handle_rtsp_setup(int client_socket, int cseq, struct sockaddr_in client_addr, char *request) {
+static void handle_rtsp_setup(int client_socket, int cseq, struct sockaddr_in client_addr, char *request, int max_fps) {
     int client_rtp_port = 0, client_rtcp_port = 0;
     int use_tcp = 0;
     int session_id = 123456;
@@ -768,6 +694,8 @@ static void handle_rtsp_setup(int client_socket, int cseq, struct sockaddr_in cl
             clients[i].timestamp = 0;
             clients[i].addr = client_addr;
             clients[i].playing = 0;
+            clients[i].frame_interval_us = max_fps > 0 ? 1000000LL / max_fps : 0;
+            clients[i].next_frame_us = 0;
             break;
         }
     }
@@ -898,9 +826,9 @@ static void handle_rtsp_request(int client_socket, struct sockaddr_in client_add
     if (strcmp(method, "OPTIONS") == 0) {
         handle_rtsp_options(client_socket, cseq);
     } else if (strcmp(method, "DESCRIBE") == 0) {
-        handle_rtsp_describe(client_socket, cseq, client_addr, input_number);
+        handle_rtsp_describe(client_socket, cseq, client_addr, input_number, parse_fps(uri));
     } else if (strcmp(method, "SETUP") == 0) {
-        handle_rtsp_setup(client_socket, cseq, client_addr, request);
+        handle_rtsp_setup(client_socket, cseq, client_addr, request, parse_fps(uri));
     } else if (strcmp(method, "PLAY") == 0) {
         handle_rtsp_play(client_socket, cseq, session_id, input_number);
     } else if (strcmp(method, "PAUSE") == 0) {
@@ -928,39 +856,25 @@ Input Value.: client socket
 Return Value: 0 on success, -1 on error
 ******************************************************************************/
 static int handle_http_snapshot(int client_socket) {
-    pthread_mutex_lock(&snapshot_mutex);
+    /* reference the current frame, it is sent without copying */
+    frame_buffer *fb = input_frame_get(&pglobal->in[input_number]);
     
-    if (snapshot_buffer == NULL || snapshot_size == 0) {
-        pthread_mutex_unlock(&snapshot_mutex);
+    if (fb == NULL || fb->size == 0) {
+        input_frame_put(fb);
         send_http_error(client_socket, 503, "Service Unavailable", "text/plain", "No frame available");
         return -1;
     }
     
-    unsigned char *snapshot_copy = malloc(snapshot_size);
-    if (!snapshot_copy) {
-        pthread_mutex_unlock(&snapshot_mutex);
-        send_http_error(client_socket, 500, "Internal Server Error", "text/plain", "Out of memory");
-        return -1;
-    }
-    
-    simd_memcpy(snapshot_copy, snapshot_buffer, snapshot_size);
-    size_t snapshot_size_copy = snapshot_size;
-    pthread_mutex_unlock(&snapshot_mutex);
-    
     char header[512];
-    build_http_headers(header, sizeof(header), 200, "OK", "image/jpeg", snapshot_size_copy);
+    build_http_headers(header, sizeof(header), 200, "OK", "image/jpeg", fb->size);
     
-    if (send(client_socket, header, strlen(header), 0) < 0) {
-        free(snapshot_copy);
+    if (send(client_socket, header, strlen(header), 0) < 0 ||
+        send(client_socket, fb->data, fb->size, 0) < 0) {
+        input_frame_put(fb);
         return -1;
     }
     
-    if (send(client_socket, snapshot_copy, snapshot_size_copy, 0) < 0) {
-        free(snapshot_copy);
-        return -1;
-    }
-    
-    free(snapshot_copy);
+    input_frame_put(fb);
     return 0;
 }
 
@@ -981,14 +895,13 @@ static int handle_http_request(int client_socket, char *request) {
     if (is_get || is_head) {
         if (is_head) {
             /* HEAD request - return headers only */
-            pthread_mutex_lock(&snapshot_mutex);
-            if (snapshot_buffer == NULL || snapshot_size == 0) {
-                pthread_mutex_unlock(&snapshot_mutex);
+            frame_buffer *fb = input_frame_get(&pglobal->in[input_number]);
+            size_t size = (fb != NULL) ? (size_t)fb->size : 0;
+            input_frame_put(fb);
+            if (size == 0) {
                 send_http_error(client_socket, 503, "Service Unavailable", "text/plain", "Service Unavailable");
                 return -1;
             }
-            size_t size = snapshot_size;
-            pthread_mutex_unlock(&snapshot_mutex);
             
             char header[512];
             build_http_headers(header, sizeof(header), 200, "OK", "image/jpeg", size);
@@ -1147,63 +1060,41 @@ Return Value: NULL
 ******************************************************************************/
 void *stream_worker_thread(void *arg)
 {
-    int frame_size = 0;
-    unsigned char *current_frame = NULL;
+    frame_buffer *fb = NULL;
+    frame_cursor cursor;
+    long long wakeup_us;
+    struct _latency *latency = latency_register("rtsp", input_number);
     
     OPRINT("RTSP stream worker started\n");
     
-    static unsigned int last_rtsp_sequence = UINT_MAX;
+    /* start with the next published frame, then walk the frame ring so slow
+     * TCP clients delay the worker by a few frames instead of dropping them */
+    cursor.next_sequence = pglobal->in[input_number].frame_sequence + 1;
+    cursor.skipped = 0;
     
     while (!pglobal->stop && server_running) {
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        
-        unsigned int current_seq = pglobal->in[input_number].frame_sequence;
-        int is_new_frame = (current_seq != last_rtsp_sequence) && 
-                           (pglobal->in[input_number].size > 0);
-        
-        if (!is_new_frame) {
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
-            if (!wait_for_fresh_frame(&pglobal->in[input_number], &last_rtsp_sequence)) {
-                usleep(1000);
-                continue;
-            }
-        } else {
-            last_rtsp_sequence = current_seq;
+        /* reference the next frame, packets are built straight from the shared buffer */
+        unsigned long long skipped = cursor.skipped;
+        fb = input_frame_next(&pglobal->in[input_number], &cursor, 1000);
+        if (fb == NULL) {
+            continue;
         }
-        
-        frame_size = pglobal->in[input_number].size;
-        
-        if (use_static_buffers && frame_size <= MAX_FRAME_SIZE) {
-            current_frame = static_frame_buffer;
-        } else if (current_frame == NULL || frame_size > MAX_FRAME_SIZE) {
-            if (current_frame && current_frame != static_frame_buffer) free(current_frame);
-            current_frame = malloc(frame_size);
-            if (!current_frame) {
-                OPRINT("Failed to allocate frame buffer\n");
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                break;
-            }
+        wakeup_us = time_monotonic_us();
+        if (cursor.skipped != skipped) {
+            DBG("RTSP worker fell behind, skipped %llu frames (%llu total)\n",
+                cursor.skipped - skipped, cursor.skipped);
         }
-        
-        if (current_frame && frame_size > 0 && pglobal->in[input_number].buf != NULL) {
-            simd_memcpy(current_frame, pglobal->in[input_number].buf, frame_size);
-            
-            pthread_mutex_lock(&snapshot_mutex);
-            if (snapshot_buffer == NULL || snapshot_size < frame_size) {
-                if (snapshot_buffer) free(snapshot_buffer);
-                snapshot_buffer = malloc(frame_size);
-                if (snapshot_buffer) {
-                    snapshot_size = frame_size;
-                }
-            }
-            if (snapshot_buffer && snapshot_size >= frame_size) {
-                simd_memcpy(snapshot_buffer, current_frame, frame_size);
-                snapshot_size = frame_size;
-            }
-            pthread_mutex_unlock(&snapshot_mutex);
+        if (fb->size <= 0) {
+            input_frame_put(fb);
+            continue;
+        }
+
+        /* --max-delay: the worker fell so far behind that the frame is stale */
+        if (max_delay_us > 0 && wakeup_us - fb->capture_us > max_delay_us) {
+            metric_add(m_late, 1);
+            input_frame_put(fb);
+            continue;
         }
-        
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
         
 
         pthread_mutex_lock(&clients_mutex);
@@ -1216,10 +1107,7 @@ void *stream_worker_thread(void *arg)
         pthread_mutex_unlock(&clients_mutex);
         
         if (playing_clients == 0) {
-            if (current_frame && current_frame != static_frame_buffer) {
-                free(current_frame);
-                current_frame = NULL;
-            }
+            input_frame_put(fb);
             continue;
         }
         
@@ -1234,12 +1122,9 @@ void *stream_worker_thread(void *arg)
         }
 
         rtp_jpeg_frame_t prepared_frame;
-        if (prepare_rtp_jpeg_frame(current_frame, frame_size, &prepared_frame) != 0) {
+        if (prepare_rtp_jpeg_frame(fb, &prepared_frame) != 0) {
             OPRINT("[RTP ERROR] failed to prepare JPEG for RTP, dropping frame\n");
-            if (current_frame && current_frame != static_frame_buffer) {
-                free(current_frame);
-                current_frame = NULL;
-            }
+            input_frame_put(fb);
             continue;
         }
 
@@ -1275,6 +1160,20 @@ void *stream_worker_thread(void *arg)
         if (prepared_frame.rtp_payload != NULL && prepared_frame.rtp_payload_size > 0) {
             for (int i = 0; i < MAX_CLIENTS; i++) {
                 if (!is_valid_client(i)) continue;
+
+                /* ?fps= clients pass over frames between their slots */
+                if (!frame_rate_take(&clients[i].next_frame_us, clients[i].frame_interval_us, fb)) continue;
+
+                /* newest frame wins: a TCP client whose kernel still holds the
+                 * previous frame misses this one instead of queueing behind it */
+                if (clients[i].rtp_port == 0 && notsent_lowat > 0 &&
+                    socket_notsent(clients[i].socket) >= notsent_lowat) {
+                    clients[i].frames_skipped++;
+                    metric_add(m_skipped, 1);
+                    if (clients[i].timestamp != 0)
+                        clients[i].timestamp += rtp_ts_increment;
+                    continue;
+                }
                 
                 /* Initialize timestamp if needed */
                 if (clients[i].timestamp == 0) {
@@ -1298,7 +1197,11 @@ void *stream_worker_thread(void *arg)
                 }
                 
                 if (send_result >= 0) {
-                    clients[i].timestamp += rtp_ts_increment;
+                    /* 90 kHz clock, decimated clients advance by their slot width */
+                    clients[i].timestamp += clients[i].frame_interval_us > 0 ?
+                        (uint32_t)(clients[i].frame_interval_us * 9 / 100) : rtp_ts_increment;
+                    clients[i].delay_us = time_monotonic_us() - fb->capture_us;
+                    metric_observe_us(m_delay[i], clients[i].delay_us);
                     clients_count++;
                 }
             }
@@ -1306,22 +1209,15 @@ void *stream_worker_thread(void *arg)
         
         pthread_mutex_unlock(&clients_mutex);
 
-        free_rtp_jpeg_frame(&prepared_frame);
-        
-        /* Free current_frame if it was allocated dynamically (not static buffer) */
-        /* Note: We keep current_frame allocated between frames for performance */
-        /* Only free if frame size exceeds MAX_FRAME_SIZE and we allocated dynamically */
-        if (current_frame && current_frame != static_frame_buffer && frame_size > MAX_FRAME_SIZE) {
-            free(current_frame);
-            current_frame = NULL;
+        if (clients_count > 0) {
+            latency_record(latency, fb, wakeup_us, time_monotonic_us());
         }
+
+        free_rtp_jpeg_frame(&prepared_frame);
+        input_frame_put(fb);
     }
     
-    /* Free current_frame on thread exit */
-    if (current_frame && current_frame != static_frame_buffer) {
-        free(current_frame);
-    }
-    OPRINT("RTSP stream worker stopped\n");
+    OPRINT("RTSP stream worker stopped (%llu frames skipped)\n", cursor.skipped);
     return NULL;
 }
 
@@ -1343,6 +1239,9 @@ int output_init(output_parameter *param, int id)
                 OPRINT("RTSP output plugin options:\n");
                 OPRINT("  -i, --input <num>   Input channel index (default from core)\n");
                 OPRINT("  -p, --port <num>    RTSP server port (default 554)\n");
+                OPRINT("  --notsent-lowat <kB> unsent kB a TCP client may have before it\n"
+                       "                      misses frames, 0 = queue every frame (default 32)\n");
+                OPRINT("  --max-delay <ms>    frames older than this are not sent (default 0 = no limit)\n");
                 return -1;
             } else if (param->argv[i] && (!strcmp(param->argv[i], "-i") || !strcmp(param->argv[i], "--input"))) {
                 if (i + 1 < param->argc && param->argv[i + 1]) {
@@ -1357,11 +1256,34 @@ int output_init(output_parameter *param, int id)
                     port = atoi(param->argv[i + 1]);
                     i++;
                 }
+            } else if (param->argv[i] && !strcmp(param->argv[i], "--notsent-lowat")) {
+                if (i + 1 < param->argc && param->argv[i + 1]) {
+                    notsent_lowat = MAX(atoi(param->argv[i + 1]), 0) * 1024;
+                    i++;
+                }
+            } else if (param->argv[i] && !strcmp(param->argv[i], "--max-delay")) {
+                if (i + 1 < param->argc && param->argv[i + 1]) {
+                    max_delay_us = MAX(atoi(param->argv[i + 1]), 0) * 1000LL;
+                    i++;
+                }
             }
         }
     }
     
     OPRINT("RTSP server will use port: %d\n", port);
+    OPRINT("Stream latency: %d kB unsent per TCP client, %lld ms per frame (0 = no limit)\n",
+           notsent_lowat / 1024, max_delay_us / 1000);
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        char labels[48];
+        snprintf(labels, sizeof(labels), "port=\"%d\",client=\"%d\"", port, i);
+        m_delay[i] = metric_histogram("mjpg_rtsp_stream_delay_seconds", labels,
+                                      "Time from capture until a frame was sent to the client in this slot");
+    }
+    m_skipped = metric_counter("mjpg_rtsp_tcp_skipped_frames_total", NULL,
+                               "Frames TCP clients missed because the kernel still held their previous frame");
+    m_late = metric_counter("mjpg_rtsp_late_frames_total", NULL,
+                            "Frames not sent because they were older than --max-delay");
     
     /* Validate input plugin */
     if (input_number >= pglobal->incnt) {
@@ -1455,15 +1377,6 @@ int output_stop(int id)
     }
     cleanup_turbojpeg_handles();
     
-    /* Free snapshot buffer */
-    pthread_mutex_lock(&snapshot_mutex);
-    if (snapshot_buffer) {
-        free(snapshot_buffer);
-        snapshot_buffer = NULL;
-        snapshot_size = 0;
-    }
-    pthread_mutex_unlock(&snapshot_mutex);
-    
     OPRINT("RTSP server stopped\n");
     return 0;
 }
@@ -112,10 +112,9 @@ Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int ok = 1, frame_size = 0, rc = 0;
+    int ok = 1, rc = 0;
     char buffer1[1024] = {0};
-    unsigned char *tmp_framebuffer = NULL;
-    unsigned char *current_frame = NULL;
+    frame_buffer *fb = NULL;
 
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
@@ -145,35 +144,16 @@ void *worker_thread(void *arg)
     while(ok >= 0 && !pglobal->stop) {
         DBG("waiting for fresh frame\n");
         
-        /* Wait for fresh frame using condition variable (efficient) */
-        if (!wait_for_fresh_frame(&pglobal->in[input_number], &last_udp_sequence)) {
-            continue; // No debug print here, as it's now a blocking wait
-        }
-
-        /* read buffer */
-        frame_size = pglobal->in[input_number].current_size;
-        if(frame_size == 0) {
-            pthread_mutex_unlock(&pglobal->in[input_number].db);
+        /* reference the next frame, the input mutex is released on return */
+        fb = input_frame_wait(&pglobal->in[input_number], &last_udp_sequence, 0);
+        if(fb == NULL) {
             continue;
         }
-
-        /* allocate buffer for frame copy */
-        if(current_frame == NULL || frame_size > 10*1024*1024) { // 10MB limit
-            if(current_frame != NULL) free(current_frame);
-            current_frame = malloc(frame_size);
-            if(current_frame == NULL) {
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                LOG("not enough memory for frame buffer\n");
-                break;
-            }
+        if(fb->size == 0) {
+            input_frame_put(fb);
+            continue;
         }
         
-        /* copy frame to our local buffer */
-        simd_memcpy(current_frame, pglobal->in[input_number].buf, frame_size);
-
-        /* allow others to access the global buffer again */
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
-        
         /* Check for UDP message (non-blocking) */
         fd_set readfds;
         struct timeval timeout;
@@ -199,19 +179,22 @@ void *worker_thread(void *arg)
             /* open file for write. Path must pre-exist */
             if((fd = open(udpbuffer, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
                 OPRINT("could not open the file %s\n", udpbuffer);
+                input_frame_put(fb);
                 return NULL;
             }
 
-            /* save picture to file using global buffer directly */
-            if(write(fd, current_frame, frame_size) < 0) {
+            /* save picture to file straight from the shared frame */
+            if(write(fd, fb->data, fb->size) < 0) {
                 OPRINT("could not write to file %s\n", udpbuffer);
                 perror("write()");
                 close(fd);
+                input_frame_put(fb);
                 return NULL;
             }
 
             close(fd);
         }
+        input_frame_put(fb);
 
         // send back client's message that came in udpbuffer
         sendto(sd, udpbuffer, bytes, 0, (struct sockaddr*)&addr, sizeof(addr));
@@ -39,7 +39,6 @@
 
 static pthread_t worker;
 static globals *pglobal;
-static unsigned char *frame = NULL;
 static int input_number = 0;
 
 /******************************************************************************
@@ -71,16 +70,9 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
 
-    free(frame);
     SDL_Quit();
 }
 
-/* Use jpeg_utils for JPEG decompression */
-
-/* Use jpeg_rgb_image from jpeg_utils.h */
-
-/* Use jpeg_decompress_to_rgb from jpeg_utils */
-
 /******************************************************************************
 Description.: this is the main worker thread
               it loops forever, grabs a fresh frame, decompressed the JPEG
@@ -90,16 +82,11 @@ Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int frame_size = 0, firstrun = 1;
+    int firstrun = 1;
 
     SDL_Window *window = NULL;
     SDL_Renderer *renderer = NULL;
     SDL_Texture *texture = NULL;
-    jpeg_rgb_image rgbimage;
-
-    /* initialize the buffer for the decompressed image */
-    rgbimage.buffersize = 0;
-    rgbimage.buffer = NULL;
 
     /* initialze the SDL video subsystem */
     if(SDL_Init(SDL_INIT_VIDEO) < 0) {
@@ -107,12 +94,6 @@ void *worker_thread(void *arg)
         exit(EXIT_FAILURE);
     }
 
-    /* just allocate a large buffer for the JPEGs */
-    if((frame = malloc(4096 * 1024)) == NULL) {
-        OPRINT("not enough memory for worker thread\n");
-        exit(EXIT_FAILURE);
-    }
-
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
@@ -121,39 +102,19 @@ void *worker_thread(void *arg)
     
     while(!pglobal->stop) {
         DBG("waiting for fresh frame\n");
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        
-        if (!is_new_frame_available(&pglobal->in[input_number], &last_viewer_sequence)) {
-            /* No new frame, wait for signal with timeout */
-            struct timespec timeout;
-            calculate_wait_timeout(&pglobal->in[input_number], &timeout);
-            int ret = pthread_cond_timedwait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db, &timeout);
-            if (ret == ETIMEDOUT) {
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                continue;
-            }
-            /* Check again after signal */
-            if (!is_new_frame_available(&pglobal->in[input_number], &last_viewer_sequence)) {
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                continue;
-            }
+        /* reference the next frame, it is decoded through its plane cache */
+        frame_buffer *fb = input_frame_wait(&pglobal->in[input_number], &last_viewer_sequence, 1000);
+        if (fb == NULL) {
+            continue;
         }
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
-        
-
-        /* Use global metadata for dimensions */
-        rgbimage.width = pglobal->in[input_number].width;
-        rgbimage.height = pglobal->in[input_number].height;
-        rgbimage.buffersize = rgbimage.width * rgbimage.height * 3;
-        
-        /* decompress the JPEG and store results in memory */
-        if(jpeg_decompress_to_rgb(frame, frame_size, &rgbimage.buffer, &rgbimage.width, &rgbimage.height, pglobal->in[input_number].width, pglobal->in[input_number].height)) {
+        /* full size RGB from the frame's decode cache, shared with any other
+         * output asking for the same picture */
+        int width = 0, height = 0;
+        const unsigned char *rgb = input_frame_plane(fb, 1, TJPF_RGB, &width, &height);
+        if(rgb == NULL) {
             DBG("could not properly decompress JPEG data\n");
+            input_frame_put(fb);
             continue;
         }
 
@@ -161,42 +122,42 @@ void *worker_thread(void *arg)
             window = SDL_CreateWindow("MJPG-Streamer Viewer",
                                       SDL_WINDOWPOS_UNDEFINED,
                                       SDL_WINDOWPOS_UNDEFINED,
-                                      rgbimage.width,
-                                      rgbimage.height,
+                                      width,
+                                      height,
                                       0);
             if (!window) {
                 OPRINT("Could not create SDL2 window: %s\n", SDL_GetError());
-                free(rgbimage.buffer);
+                input_frame_put(fb);
                 break;
             }
 
             renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
             if (!renderer) {
                 OPRINT("Could not create SDL2 renderer: %s\n", SDL_GetError());
-                free(rgbimage.buffer);
+                input_frame_put(fb);
                 break;
             }
 
             texture = SDL_CreateTexture(renderer,
                                         SDL_PIXELFORMAT_RGB24,
                                         SDL_TEXTUREACCESS_STREAMING,
-                                        rgbimage.width,
-                                        rgbimage.height);
+                                        width,
+                                        height);
             if (!texture) {
                 OPRINT("Could not create SDL2 texture: %s\n", SDL_GetError());
-                free(rgbimage.buffer);
+                input_frame_put(fb);
                 break;
             }
 
             firstrun = 0;
         }
 
-        if (SDL_UpdateTexture(texture, NULL, rgbimage.buffer, rgbimage.width * 3) != 0) {
+        int rc = SDL_UpdateTexture(texture, NULL, rgb, width * 3);
+        input_frame_put(fb);
+        if (rc != 0) {
             DBG("SDL_UpdateTexture failed: %s\n", SDL_GetError());
-            free(rgbimage.buffer);
             continue;
         }
-        free(rgbimage.buffer);
 
         SDL_RenderClear(renderer);
         SDL_RenderCopy(renderer, texture, NULL, NULL);
@@ -50,8 +50,6 @@
 
 static pthread_t worker;
 static globals *pglobal;
-static unsigned char *frame = NULL;
-static size_t frame_capacity = 0;
 static int input_number = 0;
 
 static pid_t viewer_pid = -1;
@@ -423,25 +421,6 @@ static int start_helper_if_needed(void)
     return 0;
 }
 
-static int ensure_frame_capacity(size_t size)
-{
-    unsigned char *new_buf;
-
-    if (frame_capacity >= size) {
-        return 0;
-    }
-
-    new_buf = realloc(frame, size);
-    if (!new_buf) {
-        OPRINT("not enough memory to allocate %zu bytes for frame buffer\n", size);
-        return -1;
-    }
-
-    frame = new_buf;
-    frame_capacity = size;
-    return 0;
-}
-
 static int write_jpeg_frame(const unsigned char *data, size_t size)
 {
     int fd;
@@ -528,12 +507,6 @@ void worker_cleanup(void *arg)
     OPRINT("cleaning up resources allocated by worker thread\n");
 
     stop_helper();
-
-    if (frame) {
-        free(frame);
-        frame = NULL;
-        frame_capacity = 0;
-    }
 }
 
 /******************************************************************************
@@ -549,36 +522,28 @@ void *worker_thread(void *arg)
     pthread_cleanup_push(worker_cleanup, NULL);
 
     while(!pglobal->stop) {
-        int frame_size = 0;
+        frame_buffer *fb;
         int helper_status;
 
         DBG("waiting for fresh frame\n");
 
-        if (!wait_for_fresh_frame(&pglobal->in[input_number], &last_viewer_sequence)) {
-            usleep(10000);
+        /* reference the next frame, it is handed to the helper without a copy */
+        fb = input_frame_wait(&pglobal->in[input_number], &last_viewer_sequence, 1000);
+        if (fb == NULL) {
             continue;
         }
 
-        frame_size = pglobal->in[input_number].size;
-        if (frame_size <= 0) {
-            pthread_mutex_unlock(&pglobal->in[input_number].db);
+        if (fb->size <= 0) {
+            input_frame_put(fb);
             continue;
         }
 
-        if (ensure_frame_capacity((size_t)frame_size) != 0) {
-            pthread_mutex_unlock(&pglobal->in[input_number].db);
-            break;
-        }
-
-        simd_memcpy(frame, pglobal->in[input_number].buf, (size_t)frame_size);
-
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
-
         helper_status = start_helper_if_needed();
 
-        if (write_jpeg_frame(frame, (size_t)frame_size) != 0) {
+        if (write_jpeg_frame(fb->data, (size_t)fb->size) != 0) {
             usleep(20000);
         }
+        input_frame_put(fb);
 
         if (helper_status != 0) {
             usleep(500000);
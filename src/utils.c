@@ -38,8 +38,19 @@
 #endif
 #include <sys/stat.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <linux/sockios.h>
+#endif
 #include "plugins/input.h"
+#include "jpeg_utils.h"
 
 /* SIMD optimization headers */
 #ifdef __SSE2__
@@ -265,51 +276,50 @@ void* simd_memcpy(void* dest, const void* src, size_t n) {
 
 /* Check if new frame is available using sequence number */
 int is_new_frame_available(void *in_ptr, unsigned int *last_sequence) {
+    frame_meta meta;
+
     if (in_ptr == NULL || last_sequence == NULL) {
         return 0;
     }
     
     input *in = (input *)in_ptr;
-    if (in == NULL) {
-        return 0;
-    }
-    
-    unsigned int current_frame_sequence = in->frame_sequence;
-    if (current_frame_sequence == *last_sequence) {
+    input_meta_read(in, &meta);
+
+    if (meta.sequence == *last_sequence) {
         return 0; /* No new frame */
     }
     
     /* Check if frame is actually ready (has valid size) */
-    if (in->current_size == 0 && in->size == 0) {
+    if (meta.size == 0) {
         return 0; /* Frame not ready yet */
     }
     
-    *last_sequence = current_frame_sequence;
+    *last_sequence = meta.sequence;
     return 1; /* New frame available */
 }
 
 /* Calculate optimal wait timeout based on FPS and frame timestamp */
 int calculate_wait_timeout(void *in_ptr, struct timespec *timeout) {
+    frame_meta meta;
+
     if (in_ptr == NULL || timeout == NULL) {
         return -1;
     }
     
     input *in = (input *)in_ptr;
-    if (in == NULL) {
-        return -1;
-    }
+    input_meta_read(in, &meta);
     
     /* Use global frame timestamp if available, otherwise current time */
-    if (in->frame_timestamp_ms > 0) {
-        timeout->tv_sec = in->frame_timestamp_ms / 1000;
-        timeout->tv_nsec = (in->frame_timestamp_ms % 1000) * 1000000;
+    if (meta.timestamp_ms > 0) {
+        timeout->tv_sec = meta.timestamp_ms / 1000;
+        timeout->tv_nsec = (meta.timestamp_ms % 1000) * 1000000;
     } else {
         /* Fallback to current time if frame timestamp not set */
         clock_gettime(CLOCK_REALTIME, timeout);
     }
     
     /* Calculate timeout based on FPS */
-    long timeout_ns = (in->fps > 0) ? (1000000000 / in->fps) : 100000000; /* 100ms default */
+    long timeout_ns = (meta.fps > 0) ? (1000000000 / meta.fps) : 100000000; /* 100ms default */
     timeout->tv_nsec += timeout_ns;
     if (timeout->tv_nsec >= 1000000000) {
         timeout->tv_sec += 1;
@@ -338,7 +348,1459 @@ int wait_for_fresh_frame(void *in_ptr, unsigned int *last_sequence) {
     return 1;
 }
 
+/******************************************************************************
+Description.: publish new frame metadata, readers never block on this. Writers
+              must be serialized, input_frame_publish() holds in->db for it.
+Input Value.: in: input
+              meta: new metadata
+Return Value: -
+******************************************************************************/
+void input_meta_write(input *in, const frame_meta *meta)
+{
+    /* odd value tells readers that an update is in progress */
+    __atomic_store_n(&in->meta_lock, in->meta_lock + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    in->meta = *meta;
+    __atomic_store_n(&in->meta_lock, in->meta_lock + 1, __ATOMIC_RELEASE);
+}
+
+/******************************************************************************
+Description.: get a consistent copy of the newest frame metadata without
+              taking the input mutex, retries while a write is in progress
+Input Value.: in: input
+              meta: receives the copy
+Return Value: -
+******************************************************************************/
+void input_meta_read(input *in, frame_meta *meta)
+{
+    unsigned int start;
+
+    for(;;) {
+        start = __atomic_load_n(&in->meta_lock, __ATOMIC_ACQUIRE);
+        if(start & 1) {
+            sched_yield();
+            continue;
+        }
+        *meta = in->meta;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&in->meta_lock, __ATOMIC_RELAXED) == start)
+            return;
+    }
+}
+
+/******************************************************************************
+Description.: decide whether a consumer limited to one frame per interval
+              takes a frame. The slots are evenly spaced on the capture
+              times, a frame slightly early for its slot is accepted since
+              capture times jitter, and a consumer that got nothing for a
+              whole interval starts over with the frame at hand.
+Input Value.: next_us: next slot of the consumer, 0 before the first frame
+              interval_us: slot width, 0 takes every frame
+              fb: frame
+Return Value: 1 if the frame is to be sent, 0 if it is skipped
+******************************************************************************/
+int frame_rate_take(long long *next_us, long long interval_us, const frame_buffer *fb)
+{
+    if(interval_us <= 0)
+        return 1;
+
+    if(*next_us != 0 && fb->capture_us < *next_us - interval_us / 8)
+        return 0;
+
+    if(*next_us == 0 || fb->capture_us - *next_us >= interval_us)
+        *next_us = fb->capture_us + interval_us;
+    else
+        *next_us += interval_us;
+    return 1;
+}
+
+/******************************************************************************
+Description.: release a frame buffer that is in no ring and no pool
+Input Value.: fb: frame
+Return Value: -
+******************************************************************************/
+static void frame_free(frame_buffer *fb)
+{
+    frame_plane *plane;
+
+    while(fb->planes != NULL) {
+        plane = fb->planes;
+        fb->planes = plane->next;
+        free(plane->data);
+        free(plane);
+    }
+    pthread_mutex_destroy(&fb->planes_lock);
+    free(fb->data);
+    free(fb);
+}
+
+/******************************************************************************
+Description.: lock the input mutex, contended acquisitions are timed into the
+              lock wait histogram, the uncontended path costs one trylock
+Input Value.: in: input
+Return Value: -
+******************************************************************************/
+static void input_lock(input *in)
+{
+    long long start;
+
+    if(pthread_mutex_trylock(&in->db) == 0)
+        return;
+
+    start = time_monotonic_us();
+    pthread_mutex_lock(&in->db);
+    metric_observe_us(in->m_lock_wait, time_monotonic_us() - start);
+}
+
+/******************************************************************************
+Description.: prepare the refcounted frame storage of an input
+Input Value.: in: input to initialize
+              id: input number, used as metrics label
+              ring_depth: number of published frames to keep, clamped to
+                          1..MAX_FRAME_RING_DEPTH
+Return Value: 0 on success, -1 on error
+******************************************************************************/
+int input_frames_init(input *in, int id, int ring_depth)
+{
+    char labels[32];
+
+    snprintf(labels, sizeof(labels), "input=\"%d\"", id);
+    return input_frames_init_labels(in, labels, ring_depth);
+}
+
+/******************************************************************************
+Description.: like input_frames_init(), for frame sources that are not one
+              of the inputs and label their metrics themselves
+Input Value.: in: input to initialize
+              labels: labels of the mjpg_input_* metrics
+              ring_depth: number of published frames to keep
+Return Value: 0 on success, -1 on error
+******************************************************************************/
+int input_frames_init_labels(input *in, const char *labels, int ring_depth)
+{
+    if(in == NULL)
+        return -1;
+
+    in->m_frames = metric_counter("mjpg_input_frames_total", labels, "Frames published by the input");
+    in->m_bytes = metric_counter("mjpg_input_bytes_total", labels, "JPEG bytes published by the input");
+    in->m_skipped = metric_counter("mjpg_input_ring_skipped_frames_total", labels,
+                                   "Frames that left the ring before a ring consumer read them");
+    in->m_lock_wait = metric_histogram("mjpg_input_lock_wait_seconds", labels,
+                                       "Time spent waiting for a contended input mutex");
+    in->m_capture = metric_histogram("mjpg_frame_capture_to_publish_seconds", labels,
+                                     "Time from capture until the input published the frame");
+    in->m_variants = metric_counter("mjpg_input_variant_encodes_total", labels,
+                                    "Scaled or re-quality JPEG variants encoded from published frames");
+
+    if(ring_depth < 1)
+        ring_depth = 1;
+    if(ring_depth > MAX_FRAME_RING_DEPTH)
+        ring_depth = MAX_FRAME_RING_DEPTH;
+
+    in->frame = NULL;
+    in->frame_pool = NULL;
+    in->meta_lock = 0;
+    memset(&in->meta, 0, sizeof(in->meta));
+    in->meta.subsampling = -1;
+    in->subscribers = NULL;
+    in->subscriber_count = 0;
+    in->frame_ring_depth = ring_depth;
+    in->frame_ring = calloc(ring_depth, sizeof(frame_buffer *));
+    if(in->frame_ring == NULL)
+        return -1;
+
+    if(pthread_mutex_init(&in->frame_pool_lock, NULL) != 0) {
+        free(in->frame_ring);
+        in->frame_ring = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: drop the retained frames and free the pooled ones of an input
+              that stays in use, subscribers keep their descriptors and the
+              next published frame starts over
+Input Value.: in: input
+Return Value: -
+******************************************************************************/
+void input_frames_release(input *in)
+{
+    frame_buffer *ring[MAX_FRAME_RING_DEPTH], *fb;
+    int i;
+
+    if(in == NULL || in->frame_ring == NULL)
+        return;
+
+    pthread_mutex_lock(&in->db);
+    in->frame = NULL;
+    in->buf = NULL;
+    in->size = 0;
+    for(i = 0; i < in->frame_ring_depth; i++) {
+        ring[i] = in->frame_ring[i];
+        in->frame_ring[i] = NULL;
+    }
+    pthread_mutex_unlock(&in->db);
+
+    for(i = 0; i < in->frame_ring_depth; i++)
+        input_frame_put(ring[i]);
+
+    pthread_mutex_lock(&in->frame_pool_lock);
+    while(in->frame_pool != NULL) {
+        fb = in->frame_pool;
+        in->frame_pool = fb->next;
+        frame_free(fb);
+    }
+    pthread_mutex_unlock(&in->frame_pool_lock);
+}
+
+/******************************************************************************
+Description.: drop the retained frames and free all pooled frames
+Input Value.: in: input to clean up
+Return Value: -
+******************************************************************************/
+void input_frames_cleanup(input *in)
+{
+    frame_buffer *fb;
+    int i;
+
+    if(in == NULL || in->frame_ring == NULL)
+        return;
+
+    pthread_mutex_lock(&in->db);
+    in->frame = NULL;
+    in->buf = NULL;
+    in->size = 0;
+    for(i = 0; i < in->subscriber_count; i++) {
+        if(in->subscribers[i].notify_fd != in->subscribers[i].fd)
+            close(in->subscribers[i].notify_fd);
+        close(in->subscribers[i].fd);
+    }
+    free(in->subscribers);
+    in->subscribers = NULL;
+    in->subscriber_count = 0;
+    pthread_mutex_unlock(&in->db);
+
+    for(i = 0; i < in->frame_ring_depth; i++) {
+        input_frame_put(in->frame_ring[i]);
+        in->frame_ring[i] = NULL;
+    }
+
+    pthread_mutex_lock(&in->frame_pool_lock);
+    while(in->frame_pool != NULL) {
+        fb = in->frame_pool;
+        in->frame_pool = fb->next;
+        frame_free(fb);
+    }
+    pthread_mutex_unlock(&in->frame_pool_lock);
+    pthread_mutex_destroy(&in->frame_pool_lock);
+
+    free(in->frame_ring);
+    in->frame_ring = NULL;
+}
+
+/******************************************************************************
+Description.: get a writable frame for the producer, recycled from the free
+              pool if possible. The caller owns the single reference until it
+              publishes the frame or hands it back with input_frame_put().
+Input Value.: in: input the frame belongs to
+              capacity: minimum number of bytes needed
+Return Value: frame or NULL if out of memory
+******************************************************************************/
+frame_buffer *input_frame_acquire(input *in, size_t capacity)
+{
+    frame_buffer *fb;
+
+    pthread_mutex_lock(&in->frame_pool_lock);
+    fb = in->frame_pool;
+    if(fb != NULL)
+        in->frame_pool = fb->next;
+    pthread_mutex_unlock(&in->frame_pool_lock);
+
+    if(fb == NULL) {
+        fb = calloc(1, sizeof(frame_buffer));
+        if(fb == NULL)
+            return NULL;
+        fb->owner = in;
+        pthread_mutex_init(&fb->planes_lock, NULL);
+    }
+
+    if(fb->capacity < capacity) {
+        unsigned char *data = realloc(fb->data, capacity);
+        if(data == NULL) {
+            frame_free(fb);
+            return NULL;
+        }
+        fb->data = data;
+        fb->capacity = capacity;
+    }
+
+    fb->next = NULL;
+    fb->size = 0;
+    fb->capture_us = 0;
+    fb->refcount = 1;
+    return fb;
+}
+
+/******************************************************************************
+Description.: signal a subscriber descriptor. Both ends are non-blocking, a
+              full pipe or a saturated eventfd counter already reads as ready.
+Input Value.: fd: descriptor to write to
+Return Value: -
+******************************************************************************/
+static void frame_notify(int fd)
+{
+#ifdef __linux__
+    uint64_t one = 1;
+
+    if(write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("write(eventfd)");
+#else
+    char one = 1;
+
+    if(write(fd, &one, 1) < 0 && errno != EAGAIN)
+        perror("write(pipe)");
+#endif
+}
+
+/******************************************************************************
+Description.: make a filled frame the current one. The producer's reference is
+              transferred to the frame ring, the mutex is only held for the
+              pointer swap and the frame falling out of the ring is released.
+Input Value.: in: input to publish to
+              fb: frame from input_frame_acquire()
+              size: number of valid bytes in fb->data
+              timestamp: capture time or NULL to use the current time
+Return Value: -
+******************************************************************************/
+void input_frame_publish(input *in, frame_buffer *fb, int size, struct timeval *timestamp)
+{
+    frame_buffer *old;
+    frame_meta meta;
+    int i;
+
+    fb->size = size;
+    if(timestamp != NULL)
+        fb->timestamp = *timestamp;
+    else
+        gettimeofday(&fb->timestamp, NULL);
+    fb->timestamp_ms = (long long)fb->timestamp.tv_sec * 1000 + fb->timestamp.tv_usec / 1000;
+
+    /* index the markers once here so consumers never rescan the frame,
+       dimensions and subsampling come from the frame itself when possible */
+    jpeg_index_frame(fb->data, size, &fb->jpeg);
+
+    fb->publish_us = time_monotonic_us();
+    if(fb->capture_us != 0)
+        metric_observe_us(in->m_capture, fb->publish_us - fb->capture_us);
+    else
+        fb->capture_us = fb->publish_us;
+    meta.width = fb->jpeg.sof ? fb->jpeg.width : in->width;
+    meta.height = fb->jpeg.sof ? fb->jpeg.height : in->height;
+    meta.subsampling = fb->jpeg.subsamp;
+
+    input_lock(in);
+    in->prev_size = in->current_size;
+    fb->sequence = ++in->frame_sequence;
+    old = in->frame_ring[fb->sequence % in->frame_ring_depth];
+    in->frame_ring[fb->sequence % in->frame_ring_depth] = fb;
+    in->frame = fb;
+    in->buf = fb->data;
+    in->size = size;
+    in->current_size = size;
+    in->timestamp = fb->timestamp;
+    in->frame_timestamp_ms = fb->timestamp_ms;
+
+    meta.sequence = fb->sequence;
+    meta.size = size;
+    meta.timestamp = fb->timestamp;
+    meta.timestamp_ms = fb->timestamp_ms;
+    meta.fps = in->fps;
+    input_meta_write(in, &meta);
+
+    metric_add(in->m_frames, 1);
+    metric_add(in->m_bytes, size);
+
+    pthread_cond_broadcast(&in->db_update);
+    for(i = 0; i < in->subscriber_count; i++)
+        frame_notify(in->subscribers[i].notify_fd);
+    pthread_mutex_unlock(&in->db);
+
+    if(old != NULL)
+        input_frame_put(old);
+}
+
+/******************************************************************************
+Description.: take an additional reference on a frame the caller already holds
+Input Value.: fb: frame
+Return Value: fb
+******************************************************************************/
+frame_buffer *input_frame_ref(frame_buffer *fb)
+{
+    if(fb != NULL)
+        __atomic_add_fetch(&fb->refcount, 1, __ATOMIC_RELAXED);
+    return fb;
+}
+
+/******************************************************************************
+Description.: drop a reference, the last one returns the frame to the pool
+Input Value.: fb: frame, may be NULL
+Return Value: -
+******************************************************************************/
+void input_frame_put(frame_buffer *fb)
+{
+    input *in;
+
+    if(fb == NULL)
+        return;
+
+    if(__atomic_sub_fetch(&fb->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    in = fb->owner;
+    pthread_mutex_lock(&in->frame_pool_lock);
+    fb->next = in->frame_pool;
+    in->frame_pool = fb;
+    pthread_mutex_unlock(&in->frame_pool_lock);
+}
+
+/******************************************************************************
+Description.: reference the currently published frame
+Input Value.: in: input
+Return Value: frame (release with input_frame_put) or NULL if none yet
+******************************************************************************/
+frame_buffer *input_frame_get(input *in)
+{
+    frame_buffer *fb;
+
+    input_lock(in);
+    fb = input_frame_ref(in->frame);
+    pthread_mutex_unlock(&in->db);
+
+    return fb;
+}
+
+/******************************************************************************
+Description.: wait for a frame newer than *last_sequence and reference it,
+              the mutex is released before returning
+Input Value.: in: input
+              last_sequence: sequence seen last, updated on success
+              timeout_ms: maximum time to wait, <= 0 waits forever
+Return Value: frame (release with input_frame_put) or NULL on timeout
+******************************************************************************/
+frame_buffer *input_frame_wait(input *in, unsigned int *last_sequence, int timeout_ms)
+{
+    frame_buffer *fb = NULL;
+    struct timespec abstime;
+
+    if(timeout_ms > 0) {
+        clock_gettime(CLOCK_REALTIME, &abstime);
+        abstime.tv_sec += timeout_ms / 1000;
+        abstime.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if(abstime.tv_nsec >= 1000000000) {
+            abstime.tv_sec += 1;
+            abstime.tv_nsec -= 1000000000;
+        }
+    }
+
+    input_lock(in);
+    while(in->frame == NULL || in->frame->sequence == *last_sequence) {
+        if(timeout_ms > 0) {
+            if(pthread_cond_timedwait(&in->db_update, &in->db, &abstime) == ETIMEDOUT)
+                break;
+        } else {
+            pthread_cond_wait(&in->db_update, &in->db);
+        }
+    }
+    if(in->frame != NULL && in->frame->sequence != *last_sequence) {
+        fb = input_frame_ref(in->frame);
+        *last_sequence = fb->sequence;
+    }
+    pthread_mutex_unlock(&in->db);
+
+    return fb;
+}
+
+/******************************************************************************
+Description.: find the plane of the current publication with the given key
+Input Value.: fb: frame, planes_lock held
+              scale, pixfmt, quality: plane key
+              spare: receives a stale plane with the same key, if any
+Return Value: plane or NULL if there is none for this publication
+******************************************************************************/
+static frame_plane *frame_plane_find(frame_buffer *fb, int scale, int pixfmt, int quality, frame_plane **spare)
+{
+    frame_plane *plane;
+
+    for(plane = fb->planes; plane != NULL; plane = plane->next) {
+        if(plane->scale != scale || plane->pixfmt != pixfmt || plane->quality != quality)
+            continue;
+        if(plane->sequence == fb->sequence)
+            return plane;
+        /* left over from an earlier use of this buffer */
+        *spare = plane;
+    }
+    return NULL;
+}
+
+/******************************************************************************
+Description.: get an empty plane with room for need bytes, reusing spare
+Input Value.: fb: frame, planes_lock held
+              scale, pixfmt, quality: plane key
+              spare: stale plane with the same key or NULL
+              need: bytes of content
+Return Value: plane or NULL on error
+******************************************************************************/
+static frame_plane *frame_plane_prepare(frame_buffer *fb, int scale, int pixfmt, int quality,
+                                        frame_plane *spare, size_t need)
+{
+    frame_plane *plane = spare;
+
+    if(plane == NULL) {
+        plane = calloc(1, sizeof(frame_plane));
+        if(plane == NULL)
+            return NULL;
+        plane->scale = scale;
+        plane->pixfmt = pixfmt;
+        plane->quality = quality;
+        plane->next = fb->planes;
+        fb->planes = plane;
+    }
+
+    plane->sequence = 0;
+    if(plane->capacity < need) {
+        unsigned char *data = realloc(plane->data, need);
+        if(data == NULL)
+            return NULL;
+        plane->data = data;
+        plane->capacity = need;
+    }
+    return plane;
+}
+
+/******************************************************************************
+Description.: decode a frame into a plane, reusing spare's buffer if given
+Input Value.: fb: frame, planes_lock held
+              scale, pixfmt: plane key
+              spare: stale plane with the same key or NULL
+Return Value: decoded plane or NULL on error
+******************************************************************************/
+static frame_plane *frame_plane_decode(frame_buffer *fb, int scale, int pixfmt, frame_plane *spare)
+{
+    frame_plane *plane;
+    int w, h;
+
+    if(jpeg_scaled_size(fb->jpeg.width, fb->jpeg.height, scale, &w, &h) < 0)
+        return NULL;
 
+    plane = frame_plane_prepare(fb, scale, pixfmt, 0, spare, (size_t)w * h * (pixfmt == TJPF_GRAY ? 1 : 3));
+    if(plane == NULL)
+        return NULL;
+    if(jpeg_decode_scaled(fb->data, fb->size, plane->data, w, h, pixfmt) < 0)
+        return NULL;
+
+    plane->width = w;
+    plane->height = h;
+    plane->sequence = fb->sequence;
+    return plane;
+}
+
+/******************************************************************************
+Description.: encode a JPEG variant of a frame from its scaled RGB plane,
+              which is decoded first unless another consumer already did
+Input Value.: fb: frame, planes_lock held
+              scale, quality: variant key
+              spare: stale variant with the same key or NULL
+Return Value: variant or NULL on error
+******************************************************************************/
+static frame_plane *frame_plane_encode(frame_buffer *fb, int scale, int quality, frame_plane *spare)
+{
+    frame_plane *pixels, *plane, *pixels_spare = NULL;
+
+    pixels = frame_plane_find(fb, scale, TJPF_RGB, 0, &pixels_spare);
+    if(pixels == NULL && (pixels = frame_plane_decode(fb, scale, TJPF_RGB, pixels_spare)) == NULL)
+        return NULL;
+
+    plane = frame_plane_prepare(fb, scale, TJPF_RGB, quality, spare,
+                                jpeg_encode_bound(pixels->width, pixels->height));
+    if(plane == NULL)
+        return NULL;
+    if(jpeg_encode(pixels->data, pixels->width, pixels->height, TJPF_RGB, quality,
+                   plane->data, plane->capacity, &plane->size) < 0)
+        return NULL;
+
+    plane->width = pixels->width;
+    plane->height = pixels->height;
+    plane->sequence = fb->sequence;
+    if(fb->owner != NULL)
+        metric_add(fb->owner->m_variants, 1);
+    return plane;
+}
+
+/******************************************************************************
+Description.: get a decoded picture of a published frame. The first consumer
+              asking for a (scale, pixfmt) pair decodes it, every other one
+              gets the cached pixels, so a frame is decoded once no matter how
+              many outputs analyse it. Concurrent callers for the same frame
+              wait for that decode instead of repeating it.
+Input Value.: fb: published frame, the caller holds a reference
+              scale: downscale divisor, 1 = full size
+              pixfmt: TJPF_GRAY, TJPF_RGB or TJPF_BGR
+              width, height: receive the plane dimensions, may be NULL
+Return Value: read-only pixels valid until the reference is dropped, or NULL
+              if the frame cannot be decoded
+******************************************************************************/
+const unsigned char *input_frame_plane(frame_buffer *fb, int scale, int pixfmt, int *width, int *height)
+{
+    frame_plane *plane, *spare = NULL;
+    const unsigned char *pixels = NULL;
 
+    if(fb == NULL || !fb->jpeg.valid)
+        return NULL;
+    if(scale < 1)
+        scale = 1;
 
+    pthread_mutex_lock(&fb->planes_lock);
 
+    plane = frame_plane_find(fb, scale, pixfmt, 0, &spare);
+    if(plane == NULL)
+        plane = frame_plane_decode(fb, scale, pixfmt, spare);
+
+    if(plane != NULL) {
+        pixels = plane->data;
+        if(width != NULL)
+            *width = plane->width;
+        if(height != NULL)
+            *height = plane->height;
+    }
+
+    pthread_mutex_unlock(&fb->planes_lock);
+    return pixels;
+}
+
+/******************************************************************************
+Description.: get a downscaled or re-quality JPEG of a published frame. Like
+              input_frame_plane() the first consumer asking for a (scale,
+              quality) pair encodes it and all others share the result, so
+              a variant costs one encode per frame only while someone uses it.
+Input Value.: fb: published frame, the caller holds a reference
+              scale: downscale divisor, 1 = full size, TurboJPEG scales in
+                     the DCT domain while decoding
+              quality: JPEG quality of the variant, 1 to 100
+              size: receives the JPEG length
+Return Value: read-only JPEG valid until the reference is dropped, or NULL
+              if the frame cannot be transcoded
+******************************************************************************/
+const unsigned char *input_frame_variant(frame_buffer *fb, int scale, int quality, size_t *size)
+{
+    frame_plane *plane, *spare = NULL;
+    const unsigned char *jpeg = NULL;
+
+    if(fb == NULL || !fb->jpeg.valid || quality < 1 || quality > 100 || size == NULL)
+        return NULL;
+    if(scale < 1)
+        scale = 1;
+
+    pthread_mutex_lock(&fb->planes_lock);
+
+    plane = frame_plane_find(fb, scale, TJPF_RGB, quality, &spare);
+    if(plane == NULL)
+        plane = frame_plane_encode(fb, scale, quality, spare);
+
+    if(plane != NULL) {
+        jpeg = plane->data;
+        *size = plane->size;
+    }
+
+    pthread_mutex_unlock(&fb->planes_lock);
+    return jpeg;
+}
+
+/******************************************************************************
+Description.: get a descriptor that becomes readable whenever the input
+              publishes a frame, so it can sit in a poll/epoll set next to the
+              client sockets. Notifications coalesce, after wakeup call
+              input_frame_drain() and fetch the newest frame with
+              input_frame_get() or walk the ring with input_frame_next().
+Input Value.: in: input to subscribe to
+Return Value: non-blocking descriptor or -1 on error
+******************************************************************************/
+int input_frame_subscribe(input *in)
+{
+    frame_subscriber sub, *subs;
+
+#ifdef __linux__
+    sub.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(sub.fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+    sub.notify_fd = sub.fd;
+#else
+    int p[2], i;
+
+    if(pipe(p) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    for(i = 0; i < 2; i++) {
+        fcntl(p[i], F_SETFL, fcntl(p[i], F_GETFL) | O_NONBLOCK);
+        fcntl(p[i], F_SETFD, FD_CLOEXEC);
+    }
+    sub.fd = p[0];
+    sub.notify_fd = p[1];
+#endif
+
+    pthread_mutex_lock(&in->db);
+    subs = realloc(in->subscribers, (in->subscriber_count + 1) * sizeof(frame_subscriber));
+    if(subs == NULL) {
+        pthread_mutex_unlock(&in->db);
+        if(sub.notify_fd != sub.fd)
+            close(sub.notify_fd);
+        close(sub.fd);
+        return -1;
+    }
+    in->subscribers = subs;
+    in->subscribers[in->subscriber_count++] = sub;
+    /* a frame may already be waiting, report it right away */
+    if(in->frame != NULL)
+        frame_notify(sub.notify_fd);
+    pthread_mutex_unlock(&in->db);
+
+    return sub.fd;
+}
+
+/******************************************************************************
+Description.: stop notifications and close a descriptor from
+              input_frame_subscribe(), remove it from any epoll set first
+Input Value.: in: input the descriptor was subscribed to
+              fd: descriptor
+Return Value: -
+******************************************************************************/
+void input_frame_unsubscribe(input *in, int fd)
+{
+    int i;
+
+    pthread_mutex_lock(&in->db);
+    for(i = 0; i < in->subscriber_count; i++) {
+        if(in->subscribers[i].fd != fd)
+            continue;
+        if(in->subscribers[i].notify_fd != fd)
+            close(in->subscribers[i].notify_fd);
+        close(fd);
+        in->subscribers[i] = in->subscribers[--in->subscriber_count];
+        break;
+    }
+    pthread_mutex_unlock(&in->db);
+}
+
+/******************************************************************************
+Description.: reset a subscriber descriptor after it polled readable
+Input Value.: fd: descriptor from input_frame_subscribe()
+Return Value: -
+******************************************************************************/
+void input_frame_drain(int fd)
+{
+#ifdef __linux__
+    uint64_t count;
+
+    if(read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("read(eventfd)");
+#else
+    char junk[64];
+
+    while(read(fd, junk, sizeof(junk)) > 0);
+#endif
+}
+
+/******************************************************************************
+Description.: get the oldest frame in the ring with a sequence not lower than
+              cursor->next_sequence, waiting if the consumer is up to date.
+              Frames that already left the ring are added to cursor->skipped,
+              so a slow consumer falls behind by up to the ring depth before
+              it loses frames, without ever stalling the producer.
+Input Value.: in: input
+              cursor: read position of the consumer, advanced on success
+              timeout_ms: maximum time to wait, <= 0 waits forever
+Return Value: frame (release with input_frame_put) or NULL on timeout
+******************************************************************************/
+frame_buffer *input_frame_next(input *in, frame_cursor *cursor, int timeout_ms)
+{
+    frame_buffer *fb = NULL;
+    struct timespec abstime;
+    unsigned int want, oldest, newest;
+
+    if(timeout_ms > 0) {
+        clock_gettime(CLOCK_REALTIME, &abstime);
+        abstime.tv_sec += timeout_ms / 1000;
+        abstime.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if(abstime.tv_nsec >= 1000000000) {
+            abstime.tv_sec += 1;
+            abstime.tv_nsec -= 1000000000;
+        }
+    }
+
+    input_lock(in);
+    /* sequences wrap around, so compare them by signed distance */
+    while(in->frame == NULL ||
+          (cursor->next_sequence != 0 && (int)(in->frame->sequence - cursor->next_sequence) < 0)) {
+        if(timeout_ms > 0) {
+            if(pthread_cond_timedwait(&in->db_update, &in->db, &abstime) == ETIMEDOUT)
+                break;
+        } else {
+            pthread_cond_wait(&in->db_update, &in->db);
+        }
+    }
+
+    if(in->frame != NULL &&
+       (cursor->next_sequence == 0 || (int)(in->frame->sequence - cursor->next_sequence) >= 0)) {
+        newest = in->frame->sequence;
+        oldest = newest - (unsigned int)in->frame_ring_depth + 1;
+        want = cursor->next_sequence;
+        if(want == 0 || (int)(want - oldest) < 0)
+            want = oldest;
+
+        /* slots are empty until the ring filled up once */
+        for(; (int)(newest - want) >= 0; want++) {
+            frame_buffer *slot = in->frame_ring[want % in->frame_ring_depth];
+            if(slot != NULL && slot->sequence == want) {
+                fb = input_frame_ref(slot);
+                break;
+            }
+        }
+
+        if(fb != NULL) {
+            if(cursor->next_sequence != 0 && fb->sequence != cursor->next_sequence) {
+                cursor->skipped += fb->sequence - cursor->next_sequence;
+                metric_add(in->m_skipped, fb->sequence - cursor->next_sequence);
+            }
+            cursor->next_sequence = fb->sequence + 1;
+        }
+    }
+    pthread_mutex_unlock(&in->db);
+
+    return fb;
+}
+
+/* upper bucket bounds of latency histograms in microseconds, plus +Inf */
+static const long long metric_bounds_us[] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000
+};
+#define METRIC_BUCKETS LENGTH_OF(metric_bounds_us)
+
+enum { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM };
+
+struct _metric {
+    char *name;
+    char *labels;                    /* prometheus form: key="value",... */
+    char *help;
+    int type;
+    long long value;                 /* counter, gauge */
+    long long sum;                   /* histogram sum in microseconds */
+    unsigned long long buckets[METRIC_BUCKETS + 1];
+    struct _metric *next;
+};
+
+/* append-only list, readers walk it without locking */
+static struct _metric *metrics_head = NULL;
+static struct _metric **metrics_tail = &metrics_head;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/******************************************************************************
+Description.: current time of the monotonic clock
+Input Value.: -
+Return Value: microseconds
+******************************************************************************/
+long long time_monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/******************************************************************************
+Description.: Keep the unsent part of a TCP send queue small. The socket only
+              polls writable while less than bytes are waiting to be sent,
+              a stream that writes its next frame when the socket becomes
+              writable never has more than one frame queued in the kernel.
+Input Value.: fd: connected TCP socket
+              bytes: TCP_NOTSENT_LOWAT
+Return Value: 0 on success, -1 if the system does not support it
+******************************************************************************/
+int socket_notsent_lowat(int fd, int bytes)
+{
+#ifdef TCP_NOTSENT_LOWAT
+    return setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes));
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/******************************************************************************
+Description.: bytes of a TCP send queue that did not go out yet, the bytes
+              sent and waiting for their acknowledgement do not count
+Input Value.: fd: connected TCP socket
+Return Value: bytes or -1 if the system does not tell
+******************************************************************************/
+int socket_notsent(int fd)
+{
+#ifdef SIOCOUTQNSD
+    int bytes;
+
+    if(ioctl(fd, SIOCOUTQNSD, &bytes) == 0)
+        return bytes;
+#endif
+    return -1;
+}
+
+/******************************************************************************
+Description.: find or add a metric
+Input Value.: type: METRIC_*
+              name: metric name, e.g. mjpg_input_frames_total
+              labels: prometheus label list without braces or NULL
+              help: one line description
+Return Value: metric or NULL if out of memory
+******************************************************************************/
+static struct _metric *metric_register(int type, const char *name, const char *labels, const char *help)
+{
+    struct _metric *m;
+
+    if(labels == NULL)
+        labels = "";
+
+    pthread_mutex_lock(&metrics_lock);
+    for(m = metrics_head; m != NULL; m = m->next) {
+        if(strcmp(m->name, name) == 0 && strcmp(m->labels, labels) == 0) {
+            pthread_mutex_unlock(&metrics_lock);
+            return m;
+        }
+    }
+
+    m = calloc(1, sizeof(struct _metric));
+    if(m != NULL) {
+        m->name = strdup(name);
+        m->labels = strdup(labels);
+        m->help = strdup(help != NULL ? help : "");
+        m->type = type;
+        if(m->name == NULL || m->labels == NULL || m->help == NULL) {
+            free(m->name);
+            free(m->labels);
+            free(m->help);
+            free(m);
+            m = NULL;
+        } else {
+            __atomic_store_n(metrics_tail, m, __ATOMIC_RELEASE);
+            metrics_tail = &m->next;
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+
+    return m;
+}
+
+/******************************************************************************
+Description.: register a monotonically increasing counter. Registering the
+              same name and labels again returns the existing metric, so
+              plugins can look metrics up instead of keeping pointers.
+Input Value.: name, labels (may be NULL), help
+Return Value: metric or NULL, every update function accepts NULL
+******************************************************************************/
+struct _metric *metric_counter(const char *name, const char *labels, const char *help)
+{
+    return metric_register(METRIC_COUNTER, name, labels, help);
+}
+
+/******************************************************************************
+Description.: register a value that can go up and down
+Input Value.: name, labels (may be NULL), help
+Return Value: metric or NULL
+******************************************************************************/
+struct _metric *metric_gauge(const char *name, const char *labels, const char *help)
+{
+    return metric_register(METRIC_GAUGE, name, labels, help);
+}
+
+/******************************************************************************
+Description.: register a latency histogram, observations are microseconds and
+              exported in seconds
+Input Value.: name, labels (may be NULL), help
+Return Value: metric or NULL
+******************************************************************************/
+struct _metric *metric_histogram(const char *name, const char *labels, const char *help)
+{
+    return metric_register(METRIC_HISTOGRAM, name, labels, help);
+}
+
+/******************************************************************************
+Description.: add to a counter or gauge
+Input Value.: m: metric, may be NULL
+              value: amount to add, negative for gauges going down
+Return Value: -
+******************************************************************************/
+void metric_add(struct _metric *m, long long value)
+{
+    if(m != NULL)
+        __atomic_add_fetch(&m->value, value, __ATOMIC_RELAXED);
+}
+
+/******************************************************************************
+Description.: set a gauge
+Input Value.: m: metric, may be NULL
+              value: new value
+Return Value: -
+******************************************************************************/
+void metric_set(struct _metric *m, long long value)
+{
+    if(m != NULL)
+        __atomic_store_n(&m->value, value, __ATOMIC_RELAXED);
+}
+
+/******************************************************************************
+Description.: record one observation in a histogram
+Input Value.: m: metric, may be NULL
+              us: observed duration in microseconds
+Return Value: -
+******************************************************************************/
+void metric_observe_us(struct _metric *m, long long us)
+{
+    size_t i;
+
+    if(m == NULL)
+        return;
+
+    for(i = 0; i < METRIC_BUCKETS && us > metric_bounds_us[i]; i++);
+    __atomic_add_fetch(&m->buckets[i], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->sum, us, __ATOMIC_RELAXED);
+}
+
+/* growable text buffer for metrics_format() */
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+    int failed;
+} text_buffer;
+
+static void text_printf(text_buffer *tb, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    while(!tb->failed) {
+        va_start(ap, fmt);
+        n = vsnprintf(tb->data + tb->length, tb->capacity - tb->length, fmt, ap);
+        va_end(ap);
+        if(n < 0) {
+            tb->failed = 1;
+        } else if((size_t)n < tb->capacity - tb->length) {
+            tb->length += n;
+            return;
+        } else {
+            size_t capacity = tb->capacity * 2 + n;
+            char *data = realloc(tb->data, capacity);
+            if(data == NULL) {
+                tb->failed = 1;
+            } else {
+                tb->data = data;
+                tb->capacity = capacity;
+            }
+        }
+    }
+}
+
+/* key="value",... -> {"key":"value",...} */
+static void text_labels_json(text_buffer *tb, const char *labels)
+{
+    const char *p = labels;
+    int in_value = 0;
+
+    text_printf(tb, "{");
+    if(*p != '\0')
+        text_printf(tb, "\"");
+    for(; *p != '\0'; p++) {
+        if(*p == '"') {
+            in_value = !in_value;
+            text_printf(tb, "\"");
+        } else if(!in_value && *p == '=') {
+            text_printf(tb, "\":");
+        } else if(!in_value && *p == ',') {
+            text_printf(tb, ",\"");
+        } else {
+            text_printf(tb, "%c", *p);
+        }
+    }
+    text_printf(tb, "}");
+}
+
+static void text_metric_prometheus(text_buffer *tb, struct _metric *m)
+{
+    const char *sep = m->labels[0] != '\0' ? "," : "";
+    unsigned long long count = 0;
+    size_t i;
+
+    if(m->type != METRIC_HISTOGRAM) {
+        text_printf(tb, "%s%s%s%s %lld\n", m->name, m->labels[0] ? "{" : "", m->labels,
+                    m->labels[0] ? "}" : "", __atomic_load_n(&m->value, __ATOMIC_RELAXED));
+        return;
+    }
+
+    for(i = 0; i <= METRIC_BUCKETS; i++) {
+        count += __atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED);
+        if(i < METRIC_BUCKETS)
+            text_printf(tb, "%s_bucket{%s%sle=\"%g\"} %llu\n", m->name, m->labels, sep,
+                        metric_bounds_us[i] / 1e6, count);
+        else
+            text_printf(tb, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", m->name, m->labels, sep, count);
+    }
+    text_printf(tb, "%s_sum%s%s%s %.6f\n", m->name, m->labels[0] ? "{" : "", m->labels,
+                m->labels[0] ? "}" : "", __atomic_load_n(&m->sum, __ATOMIC_RELAXED) / 1e6);
+    text_printf(tb, "%s_count%s%s%s %llu\n", m->name, m->labels[0] ? "{" : "", m->labels,
+                m->labels[0] ? "}" : "", count);
+}
+
+static void text_metric_json(text_buffer *tb, struct _metric *m)
+{
+    static const char *types[] = {"counter", "gauge", "histogram"};
+    unsigned long long count = 0;
+    size_t i;
+
+    text_printf(tb, "{\"name\":\"%s\",\"type\":\"%s\",\"labels\":", m->name, types[m->type]);
+    text_labels_json(tb, m->labels);
+
+    if(m->type != METRIC_HISTOGRAM) {
+        text_printf(tb, ",\"value\":%lld}", __atomic_load_n(&m->value, __ATOMIC_RELAXED));
+        return;
+    }
+
+    text_printf(tb, ",\"buckets\":[");
+    for(i = 0; i <= METRIC_BUCKETS; i++) {
+        count += __atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED);
+        if(i < METRIC_BUCKETS)
+            text_printf(tb, "%s{\"le_us\":%lld,\"count\":%llu}", i ? "," : "", metric_bounds_us[i], count);
+        else
+            text_printf(tb, ",{\"le_us\":null,\"count\":%llu}", count);
+    }
+    text_printf(tb, "],\"sum_us\":%lld,\"count\":%llu}", __atomic_load_n(&m->sum, __ATOMIC_RELAXED), count);
+}
+
+/******************************************************************************
+Description.: render all registered metrics, metrics of the same name are
+              grouped under one HELP/TYPE header
+Input Value.: json: 0 for prometheus text format, 1 for JSON
+              length: receives the text length, may be NULL
+Return Value: malloc'ed text the caller frees, or NULL if out of memory
+******************************************************************************/
+char *metrics_format(int json, size_t *length)
+{
+    static const char *types[] = {"counter", "gauge", "histogram"};
+    text_buffer tb = {NULL, 0, 0, 0};
+    struct _metric *head, *m, *o, *prev;
+    int first = 1;
+
+    tb.capacity = 4096;
+    tb.data = malloc(tb.capacity);
+    if(tb.data == NULL)
+        return NULL;
+    tb.data[0] = '\0';
+
+    if(json)
+        text_printf(&tb, "{\"metrics\":[");
+
+    head = __atomic_load_n(&metrics_head, __ATOMIC_ACQUIRE);
+    for(m = head; m != NULL; m = __atomic_load_n(&m->next, __ATOMIC_ACQUIRE)) {
+        /* skip names already printed with an earlier metric */
+        for(prev = head; prev != m && strcmp(prev->name, m->name) != 0; prev = prev->next);
+        if(prev != m)
+            continue;
+
+        if(!json)
+            text_printf(&tb, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, types[m->type]);
+
+        for(o = m; o != NULL; o = __atomic_load_n(&o->next, __ATOMIC_ACQUIRE)) {
+            if(strcmp(o->name, m->name) != 0)
+                continue;
+            if(json) {
+                text_printf(&tb, "%s", first ? "" : ",");
+                text_metric_json(&tb, o);
+                first = 0;
+            } else {
+                text_metric_prometheus(&tb, o);
+            }
+        }
+    }
+
+    if(json)
+        text_printf(&tb, "]}\n");
+
+    if(tb.failed) {
+        free(tb.data);
+        return NULL;
+    }
+    if(length != NULL)
+        *length = tb.length;
+    return tb.data;
+}
+
+/* consumer of frames whose stage latencies are recorded */
+struct _latency {
+    char *consumer;
+    int input;
+    int id;                          /* trace thread id, 0 is unused */
+    struct _metric *wakeup;          /* capture -> consumer wakeup */
+    struct _metric *sent;            /* consumer wakeup -> written */
+    struct _latency *next;
+};
+
+/* stage timestamps of one delivered frame, kept for the trace dump */
+typedef struct {
+    const struct _latency *consumer;
+    unsigned int sequence;
+    long long capture_us;
+    long long publish_us;
+    long long wakeup_us;
+    long long sent_us;
+} latency_event;
+
+static struct _latency *latency_head = NULL;
+static int latency_count = 0;
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ring of the latest events, only allocated when tracing is enabled */
+static latency_event *trace_events = NULL;
+static int trace_size = 0;
+static unsigned long long trace_count = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/******************************************************************************
+Description.: register a frame consumer, e.g. an output plugin, for latency
+              histograms. Registering the same consumer and input again
+              returns the existing entry.
+Input Value.: consumer: short name like "http:8080"
+              input: input number the consumer reads from
+Return Value: consumer or NULL if out of memory, latency_record() accepts NULL
+******************************************************************************/
+struct _latency *latency_register(const char *consumer, int input)
+{
+    struct _latency *l;
+    char labels[128];
+
+    pthread_mutex_lock(&latency_lock);
+    for(l = latency_head; l != NULL; l = l->next) {
+        if(l->input == input && strcmp(l->consumer, consumer) == 0) {
+            pthread_mutex_unlock(&latency_lock);
+            return l;
+        }
+    }
+
+    l = calloc(1, sizeof(struct _latency));
+    if(l != NULL && (l->consumer = strdup(consumer)) == NULL) {
+        free(l);
+        l = NULL;
+    }
+    if(l != NULL) {
+        snprintf(labels, sizeof(labels), "consumer=\"%s\",input=\"%d\"", consumer, input);
+        l->input = input;
+        l->id = ++latency_count;
+        l->wakeup = metric_histogram("mjpg_frame_capture_to_wakeup_seconds", labels,
+                                     "Time from capture until a consumer picked the frame up");
+        l->sent = metric_histogram("mjpg_frame_wakeup_to_sent_seconds", labels,
+                                   "Time from consumer wakeup until the frame was written");
+        l->next = latency_head;
+        __atomic_store_n(&latency_head, l, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&latency_lock);
+
+    return l;
+}
+
+/******************************************************************************
+Description.: record the stages of one delivered frame
+Input Value.: l: consumer, may be NULL
+              fb: delivered frame
+              wakeup_us: time_monotonic_us() when the consumer got the frame
+              sent_us: time_monotonic_us() after the last write of the frame
+Return Value: -
+******************************************************************************/
+void latency_record(struct _latency *l, const frame_buffer *fb, long long wakeup_us, long long sent_us)
+{
+    latency_event *e;
+
+    if(l == NULL || fb == NULL)
+        return;
+
+    metric_observe_us(l->wakeup, wakeup_us - fb->capture_us);
+    metric_observe_us(l->sent, sent_us - wakeup_us);
+
+    if(trace_size == 0)
+        return;
+
+    pthread_mutex_lock(&trace_lock);
+    e = &trace_events[trace_count++ % trace_size];
+    e->consumer = l;
+    e->sequence = fb->sequence;
+    e->capture_us = fb->capture_us;
+    e->publish_us = fb->publish_us;
+    e->wakeup_us = wakeup_us;
+    e->sent_us = sent_us;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/******************************************************************************
+Description.: keep the stage timestamps of the latest frames for the trace
+              dump, call it once before the plugins start
+Input Value.: events: number of delivered frames to keep
+Return Value: 0 on success, -1 on error
+******************************************************************************/
+int latency_trace_init(int events)
+{
+    if(events <= 0 || trace_events != NULL)
+        return -1;
+
+    trace_events = calloc(events, sizeof(latency_event));
+    if(trace_events == NULL)
+        return -1;
+    trace_size = events;
+    return 0;
+}
+
+/* estimate a quantile from the buckets, interpolating inside the bucket */
+static long long metric_quantile_us(struct _metric *m, unsigned long long count, double q)
+{
+    unsigned long long seen = 0, n;
+    double rank = q * count;
+    long long lower = 0;
+    size_t i;
+
+    for(i = 0; i < METRIC_BUCKETS; i++) {
+        n = __atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED);
+        if(n > 0 && seen + n >= rank)
+            return lower + (long long)((metric_bounds_us[i] - lower) * ((rank - seen) / n));
+        seen += n;
+        lower = metric_bounds_us[i];
+    }
+    return metric_bounds_us[METRIC_BUCKETS - 1];
+}
+
+/******************************************************************************
+Description.: summarize the frame stage histograms (mjpg_frame_*) as JSON,
+              quantiles are estimated from the histogram buckets
+Input Value.: length: receives the text length, may be NULL
+Return Value: malloc'ed text the caller frees, or NULL if out of memory
+******************************************************************************/
+char *latency_format(size_t *length)
+{
+    text_buffer tb = {NULL, 0, 4096, 0};
+    struct _metric *m;
+    unsigned long long count;
+    int first = 1;
+    size_t i;
+
+    tb.data = malloc(tb.capacity);
+    if(tb.data == NULL)
+        return NULL;
+
+    text_printf(&tb, "{\"stages\":[");
+    for(m = __atomic_load_n(&metrics_head, __ATOMIC_ACQUIRE); m != NULL;
+        m = __atomic_load_n(&m->next, __ATOMIC_ACQUIRE)) {
+        if(m->type != METRIC_HISTOGRAM || strncmp(m->name, "mjpg_frame_", 11) != 0)
+            continue;
+
+        count = 0;
+        for(i = 0; i <= METRIC_BUCKETS; i++)
+            count += __atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED);
+
+        /* mjpg_frame_capture_to_wakeup_seconds -> capture_to_wakeup */
+        text_printf(&tb, "%s{\"stage\":\"%.*s\",\"labels\":", first ? "" : ",",
+                    (int)(strlen(m->name) - 11 - 8), m->name + 11);
+        text_labels_json(&tb, m->labels);
+        text_printf(&tb, ",\"count\":%llu", count);
+        if(count > 0)
+            text_printf(&tb, ",\"mean_us\":%lld,\"p50_us\":%lld,\"p90_us\":%lld,\"p99_us\":%lld}",
+                        __atomic_load_n(&m->sum, __ATOMIC_RELAXED) / (long long)count,
+                        metric_quantile_us(m, count, 0.5), metric_quantile_us(m, count, 0.9),
+                        metric_quantile_us(m, count, 0.99));
+        else
+            text_printf(&tb, "}");
+        first = 0;
+    }
+    text_printf(&tb, "],\"trace_events\":%d}\n", trace_size);
+
+    if(tb.failed) {
+        free(tb.data);
+        return NULL;
+    }
+    if(length != NULL)
+        *length = tb.length;
+    return tb.data;
+}
+
+/******************************************************************************
+Description.: dump the latest delivered frames in the Chrome trace event
+              format (chrome://tracing, Perfetto). Every consumer is a thread
+              of the process named after its input, each frame shows as the
+              slices capture, queued and send.
+Input Value.: length: receives the text length, may be NULL
+Return Value: malloc'ed text the caller frees, or NULL if out of memory
+******************************************************************************/
+char *latency_trace_format(size_t *length)
+{
+    text_buffer tb = {NULL, 0, 4096, 0};
+    struct _latency *l;
+    latency_event *copy = NULL;
+    unsigned long long i, count = 0, from;
+    int first = 1;
+
+    if(trace_size > 0) {
+        copy = malloc(trace_size * sizeof(latency_event));
+        if(copy == NULL)
+            return NULL;
+        pthread_mutex_lock(&trace_lock);
+        memcpy(copy, trace_events, trace_size * sizeof(latency_event));
+        count = trace_count;
+        pthread_mutex_unlock(&trace_lock);
+    }
+
+    tb.data = malloc(tb.capacity);
+    if(tb.data == NULL) {
+        free(copy);
+        return NULL;
+    }
+
+    text_printf(&tb, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for(l = __atomic_load_n(&latency_head, __ATOMIC_ACQUIRE); l != NULL; l = l->next) {
+        text_printf(&tb, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"input %d\"}}",
+                    first ? "" : ",", l->input, l->input);
+        text_printf(&tb, ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    l->input, l->id, l->consumer);
+        first = 0;
+    }
+
+    from = count > (unsigned long long)trace_size ? count - trace_size : 0;
+    for(i = from; i < count; i++) {
+        latency_event *e = &copy[i % trace_size];
+        int pid = e->consumer->input, tid = e->consumer->id;
+
+        text_printf(&tb, "%s{\"name\":\"capture\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,"
+                    "\"args\":{\"sequence\":%u}}", first ? "" : ",", pid, tid,
+                    e->capture_us, e->publish_us - e->capture_us, e->sequence);
+        text_printf(&tb, ",{\"name\":\"queued\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld}",
+                    pid, tid, e->publish_us, e->wakeup_us - e->publish_us);
+        text_printf(&tb, ",{\"name\":\"send\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld}",
+                    pid, tid, e->wakeup_us, e->sent_us - e->wakeup_us);
+        first = 0;
+    }
+    text_printf(&tb, "]}\n");
+    free(copy);
+
+    if(tb.failed) {
+        free(tb.data);
+        return NULL;
+    }
+    if(length != NULL)
+        *length = tb.length;
+    return tb.data;
+}
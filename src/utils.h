@@ -153,3 +153,52 @@ int calculate_wait_timeout(void *in_ptr, struct timespec *timeout);
 /* Wait for a fresh frame; returns 1 with mutex held, 0 on timeout (mutex unlocked) */
 int wait_for_fresh_frame(void *in_ptr, unsigned int *last_sequence);
 
+/* Refcounted frames, see struct _frame_buffer in plugins/input.h */
+struct _input;
+struct _frame_buffer;
+struct _frame_cursor;
+struct _frame_meta;
+struct timeval;
+int input_frames_init(struct _input *in, int id, int ring_depth);
+int input_frames_init_labels(struct _input *in, const char *labels, int ring_depth);
+void input_frames_cleanup(struct _input *in);
+void input_frames_release(struct _input *in);
+struct _frame_buffer *input_frame_acquire(struct _input *in, size_t capacity);
+void input_frame_publish(struct _input *in, struct _frame_buffer *fb, int size, struct timeval *timestamp);
+struct _frame_buffer *input_frame_ref(struct _frame_buffer *fb);
+void input_frame_put(struct _frame_buffer *fb);
+struct _frame_buffer *input_frame_get(struct _input *in);
+struct _frame_buffer *input_frame_wait(struct _input *in, unsigned int *last_sequence, int timeout_ms);
+struct _frame_buffer *input_frame_next(struct _input *in, struct _frame_cursor *cursor, int timeout_ms);
+const unsigned char *input_frame_plane(struct _frame_buffer *fb, int scale, int pixfmt, int *width, int *height);
+const unsigned char *input_frame_variant(struct _frame_buffer *fb, int scale, int quality, size_t *size);
+int input_frame_subscribe(struct _input *in);
+void input_frame_unsubscribe(struct _input *in, int fd);
+void input_frame_drain(int fd);
+void input_meta_write(struct _input *in, const struct _frame_meta *meta);
+void input_meta_read(struct _input *in, struct _frame_meta *meta);
+int frame_rate_take(long long *next_us, long long interval_us, const struct _frame_buffer *fb);
+
+/* Metrics registry, see metric_counter(). Metrics live for the whole process
+ * and are updated with atomic operations, hot paths never take a lock. */
+struct _metric;
+struct _metric *metric_counter(const char *name, const char *labels, const char *help);
+struct _metric *metric_gauge(const char *name, const char *labels, const char *help);
+struct _metric *metric_histogram(const char *name, const char *labels, const char *help);
+void metric_add(struct _metric *m, long long value);
+void metric_set(struct _metric *m, long long value);
+void metric_observe_us(struct _metric *m, long long us);
+char *metrics_format(int json, size_t *length);
+long long time_monotonic_us(void);
+
+/* Bounded TCP send queues for live streams, see socket_notsent_lowat() */
+int socket_notsent_lowat(int fd, int bytes);
+int socket_notsent(int fd);
+
+/* Per-frame latency from capture to socket write, see latency_register() */
+struct _latency;
+struct _latency *latency_register(const char *consumer, int input);
+void latency_record(struct _latency *l, const struct _frame_buffer *fb, long long wakeup_us, long long sent_us);
+int latency_trace_init(int events);
+char *latency_format(size_t *length);
+char *latency_trace_format(size_t *length);